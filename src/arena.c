@@ -0,0 +1,48 @@
+#include "arena.h"
+
+#include <stdlib.h>
+
+#define ARENA_MIN_BLOCK_SIZE 4096
+
+void arena_init(Arena *arena, size_t block_size) {
+    arena->head = NULL;
+    arena->block_size = block_size < ARENA_MIN_BLOCK_SIZE ? ARENA_MIN_BLOCK_SIZE : block_size;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    // Round up so every allocation stays max-aligned
+    size_t align = sizeof(max_align_t);
+    size = (size + align - 1) & ~(align - 1);
+
+    ArenaBlock *block = arena->head;
+    if (block == NULL || block->capacity - block->used < size) {
+        size_t capacity = arena->block_size;
+        while (capacity < size) {
+            capacity *= 2;
+        }
+
+        block = malloc(sizeof(ArenaBlock) + capacity);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = arena->head;
+        block->capacity = capacity;
+        block->used = 0;
+        arena->head = block;
+        arena->block_size = capacity * 2;
+    }
+
+    void *ptr = (char *)block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->head;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
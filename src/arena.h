@@ -0,0 +1,29 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// A block of arena memory, blocks are chained so earlier allocations never move
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t capacity;
+    size_t used;
+    max_align_t data[];
+} ArenaBlock;
+
+// Bump allocator: allocations are carved out of large blocks and released all at once
+typedef struct Arena {
+    ArenaBlock *head;
+    size_t block_size; // Size of the next block to allocate, doubles as blocks are added
+} Arena;
+
+// prepares an empty arena whose first block will hold at least 'block_size' bytes
+void arena_init(Arena *arena, size_t block_size);
+
+// returns 'size' bytes of max-aligned memory, NULL if the system is out of memory
+void *arena_alloc(Arena *arena, size_t size);
+
+// releases every allocation made from the arena at once
+void arena_free(Arena *arena);
+
+#endif // ARENA_H
@@ -0,0 +1,818 @@
+#define _GNU_SOURCE // ppoll
+#include "bench.h"
+#include "bencode.h"
+#include "bitfield.h"
+#include "decode.h"
+#include "info.h"
+#include "ingest.h"
+#include "metacache.h"
+#include "peer.h"
+#include "picker.h"
+#include "reactor.h"
+#include "recheck.h"
+#include "sha1.h"
+#include "sha1_multi.h"
+#include "sink.h"
+#include "storage.h"
+#include "tape.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <limits.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define SYNTHETIC_PIECE_LENGTH (256 * 1024)
+
+// Write a dict key, keys here are plain text
+static void write_key(BencodeWriter *writer, const char *key) {
+    bencode_write_string(writer, key, strlen(key));
+}
+
+// A multi-file torrent with 'num_files' files sharing 'num_pieces' pieces of 256 KiB (made-up hashes),
+// standing in for the big ones. returns the bencoded bytes (heap) and sets 'length', NULL if out of memory
+static char *synthetic_torrent(size_t num_files, size_t num_pieces, size_t *length) {
+    char *pieces = malloc(num_pieces * 20 + 1);
+    if (pieces == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < num_pieces * 20; i++) {
+        pieces[i] = (char)(i * 2654435761u >> 13);
+    }
+
+    Buffer buffer = {0};
+    BencodeWriter writer;
+    size_t total = num_pieces * SYNTHETIC_PIECE_LENGTH;
+    bencode_writer_init(&writer, buffer_sink(&buffer));
+    bencode_write_dict_start(&writer);
+    write_key(&writer, "announce");
+    write_key(&writer, "http://localhost");
+    write_key(&writer, "info");
+    bencode_write_dict_start(&writer);
+    write_key(&writer, "files");
+    bencode_write_list_start(&writer);
+    for (size_t i = 0; i < num_files; i++) {
+        char name[32];
+        int name_length = snprintf(name, sizeof(name), "file-%zu", i);
+        bencode_write_dict_start(&writer);
+        write_key(&writer, "length");
+        bencode_write_int(&writer, i + 1 < num_files ? total / num_files : total - (num_files - 1) * (total / num_files));
+        write_key(&writer, "path");
+        bencode_write_list_start(&writer);
+        write_key(&writer, "dir");
+        bencode_write_string(&writer, name, name_length);
+        bencode_write_end(&writer);
+        bencode_write_end(&writer);
+    }
+    bencode_write_end(&writer);
+    write_key(&writer, "name");
+    write_key(&writer, "bench");
+    write_key(&writer, "piece length");
+    bencode_write_int(&writer, SYNTHETIC_PIECE_LENGTH);
+    write_key(&writer, "pieces");
+    bencode_write_string(&writer, pieces, num_pieces * 20);
+    bencode_write_end(&writer);
+    bencode_write_end(&writer);
+    free(pieces);
+
+    if (bencode_writer_finish(&writer) < 0) {
+        buffer_free(&buffer);
+        return NULL;
+    }
+    *length = buffer.length;
+    return buffer.data;
+}
+
+// The 'pieces' payload of a torrent made by synthetic_torrent, where made-up hashes can be replaced
+static char *synthetic_pieces(char *torrent) {
+    return strchr(strstr(torrent, "6:pieces") + 8, ':') + 1;
+}
+
+// Bencoded torrents of 1 to 16 times 1.2 MB (50k pieces and 5k files per step), so time per byte shows whether
+// decoding stays linear
+int bench_decode(void) {
+    printf("%8s %10s %10s %10s %10s\n", "MB", "copy ms", "view ms", "copy MB/s", "view MB/s");
+    for (size_t scale = 1; scale <= 16; scale *= 2) {
+        size_t length;
+        char *torrent = synthetic_torrent(5000 * scale, 50000 * scale, &length);
+        if (torrent == NULL) {
+            perror("Failed to build the benchmark torrent");
+            return 1;
+        }
+        // Best of a few rounds, the first one also pays for faulting the memory in
+        double copy = -1, view = -1;
+        for (int round = 0; round < 3; round++) {
+            DecodedValue decoded;
+            double start = now_seconds();
+            if (decode_bencode_buffer(torrent, length, &decoded) == 0) {
+                fprintf(stderr, "Failed to decode the benchmark torrent: %s\n", bencode_error());
+                free(torrent);
+                return 1;
+            }
+            double seconds = now_seconds() - start;
+            free_decoded_value(decoded);
+            if (copy < 0 || seconds < copy) copy = seconds;
+
+            BencodeDocument document;
+            start = now_seconds();
+            if (decode_bencode_document(torrent, length, DECODE_MODE_VIEW, &document) == 0) {
+                fprintf(stderr, "Failed to decode the benchmark torrent: %s\n", bencode_error());
+                free(torrent);
+                return 1;
+            }
+            seconds = now_seconds() - start;
+            free_bencode_document(&document);
+            if (view < 0 || seconds < view) view = seconds;
+        }
+        printf("%8.1f %10.2f %10.2f %10.0f %10.0f\n", length / 1e6, copy * 1e3, view * 1e3, length / copy / 1e6, length / view / 1e6);
+        free(torrent);
+    }
+    return 0;
+}
+
+// Renders a torrent into a sink, one of the renderers below
+typedef int (*Renderer)(const void *value, Sink sink);
+
+static int render_info_text(const void *value, Sink sink) { return render_meta_info(*(const MetaInfo *)value, sink); }
+static int render_info_json(const void *value, Sink sink) { return render_meta_info_json(*(const MetaInfo *)value, sink); }
+static int render_tree_text(const void *value, Sink sink) { return render_decoded_value(*(const DecodedValue *)value, sink); }
+static int render_tree_json(const void *value, Sink sink) { return render_decoded_value_json(*(const DecodedValue *)value, sink); }
+
+// Meta info and the raw decoded tree of a 200k-piece torrent rendered as text and JSON, best of 5
+int bench_render(void) {
+    size_t length;
+    char *torrent = synthetic_torrent(1000, 200000, &length);
+    if (torrent == NULL) {
+        perror("Failed to build the benchmark torrent");
+        return 1;
+    }
+    MetaInfo info;
+    BencodeDocument document;
+    if (info_extract(torrent, length, &info) < 0) {
+        fprintf(stderr, "Failed to parse the benchmark torrent: %s\n", info_error());
+        free(torrent);
+        return 1;
+    }
+    if (decode_bencode_document(torrent, length, DECODE_MODE_VIEW, &document) == 0) {
+        fprintf(stderr, "Failed to decode the benchmark torrent: %s\n", bencode_error());
+        free_info(info);
+        free(torrent);
+        return 1;
+    }
+
+    const struct { const char *label; Renderer render; const void *value; } cases[] = {
+        { "info text", render_info_text, &info },
+        { "info json", render_info_json, &info },
+        { "tree text", render_tree_text, &document.root },
+        { "tree json", render_tree_json, &document.root },
+    };
+    int status = 0;
+    printf("%zu pieces, %zu files\n", info.num_pieces, info.num_files);
+    printf("%10s %10s %10s %10s\n", "render", "MB out", "ms", "MB/s");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]) && status == 0; i++) {
+        double best = -1;
+        size_t output = 0;
+        for (int round = 0; round < 5; round++) {
+            Buffer text = {0};
+            double start = now_seconds();
+            int rendered = cases[i].render(cases[i].value, buffer_sink(&text));
+            double seconds = now_seconds() - start;
+            output = text.length;
+            buffer_free(&text);
+            if (rendered < 0) {
+                fprintf(stderr, "Failed to render %s\n", cases[i].label);
+                status = 1;
+                break;
+            }
+            if (best < 0 || seconds < best) best = seconds;
+        }
+        if (status == 0) {
+            printf("%10s %10.1f %10.2f %10.0f\n", cases[i].label, output / 1e6, best * 1e3, output / best / 1e6);
+        }
+    }
+    free_bencode_document(&document);
+    free_info(info);
+    free(torrent);
+    return status;
+}
+
+#define CACHE_BENCH_TORRENTS 1000
+#define INGEST_BENCH_TORRENTS 2000
+
+// Remove a directory and the plain files in it
+static void remove_directory(const char *path) {
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    char file[PATH_MAX];
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 &&
+            snprintf(file, sizeof(file), "%s/%s", path, entry->d_name) < (int)sizeof(file)) {
+            unlink(file);
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    rmdir(path);
+}
+
+// Fill a fresh temp directory ('directory' is a mkdtemp template) with 'count' synthetic torrents named
+// tNNNN.torrent. they differ in their first piece hash, so each has its own info hash. returns 0 or -1
+static int write_torrent_directory(char *directory, int count, size_t num_files, size_t num_pieces, size_t *length) {
+    if (mkdtemp(directory) == NULL) {
+        perror("Failed to create the benchmark directory");
+        return -1;
+    }
+    char *torrent = synthetic_torrent(num_files, num_pieces, length);
+    if (torrent == NULL) {
+        perror("Failed to build the benchmark torrent");
+        return -1;
+    }
+    char *hashes = synthetic_pieces(torrent);
+    char path[PATH_MAX];
+    int status = 0;
+    for (int i = 0; i < count && status == 0; i++) {
+        memcpy(hashes, &i, sizeof(i));
+        snprintf(path, sizeof(path), "%s/t%04d.torrent", directory, i);
+        FILE *file = fopen(path, "wb");
+        if (file == NULL || fwrite(torrent, 1, *length, file) != *length) {
+            perror("Failed to write a benchmark torrent");
+            status = -1;
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+    }
+    free(torrent);
+    return status;
+}
+
+// Load every benchmark torrent once, returns the seconds it took or -1
+static double load_torrents(const char *directory) {
+    char path[PATH_MAX];
+    double start = now_seconds();
+    for (int i = 0; i < CACHE_BENCH_TORRENTS; i++) {
+        MetaInfo info;
+        snprintf(path, sizeof(path), "%s/t%04d.torrent", directory, i);
+        if (load_meta_info(path, &info) < 0) {
+            fprintf(stderr, "Failed to load %s: %s\n", path, info_error());
+            return -1;
+        }
+        free_info(info);
+    }
+    return now_seconds() - start;
+}
+
+// Start-up cost of 1,000 torrents (20 files, 2,000 pieces each): the first start parses every file and
+// writes the cache, the next ones only map cache entries. files are in the page cache for both
+int bench_cache(void) {
+    char directory[] = "/tmp/bittorrent-bench-XXXXXX";
+    char cache[PATH_MAX];
+    size_t length;
+    int status = write_torrent_directory(directory, CACHE_BENCH_TORRENTS, 20, 2000, &length) < 0 ? 1 : 0;
+    snprintf(cache, sizeof(cache), "%s/cache", directory);
+    setenv("BITTORRENT_CACHE_DIR", cache, 1);
+
+    printf("%d torrents of %.1f KB\n", CACHE_BENCH_TORRENTS, length / 1e3);
+    printf("%10s %10s %12s\n", "start", "ms", "torrents/s");
+    for (int round = 0; round < 3 && status == 0; round++) {
+        double seconds = load_torrents(directory);
+        if (seconds < 0) {
+            status = 1;
+            break;
+        }
+        printf("%10s %10.1f %12.0f\n", round == 0 ? "cold" : "cached", seconds * 1e3, CACHE_BENCH_TORRENTS / seconds);
+    }
+    remove_directory(cache);
+    remove_directory(directory);
+    return status;
+}
+
+// Directory load rate for 1, 2, 4, ... up to every online core, first with an empty metadata cache
+// (every file parsed and its cache entry written) and then with the entries in place
+int bench_ingest(void) {
+    char directory[] = "/tmp/bittorrent-bench-XXXXXX";
+    char cache[PATH_MAX];
+    size_t length;
+    int status = write_torrent_directory(directory, INGEST_BENCH_TORRENTS, 20, 500, &length) < 0 ? 1 : 0;
+    snprintf(cache, sizeof(cache), "%s/cache", directory);
+    setenv("BITTORRENT_CACHE_DIR", cache, 1);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("%d torrents of %.1f KB, %ld cores\n", INGEST_BENCH_TORRENTS, length / 1e3, cores);
+    printf("%8s %14s %14s\n", "threads", "parse files/s", "cached files/s");
+    for (long n = 1; status == 0 && n <= cores; n = (n * 2 > cores && n < cores) ? cores : n * 2) {
+        double rates[2];
+        remove_directory(cache);
+        for (int pass = 0; pass < 2 && status == 0; pass++) {
+            TorrentLibrary library;
+            if (ingest_directory(directory, n, &library) < 0) {
+                fprintf(stderr, "Failed to load %s: %s\n", directory, info_error());
+                status = 1;
+                break;
+            }
+            if ((size_t)library.count != INGEST_BENCH_TORRENTS) {
+                fprintf(stderr, "Loaded %zu of %d torrents\n", (size_t)library.count, INGEST_BENCH_TORRENTS);
+                status = 1;
+            }
+            rates[pass] = library_files_per_second(&library);
+            free_library(&library);
+        }
+        if (status == 0) {
+            printf("%8ld %14.0f %14.0f\n", n, rates[0], rates[1]);
+        }
+    }
+    remove_directory(cache);
+    remove_directory(directory);
+    return status;
+}
+
+#define RECHECK_BENCH_PIECES 512
+
+// Deterministic content of one synthetic piece
+static void fill_piece(char *data, size_t piece) {
+    for (size_t i = 0; i < SYNTHETIC_PIECE_LENGTH; i++) {
+        data[i] = (char)((i * 2654435761u >> 13) ^ piece);
+    }
+}
+
+// Recheck throughput of 128 MiB in 16 files (all pieces valid) for 1, 2, 4, ... up to every online core.
+// an untimed first run pulls the files into the page cache, so this measures hashing and not the disk
+int bench_recheck(void) {
+    size_t length;
+    char *torrent = synthetic_torrent(16, RECHECK_BENCH_PIECES, &length);
+    char *data = malloc(SYNTHETIC_PIECE_LENGTH);
+    if (torrent == NULL || data == NULL) {
+        perror("Failed to build the benchmark torrent");
+        free(torrent);
+        free(data);
+        return 1;
+    }
+    unsigned char *hashes = (unsigned char *)synthetic_pieces(torrent);
+    for (size_t piece = 0; piece < RECHECK_BENCH_PIECES; piece++) {
+        fill_piece(data, piece);
+        sha1_hash((unsigned char *)data, SYNTHETIC_PIECE_LENGTH, hashes + piece * SHA1_DIGEST_LENGTH);
+    }
+
+    MetaInfo info;
+    if (info_extract(torrent, length, &info) < 0) {
+        fprintf(stderr, "Failed to parse the benchmark torrent: %s\n", info_error());
+        free(torrent);
+        free(data);
+        return 1;
+    }
+    char directory[] = "/tmp/bittorrent-bench-XXXXXX";
+    Storage storage = {0};
+    int status = 0;
+    if (mkdtemp(directory) == NULL || storage_open(&storage, &info, directory) < 0) {
+        perror("Failed to create the benchmark files");
+        status = 1;
+    }
+    for (size_t piece = 0; piece < RECHECK_BENCH_PIECES && status == 0; piece++) {
+        fill_piece(data, piece);
+        if (storage_write_piece(&storage, piece, data, SYNTHETIC_PIECE_LENGTH) < 0) {
+            perror("Failed to write the benchmark files");
+            status = 1;
+        }
+    }
+    storage_close(&storage);
+    free(data);
+
+    Recheck recheck;
+    if (status == 0 && recheck_files(&recheck, &info, directory, 0) == 0) {
+        if (recheck.pieces_valid != RECHECK_BENCH_PIECES) {
+            fprintf(stderr, "Only %zu of %d pieces verified\n", (size_t)recheck.pieces_valid, RECHECK_BENCH_PIECES);
+            status = 1;
+        }
+        recheck_free(&recheck);
+    } else if (status == 0) {
+        fprintf(stderr, "Recheck failed: %s\n", info_error());
+        status = 1;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    double baseline = 0;
+    printf("%.0f MiB, sha1 engine %s, %ld cores\n", info.length / 1048576.0, sha1_engine_name(sha1_engine_active()), cores);
+    printf("%8s %10s %8s\n", "threads", "MB/s", "speedup");
+    for (long n = 1; status == 0 && n <= cores; n = (n * 2 > cores && n < cores) ? cores : n * 2) {
+        if (recheck_files(&recheck, &info, directory, n) < 0) {
+            fprintf(stderr, "Recheck failed: %s\n", info_error());
+            status = 1;
+            break;
+        }
+        double rate = recheck_bytes_per_second(&recheck) / 1e6;
+        if (baseline == 0) baseline = rate;
+        printf("%8d %10.1f %7.2fx\n", recheck.threads, rate, rate / baseline);
+        recheck_free(&recheck);
+    }
+
+    char files[PATH_MAX];
+    snprintf(files, sizeof(files), "%s/dir", directory);
+    remove_directory(files);
+    remove_directory(directory);
+    free_info(info);
+    free(torrent);
+    return status;
+}
+
+// Best of 'rounds' timings of one tape operation, -1 when it fails
+static double time_tape(const char *torrent, size_t length, bool materialize, int rounds) {
+    double best = -1;
+    for (int round = 0; round < rounds; round++) {
+        BencodeTape tape;
+        BencodeDocument document;
+        double start = now_seconds();
+        if (tape_build(&tape, torrent, length) == 0) {
+            fprintf(stderr, "Failed to index the benchmark torrent: %s\n", tape.error);
+            tape_free(&tape);
+            return -1;
+        }
+        if (materialize && tape_materialize(&tape, 0, DECODE_MODE_VIEW, &document) == 0) {
+            tape_free(&tape);
+            return -1;
+        }
+        double seconds = now_seconds() - start;
+        if (materialize) {
+            free_bencode_document(&document);
+        }
+        tape_free(&tape);
+        if (best < 0 || seconds < best) best = seconds;
+    }
+    return best;
+}
+
+// Index, index + materialize and the plain view decode, on a torrent dominated by the pieces string
+// (few files) and on one dominated by the file list
+int bench_tape(void) {
+    const struct { const char *label; size_t files, pieces; } shapes[] = {
+        { "pieces", 100, 400000 },
+        { "files", 200000, 50000 },
+    };
+    printf("kernel: %s\n", tape_kernel_name());
+    printf("%8s %8s %10s %10s %10s\n", "shape", "MB", "tape GB/s", "+tree GB/s", "view GB/s");
+    for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+        size_t length;
+        char *torrent = synthetic_torrent(shapes[i].files, shapes[i].pieces, &length);
+        if (torrent == NULL) {
+            perror("Failed to build the benchmark torrent");
+            return 1;
+        }
+        double tape = time_tape(torrent, length, false, 5);
+        double tree = time_tape(torrent, length, true, 5);
+        double view = -1;
+        for (int round = 0; round < 5; round++) {
+            BencodeDocument document;
+            double start = now_seconds();
+            if (decode_bencode_document(torrent, length, DECODE_MODE_VIEW, &document) == 0) {
+                fprintf(stderr, "Failed to decode the benchmark torrent: %s\n", bencode_error());
+                break;
+            }
+            double seconds = now_seconds() - start;
+            free_bencode_document(&document);
+            if (view < 0 || seconds < view) view = seconds;
+        }
+        free(torrent);
+        if (tape < 0 || tree < 0 || view < 0) {
+            return 1;
+        }
+        printf("%8s %8.1f %10.2f %10.2f %10.2f\n", shapes[i].label, length / 1e6, length / tape / 1e9,
+               length / tree / 1e9, length / view / 1e9);
+    }
+    return 0;
+}
+
+// Pieces of 256 KiB, a common piece size, hashed 64 at a time as verify_pieces does
+#define BENCH_PIECE_LENGTH (256 * 1024)
+#define BENCH_PIECES 64
+#define BENCH_ROUNDS 8
+
+// Measures every SHA-1 engine this CPU can run and prints its throughput
+int bench_sha1(void) {
+    unsigned char *data = malloc((size_t)BENCH_PIECES * BENCH_PIECE_LENGTH);
+    if (data == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < (size_t)BENCH_PIECES * BENCH_PIECE_LENGTH; i++) {
+        data[i] = (unsigned char)(i * 2654435761u >> 11);
+    }
+    const unsigned char *pieces[BENCH_PIECES];
+    for (int i = 0; i < BENCH_PIECES; i++) {
+        pieces[i] = data + (size_t)i * BENCH_PIECE_LENGTH;
+    }
+
+    unsigned char hashes[BENCH_PIECES * SHA1_DIGEST_LENGTH];
+    unsigned char expected[BENCH_PIECES * SHA1_DIGEST_LENGTH];
+    sha1_hash_many_with(SHA1_ENGINE_OPENSSL, pieces, BENCH_PIECES, BENCH_PIECE_LENGTH, expected);
+
+    printf("%-12s %10s\n", "engine", "GB/s");
+    for (int engine = 0; engine < SHA1_ENGINE_COUNT; engine++) {
+        if (!sha1_engine_available(engine)) {
+            printf("%-12s %10s\n", sha1_engine_name(engine), "n/a");
+            continue;
+        }
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+            sha1_hash_many_with(engine, pieces, BENCH_PIECES, BENCH_PIECE_LENGTH, hashes);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        double bytes = (double)BENCH_ROUNDS * BENCH_PIECES * BENCH_PIECE_LENGTH;
+        printf("%-12s %10.2f%s%s\n", sha1_engine_name(engine), bytes / seconds / 1e9,
+               memcmp(hashes, expected, sizeof(hashes)) == 0 ? "" : "  MISMATCH",
+               engine == (int)sha1_engine_active() ? "  (active)" : "");
+    }
+    free(data);
+    return 0;
+}
+
+// The pipeline benchmark downloads 4 pieces of 256 KiB (64 blocks) through the reactor, from a fake peer on loopback
+#define PIPELINE_PIECE_LENGTH (256 * 1024)
+#define PIPELINE_PIECES 4
+#define FAKE_PEER_BACKLOG 256
+
+// A REQUEST the fake peer answers once its time has come
+typedef struct DelayedAnswer {
+    double due;
+    uint32_t index, begin, length;
+} DelayedAnswer;
+
+static int send_all(int fd, const void *data, size_t length) {
+    for (size_t sent = 0; sent < length;) {
+        ssize_t n = send(fd, (const char *)data + sent, length - sent, 0);
+        if (n <= 0) return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+// Seeds 'content' to the first connection on 'listener', answering every REQUEST 'rtt' seconds after it
+// came in (whatever else is pending), the way a peer one round trip away looks from here
+static void fake_peer(int listener, const char *content, size_t length, double rtt) {
+    int fd = accept(listener, NULL, NULL);
+    char handshake[PACKET_LENGTH];
+    int nodelay = 1;
+    if (fd < 0 || setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0 || recv(fd, handshake, PACKET_LENGTH, MSG_WAITALL) != PACKET_LENGTH || send_all(fd, handshake, PACKET_LENGTH) < 0) {
+        return;
+    }
+
+    size_t bitfield_length = (length / PIPELINE_PIECE_LENGTH + 7) / 8;
+    char bitfield[LENGTH_PREFIX_SIZE + 1 + 64];
+    uint32_t prefix = htonl(1 + bitfield_length);
+    memcpy(bitfield, &prefix, LENGTH_PREFIX_SIZE);
+    bitfield[LENGTH_PREFIX_SIZE] = BITFIELD;
+    memset(bitfield + LENGTH_PREFIX_SIZE + 1, 0xFF, bitfield_length);
+    char interested[LENGTH_PREFIX_SIZE + 1];
+    char unchoke[LENGTH_PREFIX_SIZE + 1] = { 0, 0, 0, 1, UNCHOKE };
+    if (send_all(fd, bitfield, LENGTH_PREFIX_SIZE + 1 + bitfield_length) < 0 ||
+        recv(fd, interested, sizeof(interested), MSG_WAITALL) != sizeof(interested) || send_all(fd, unchoke, sizeof(unchoke)) < 0) {
+        return;
+    }
+
+    DelayedAnswer answers[FAKE_PEER_BACKLOG];
+    int pending = 0;
+    char *message = malloc(LENGTH_PREFIX_SIZE + 9 + BLOCK_LENGTH);
+    for (;;) {
+        struct timespec timeout = { 0, 0 };
+        if (pending > 0) {
+            double wait = answers[0].due - now_seconds();
+            if (wait > 0) {
+                timeout.tv_sec = (time_t)wait;
+                timeout.tv_nsec = (long)((wait - timeout.tv_sec) * 1e9);
+            }
+        }
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (ppoll(&pfd, 1, pending > 0 ? &timeout : NULL, NULL) < 0) break;
+        if (pfd.revents & (POLLIN | POLLHUP)) {
+            // Only REQUESTs get an answer, keep-alives and the like are skipped
+            uint32_t prefix;
+            unsigned char body[64];
+            if (recv(fd, &prefix, sizeof(prefix), MSG_WAITALL) != sizeof(prefix) || ntohl(prefix) > sizeof(body) ||
+                recv(fd, body, ntohl(prefix), MSG_WAITALL) != (ssize_t)ntohl(prefix) || pending == FAKE_PEER_BACKLOG) break;
+            if (ntohl(prefix) == 13 && body[0] == REQUEST) {
+                uint32_t fields[3];
+                memcpy(fields, body + 1, sizeof(fields));
+                answers[pending++] = (DelayedAnswer){ now_seconds() + rtt, ntohl(fields[0]), ntohl(fields[1]), ntohl(fields[2]) };
+            }
+        }
+        // Answers are due in the order their requests came in
+        while (pending > 0 && answers[0].due <= now_seconds()) {
+            DelayedAnswer *answer = &answers[0];
+            uint32_t header[3] = { htonl(9 + answer->length), htonl(answer->index), htonl(answer->begin) };
+            memcpy(message, &header[0], LENGTH_PREFIX_SIZE);
+            message[LENGTH_PREFIX_SIZE] = PIECE;
+            memcpy(message + LENGTH_PREFIX_SIZE + 1, &header[1], 8);
+            memcpy(message + LENGTH_PREFIX_SIZE + 9, content + (size_t)answer->index * PIPELINE_PIECE_LENGTH + answer->begin, answer->length);
+            if (send_all(fd, message, LENGTH_PREFIX_SIZE + 9 + answer->length) < 0) {
+                pending = -1;
+                break;
+            }
+            memmove(&answers[0], &answers[1], --pending * sizeof(answers[0]));
+        }
+        if (pending < 0) break;
+    }
+    free(message);
+    close(fd);
+}
+
+// Builds the metainfo of a single-file torrent holding 'content'
+static int bench_torrent(const char *content, size_t length, MetaInfo *info) {
+    size_t num_pieces = length / PIPELINE_PIECE_LENGTH;
+    char *torrent = malloc(256 + num_pieces * SHA1_DIGEST_LENGTH);
+    if (torrent == NULL) return -1;
+    int header = sprintf(torrent, "d8:announce16:http://localhost4:infod6:lengthi%zue4:name5:bench12:piece lengthi%de6:pieces%zu:",
+                         length, PIPELINE_PIECE_LENGTH, num_pieces * SHA1_DIGEST_LENGTH);
+    for (size_t i = 0; i < num_pieces; i++) {
+        sha1_hash((const unsigned char *)content + i * PIPELINE_PIECE_LENGTH, PIPELINE_PIECE_LENGTH,
+                  (unsigned char *)torrent + header + i * SHA1_DIGEST_LENGTH);
+    }
+    size_t total = header + num_pieces * SHA1_DIGEST_LENGTH;
+    memcpy(torrent + total, "ee", 2);
+    int status = info_extract(torrent, total + 2, info);
+    free(torrent);
+    return status;
+}
+
+// Downloads the whole torrent once with 'depth' requests in flight, returns the seconds it took (-1 on failure)
+static double pipelined_download(const MetaInfo *info, const char *content, const char *target, double rtt, int depth) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t address_length = sizeof(address);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 1) < 0 ||
+        getsockname(listener, (struct sockaddr *)&address, &address_length) < 0) {
+        perror("Failed to listen on loopback");
+        if (listener >= 0) close(listener);
+        return -1;
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        fake_peer(listener, content, info->length, rtt);
+        _exit(0);
+    }
+    close(listener);
+    if (child < 0) {
+        return -1;
+    }
+
+    // The reactor the client runs on, with one peer and the window set to 'depth'
+    Storage storage;
+    Reactor reactor;
+    double seconds = -1;
+    if (storage_open(&storage, info, target) == 0) {
+        if (reactor_init(&reactor, info, &storage) == 0) {
+            reactor.depth = depth;
+            Peer peer = { "127.0.0.1", ntohs(address.sin_port) };
+            double start = now_seconds();
+            if (reactor_add_peer(&reactor, &peer) == 0 && reactor_run(&reactor, NULL, NULL) == 0) {
+                seconds = now_seconds() - start;
+            }
+            reactor_free(&reactor);
+        }
+        storage_close(&storage);
+    }
+    kill(child, SIGKILL); // Its socket closed with the reactor, this is in case it never connected
+    waitpid(child, NULL, 0);
+    return seconds;
+}
+
+int bench_pipeline(void) {
+    size_t length = (size_t)PIPELINE_PIECES * PIPELINE_PIECE_LENGTH;
+    char *content = malloc(length);
+    char target[] = "/tmp/bench-pipeline-XXXXXX";
+    int fd = mkstemp(target);
+    MetaInfo info;
+    if (content == NULL || fd < 0) {
+        perror("Failed to set up the benchmark");
+        free(content);
+        return 1;
+    }
+    close(fd);
+    for (size_t i = 0; i < length; i++) {
+        content[i] = (char)(i * 2654435761u >> 7);
+    }
+    if (bench_torrent(content, length, &info) < 0) {
+        fprintf(stderr, "Failed to build the benchmark torrent: %s\n", info_error());
+        free(content);
+        unlink(target);
+        return 1;
+    }
+
+    static const double rtts[] = { 0.001, 0.010, 0.050 };
+    static const int depths[] = { 1, 2, 5, 10, 20 };
+    printf("%zu KiB over loopback, MB/s by simulated RTT and requests in flight\n", length / 1024);
+    printf("%8s", "rtt");
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) printf("  depth %-3d", depths[d]);
+    printf("\n");
+    for (size_t r = 0; r < sizeof(rtts) / sizeof(rtts[0]); r++) {
+        printf("%6.0fms", rtts[r] * 1000);
+        for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+            double seconds = pipelined_download(&info, content, target, rtts[r], depths[d]);
+            if (seconds > 0) printf("  %9.2f", length / seconds / 1e6);
+            else printf("  %9s", "failed");
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    free_info(info);
+    free(content);
+    unlink(target);
+    return 0;
+}
+
+// The picker benchmark uses a 1M-piece torrent (256 GiB at 256 KiB a piece), well past any real one
+#define PICKER_PIECES (1024 * 1024)
+#define PICKER_PEERS 50
+#define INTEREST_ROUNDS 200
+
+// Worst-case interest test (the one missing piece is the last), word-wise next to a bit-by-bit scan,
+// then rarest-first picks with PICKER_PEERS peers counted in until every piece is done
+int bench_picker(void) {
+    size_t bytes = bitfield_bytes(PICKER_PIECES);
+    unsigned char *have = malloc(bytes);
+    unsigned char *peers = malloc(bytes * PICKER_PEERS);
+    PiecePicker picker;
+    if (have == NULL || peers == NULL || picker_init(&picker, PICKER_PIECES, PICKER_PEERS) < 0) {
+        perror("Failed to set up the benchmark");
+        free(have);
+        free(peers);
+        return 1;
+    }
+    memset(have, 0xff, bytes);
+    have[bytes - 1] = 0xfe;
+    // Peer 0 is a seed, the others have about half the pieces each
+    uint64_t state = 0x9e3779b97f4a7c15;
+    memset(peers, 0xff, bytes);
+    for (size_t i = bytes; i < bytes * PICKER_PEERS; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        peers[i] = (unsigned char)state;
+    }
+
+    size_t found = 0;
+    double start = now_seconds();
+    for (int round = 0; round < INTEREST_ROUNDS; round++) {
+        found += bitfield_any_missing(peers, have, PICKER_PIECES);
+    }
+    double any = (now_seconds() - start) / INTEREST_ROUNDS;
+    start = now_seconds();
+    for (int round = 0; round < INTEREST_ROUNDS; round++) {
+        found += bitfield_count_missing(peers, have, PICKER_PIECES);
+    }
+    double count = (now_seconds() - start) / INTEREST_ROUNDS;
+    start = now_seconds();
+    for (int round = 0; round < INTEREST_ROUNDS; round++) {
+        for (size_t piece = 0; piece < PICKER_PIECES; piece++) {
+            if (bitfield_get(peers, piece) && !bitfield_get(have, piece)) {
+                found++;
+                break;
+            }
+        }
+    }
+    double scan = (now_seconds() - start) / INTEREST_ROUNDS;
+    if (found != 3 * INTEREST_ROUNDS) {
+        fprintf(stderr, "Interest tests disagree: %zu hits, expected %d\n", found, 3 * INTEREST_ROUNDS);
+    }
+    printf("%d pieces, worst-case interest test\n", PICKER_PIECES);
+    printf("%-16s %10.1f us\n", "any_missing", any * 1e6);
+    printf("%-16s %10.1f us\n", "count_missing", count * 1e6);
+    printf("%-16s %10.1f us\n", "bit by bit", scan * 1e6);
+
+    start = now_seconds();
+    for (int peer = 0; peer < PICKER_PEERS; peer++) {
+        picker_add_bitfield(&picker, peers + (size_t)peer * bytes);
+    }
+    double add = (now_seconds() - start) / PICKER_PEERS;
+    size_t picks = 0;
+    start = now_seconds();
+    for (;;) {
+        long piece = picker_pick(&picker, peers, NULL, NULL);
+        if (piece < 0) break;
+        picker_set_done(&picker, (uint32_t)piece);
+        picks++;
+    }
+    double pick = now_seconds() - start;
+    printf("%-16s %10.1f us\n", "add bitfield", add * 1e6);
+    printf("%-16s %10.2f us  (%zu picks, each marked done)\n", "pick", picks ? pick / picks * 1e6 : 0.0, picks);
+
+    picker_free(&picker);
+    free(have);
+    free(peers);
+    return picks == PICKER_PIECES ? 0 : 1;
+}
@@ -0,0 +1,33 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Benchmarks run from the command line (--bench-*), they print their results on stdout
+
+// decode time of ever larger torrents (1.2 to 20 MB) in copy and view mode, flat MB/s means linear
+int bench_decode(void);
+
+// loading 1,000 torrents with an empty metadata cache, then with a warm one
+int bench_cache(void);
+
+// directory load rate (files/s) by thread count, with an empty and with a warm metadata cache
+int bench_ingest(void);
+
+// recheck throughput of data on disk by thread count
+int bench_recheck(void);
+
+// text and JSON rendering of a 200k-piece torrent, as meta info and as the raw decoded tree
+int bench_render(void);
+
+// structural indexing speed of the tape (GB/s), alone and with the tree built from it, next to the view decode
+int bench_tape(void);
+
+// SHA-1 throughput of every multi-buffer engine this CPU can run
+int bench_sha1(void);
+
+// download throughput over loopback from a fake peer with a simulated round-trip time, for several pipeline depths
+int bench_pipeline(void);
+
+// interest tests and rarest-first picks on a 1M-piece torrent
+int bench_picker(void);
+
+#endif
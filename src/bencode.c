@@ -4,190 +4,167 @@
 #include <string.h>
 #include <inttypes.h>
 
-// Helper function for memory allocation with error checking
-char *allocate_memory(size_t size) {
-    char *ptr = (char *)malloc(size);
-    if (ptr == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-    }
-    return ptr;
-}
+// Longest decimal form of a 64-bit magnitude
+#define MAX_DECIMAL_DIGITS 20
 
 // Comparison function to be used with qsort
 int compare_keyval_pairs(const void *a, const void *b) {
     KeyValPair *pairA = (KeyValPair *)a;
     KeyValPair *pairB = (KeyValPair *)b;
-    return strcmp(pairA->key, pairB->key);
+    return compare_keys(pairA->key, pairA->key_length, pairB->key, pairB->key_length);
 }
 
-// Function to sort a dictionary by its keys
-void sort_dict(KeyValPair *dict, size_t size) {
-    qsort(dict, size, sizeof(KeyValPair), compare_keyval_pairs);
-}
-
-EncodedString bencode_string(const char *decoded, size_t len) {
-    EncodedString result = {NULL, 0};
-
-    if (decoded == NULL) return result;
-
-    size_t encoded_len = snprintf(NULL, 0, "%zu", len) + len + 2;
-    char *encoded_str = allocate_memory(encoded_len);
-
-    if (encoded_str == NULL) return result;
-
-    int prefix_len = snprintf(encoded_str, encoded_len, "%zu:", len);
-    memcpy(encoded_str + prefix_len, decoded, len);
-
-    result.str = encoded_str;
-    result.length = encoded_len - 1;  // Exclude the null terminator in the length
+// Pairs of a dict in encoding order. unsorted dicts are sorted into '*scratch', which the caller frees
+static const KeyValPair *ordered_pairs(const DecodedValue *dict, KeyValPair **scratch) {
+    *scratch = NULL;
+    if (dict->val.sorted || dict->size < 2) {
+        return dict->val.dict;
+    }
 
-    return result;
+    // Sort a shallow copy so the dict (and its hash index) are left untouched
+    *scratch = (KeyValPair *)malloc(dict->size * sizeof(KeyValPair));
+    if (*scratch == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+    memcpy(*scratch, dict->val.dict, dict->size * sizeof(KeyValPair));
+    qsort(*scratch, dict->size, sizeof(KeyValPair), compare_keyval_pairs);
+    return *scratch;
 }
 
-EncodedString bencode_integer(int64_t decoded) {
-    EncodedString result = {NULL, 0};
-
-    size_t encoded_len = snprintf(NULL, 0, "i%" PRId64 "e", decoded) + 1;
-    char *encoded_str = allocate_memory(encoded_len);
-
-    if (encoded_str == NULL) return result;
-
-    snprintf(encoded_str, encoded_len, "i%" PRId64 "e", decoded);
-
-    result.str = encoded_str;
-    result.length = encoded_len - 1;  // Exclude the null terminator in the length
-
-    return result;
+// Number of decimal digits in 'value'
+static size_t decimal_length(uint64_t value) {
+    size_t digits = 1;
+    while (value >= 10) {
+        value /= 10;
+        digits++;
+    }
+    return digits;
 }
 
-EncodedString bencode_list(DecodedValue list) {
-    EncodedString result = {NULL, 0};
-
-    if (list.val.list == NULL || list.size == 0) return result;
-
-    size_t value_size = 2; // initial size for 'l' and 'e'
-    char *value = allocate_memory(value_size);
-
-    if (value == NULL) return result;
-
-    value[0] = 'l';
-    value[1] = '\0';
-
-    size_t total_length = 1; // length for 'l'
-    for (size_t i = 0; i < list.size; i++) {
-        EncodedString temp = encode_decode(list.val.list[i]);
-        if (temp.str == NULL) {
-            free(value);
-            return result;
-        }
-
-        value_size += temp.length;
-        value = realloc(value, value_size + 1);
-
-        if (value == NULL) {
-            fprintf(stderr, "Memory allocation failure\n");
-            free(temp.str);
-            return result;
-        }
-
-        memcpy(value + total_length, temp.str, temp.length);
-        total_length += temp.length;
-        free(temp.str);
+// Write 'value' in decimal, returns the number of digits
+static size_t format_decimal(uint64_t value, char *out) {
+    size_t digits = decimal_length(value);
+    for (size_t i = digits; i > 0; i--) {
+        out[i - 1] = '0' + value % 10;
+        value /= 10;
     }
-
-    value[total_length] = 'e';
-    value[total_length + 1] = '\0';
-
-    result.str = value;
-    result.length = total_length + 1;  // include 'e'
-
-    return result;
+    return digits;
 }
 
-EncodedString bencode_dict(DecodedValue *dict) {
-    EncodedString result = {NULL, 0};
-
-    if (dict->val.dict == NULL || dict->size == 0) return result;
-
-    // Sorting the dictionary before encoding it
-    sort_dict(dict->val.dict, dict->size);
-
-    size_t value_size = 2; // initial size for 'd' and 'e'
-    char *value = allocate_memory(value_size);
-
-    if (value == NULL) return result;
-
-    value[0] = 'd';
-    value[1] = '\0';
-
-    size_t total_length = 1; // length for 'd'
-    for (size_t i = 0; i < dict->size; i++) {
-        EncodedString temp1 = bencode_string(dict->val.dict[i].key, strlen(dict->val.dict[i].key));
-        EncodedString temp2 = encode_decode(dict->val.dict[i].val);
+// Magnitude of an integer, safe for INT64_MIN
+static uint64_t magnitude(int64_t value) {
+    return value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+}
 
-        if (temp1.str == NULL || temp2.str == NULL) {
-            free(value);
-            if (temp1.str) free(temp1.str);
-            if (temp2.str) free(temp2.str);
-            return result;
-        }
+void bencode_writer_init(BencodeWriter *writer, Sink sink) {
+    writer->sink = sink;
+    writer->pending_length = 0;
+    writer->status = 0;
+}
 
-        value_size += temp1.length + temp2.length;
-        value = realloc(value, value_size + 1);
+// Pass staged bytes on to the sink
+static void writer_flush(BencodeWriter *writer) {
+    if (writer->status == 0 && sink_write(writer->sink, writer->pending, writer->pending_length) < 0) {
+        writer->status = -1;
+    }
+    writer->pending_length = 0;
+}
 
-        if (value == NULL) {
-            fprintf(stderr, "Memory allocation failure\n");
-            free(temp1.str);
-            free(temp2.str);
-            return result;
+// Stage bytes, large payloads go straight to the sink
+static void writer_emit(BencodeWriter *writer, const void *data, size_t length) {
+    if (writer->pending_length + length > sizeof(writer->pending)) {
+        writer_flush(writer);
+        if (length > sizeof(writer->pending)) {
+            if (writer->status == 0 && sink_write(writer->sink, data, length) < 0) {
+                writer->status = -1;
+            }
+            return;
         }
+    }
+    memcpy(writer->pending + writer->pending_length, data, length);
+    writer->pending_length += length;
+}
 
-        memcpy(value + total_length, temp1.str, temp1.length);
-        total_length += temp1.length;
-        free(temp1.str);
-
-        memcpy(value + total_length, temp2.str, temp2.length);
-        total_length += temp2.length;
-        free(temp2.str);
+void bencode_write_int(BencodeWriter *writer, int64_t value) {
+    char token[MAX_DECIMAL_DIGITS + 3];
+    size_t length = 0;
+    token[length++] = 'i';
+    if (value < 0) {
+        token[length++] = '-';
     }
+    length += format_decimal(magnitude(value), token + length);
+    token[length++] = 'e';
+    writer_emit(writer, token, length);
+}
 
-    value[total_length] = 'e';
-    value[total_length + 1] = '\0';
+void bencode_write_string(BencodeWriter *writer, const void *str, size_t length) {
+    char prefix[MAX_DECIMAL_DIGITS + 1];
+    size_t prefix_length = format_decimal(length, prefix);
+    prefix[prefix_length++] = ':';
+    writer_emit(writer, prefix, prefix_length);
+    writer_emit(writer, str, length);
+}
 
-    result.str = value;
-    result.length = total_length + 1;  // include 'e'
+void bencode_write_list_start(BencodeWriter *writer) {
+    writer_emit(writer, "l", 1);
+}
 
-    return result;
+void bencode_write_dict_start(BencodeWriter *writer) {
+    writer_emit(writer, "d", 1);
 }
 
-EncodedString encode_decode(DecodedValue decoded) {
+void bencode_write_end(BencodeWriter *writer) {
+    writer_emit(writer, "e", 1);
+}
+
+void bencode_write_value(BencodeWriter *writer, DecodedValue decoded) {
     switch (decoded.type) {
         case DECODED_VALUE_TYPE_STR:
-            return bencode_string(decoded.val.str, decoded.val.length);
+            bencode_write_string(writer, decoded.val.str, decoded.val.length);
+            break;
         case DECODED_VALUE_TYPE_INT:
-            return bencode_integer(decoded.val.integer);
+            bencode_write_int(writer, decoded.val.integer);
+            break;
         case DECODED_VALUE_TYPE_LIST:
-            return bencode_list(decoded);
-        case DECODED_VALUE_TYPE_DICT:
-            return bencode_dict(&decoded);
+            bencode_write_list_start(writer);
+            for (size_t i = 0; i < decoded.size; i++) {
+                bencode_write_value(writer, decoded.val.list[i]);
+            }
+            bencode_write_end(writer);
+            break;
+        case DECODED_VALUE_TYPE_DICT: {
+            KeyValPair *scratch;
+            const KeyValPair *pairs = ordered_pairs(&decoded, &scratch);
+            if (pairs == NULL && decoded.size > 0) {
+                writer->status = -1;
+                return;
+            }
+            bencode_write_dict_start(writer);
+            for (size_t i = 0; i < decoded.size; i++) {
+                bencode_write_string(writer, pairs[i].key, pairs[i].key_length);
+                bencode_write_value(writer, pairs[i].val);
+            }
+            bencode_write_end(writer);
+            free(scratch);
+            break;
+        }
         default:
             fprintf(stderr, "Invalid type\n");
-            EncodedString result = {NULL, 0};
-            return result;
+            writer->status = -1;
+            break;
     }
 }
 
-void print_encoded_string(EncodedString encoded) {
-    if (encoded.str == NULL || encoded.length == 0) {
-        printf("Encoded string is empty or NULL.\n");
-        return;
-    }
+int bencode_writer_finish(BencodeWriter *writer) {
+    writer_flush(writer);
+    return writer->status;
+}
 
-    // Print each character as a hex value for clarity in binary data
-    printf("Encoded String: ");
-    for (size_t i = 0; i < encoded.length; ++i) {
-        printf("%c", encoded.str[i]);
-    }
-    printf("\nLength: %zu\n", encoded.length);
+int bencode_encode_to_sink(DecodedValue decoded, Sink sink) {
+    BencodeWriter writer;
+    bencode_writer_init(&writer, sink);
+    bencode_write_value(&writer, decoded);
+    return bencode_writer_finish(&writer);
 }
 
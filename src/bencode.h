@@ -3,18 +3,34 @@
 
 #include "decode.h"
 #include "info.h"
+#include "sink.h"
 #include <inttypes.h>
 
-// Struct for encoded string and its length
-typedef struct {
-    char *str;
-    size_t length;
-} EncodedString;
+// Writer that emits bencode token by token into a sink (tracker requests, handshakes, resume files, ...)
+typedef struct BencodeWriter {
+    Sink sink;
+    char pending[1024];     // Small tokens are staged here so the sink sees few, large writes
+    size_t pending_length;
+    int status;             // 0, or -1 once any write failed
+} BencodeWriter;
 
-// A function that extracts the decoded value and returns it bencoded
-EncodedString encode_decode(DecodedValue decoded);
+// Stream the encoding into a sink (file descriptor, buffer, SHA-1 context, ...). returns 0 or -1
+int bencode_encode_to_sink(DecodedValue decoded, Sink sink);
 
-// Function to print an EncodedString
-void print_encoded_string(EncodedString encoded);
+// prepares a writer over 'sink'
+void bencode_writer_init(BencodeWriter *writer, Sink sink);
+
+// token writers, errors are sticky and reported by bencode_writer_finish
+void bencode_write_int(BencodeWriter *writer, int64_t value);
+void bencode_write_string(BencodeWriter *writer, const void *str, size_t length);
+void bencode_write_list_start(BencodeWriter *writer);
+void bencode_write_dict_start(BencodeWriter *writer);
+void bencode_write_end(BencodeWriter *writer);
+
+// writes a whole decoded tree, dict keys in sorted order
+void bencode_write_value(BencodeWriter *writer, DecodedValue decoded);
+
+// flushes staged output, returns 0 if every write succeeded and -1 otherwise
+int bencode_writer_finish(BencodeWriter *writer);
 
 #endif // BENCODE_H
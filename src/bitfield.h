@@ -0,0 +1,62 @@
+#ifndef BITFIELD_H
+#define BITFIELD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Piece bitfields in the layout of the BITFIELD message: piece 0 is the high bit of the first byte
+
+static inline size_t bitfield_bytes(size_t num_pieces) {
+    return (num_pieces + 7) / 8;
+}
+
+static inline bool bitfield_get(const unsigned char *bits, size_t index) {
+    return bits[index / 8] & (0x80 >> (index % 8));
+}
+
+static inline void bitfield_set(unsigned char *bits, size_t index) {
+    bits[index / 8] |= 0x80 >> (index % 8);
+}
+
+// bitfield_set for bitfields that several threads fill at once
+static inline void bitfield_set_atomic(unsigned char *bits, size_t index) {
+    __atomic_fetch_or(&bits[index / 8], (unsigned char)(0x80 >> (index % 8)), __ATOMIC_RELAXED);
+}
+
+// Number of pieces set in 'peer' and clear in 'have', i.e. what a peer could still give us. works on
+// 64-bit words with popcount, so even a million pieces is a few thousand instructions
+static inline size_t bitfield_count_missing(const unsigned char *peer, const unsigned char *have, size_t num_pieces) {
+    size_t bytes = bitfield_bytes(num_pieces);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t theirs, ours;
+        memcpy(&theirs, peer + i, 8);
+        memcpy(&ours, have + i, 8);
+        count += __builtin_popcountll(theirs & ~ours);
+    }
+    for (; i < bytes; i++) {
+        count += __builtin_popcount(peer[i] & ~have[i] & 0xff);
+    }
+    return count;
+}
+
+// bitfield_count_missing() > 0, stopping at the first word that answers it
+static inline bool bitfield_any_missing(const unsigned char *peer, const unsigned char *have, size_t num_pieces) {
+    size_t bytes = bitfield_bytes(num_pieces);
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t theirs, ours;
+        memcpy(&theirs, peer + i, 8);
+        memcpy(&ours, have + i, 8);
+        if (theirs & ~ours) return true;
+    }
+    for (; i < bytes; i++) {
+        if (peer[i] & ~have[i]) return true;
+    }
+    return false;
+}
+
+#endif
@@ -1,176 +1,522 @@
 #include "decode.h"
 
+#include <inttypes.h>
+
+// Nesting limit for lists and dicts, keeps hostile input from blowing the stack
+#define MAX_DECODE_DEPTH 512
+
+// Cursor over a length-bounded bencoded buffer
+typedef struct Parser {
+    const char *data;
+    size_t length;
+    size_t pos;
+    size_t depth;
+    DecodeMode mode;
+    Arena *arena;              // NULL when nodes are individually malloc'd
+    DecodedValue *values;      // Scratch stack of list elements still being decoded
+    size_t values_count;
+    size_t values_capacity;
+    KeyValPair *pairs;         // Scratch stack of dict pairs still being decoded
+    size_t pairs_count;
+    size_t pairs_capacity;
+} Parser;
+
+static _Thread_local char decode_error_message[128] = "";
+
 // Check if a character is a digit
 bool is_digit(char c) {
     return c >= '0' && c <= '9';
 }
 
+const char *bencode_error(void) {
+    return decode_error_message;
+}
+
+// Record why decoding failed, always returns -1
+static int parse_error(Parser *parser, const char *message) {
+    snprintf(decode_error_message, sizeof(decode_error_message), "%s at offset %zu", message, parser->pos);
+    return -1;
+}
+
+// Parse a run of digits terminated by 'delimiter' into an unsigned value
+static int parse_length(Parser *parser, char delimiter, size_t *value) {
+    size_t start = parser->pos;
+    size_t result = 0;
+
+    while (parser->pos < parser->length && is_digit(parser->data[parser->pos])) {
+        size_t digit = parser->data[parser->pos] - '0';
+        if (result > (SIZE_MAX - digit) / 10) {
+            return parse_error(parser, "Length overflow");
+        }
+        result = result * 10 + digit;
+        parser->pos++;
+    }
+
+    if (parser->pos == start) {
+        return parse_error(parser, "Expected digits");
+    }
+    if (parser->pos >= parser->length || parser->data[parser->pos] != delimiter) {
+        return parse_error(parser, "Unterminated number");
+    }
+    parser->pos++; // Skip the delimiter
+
+    *value = result;
+    return 0;
+}
+
+// Parse "<length>:" and return where the string bytes start
+static int parse_string_span(Parser *parser, const char **str, size_t *length) {
+    if (parse_length(parser, ':', length) < 0) {
+        return -1;
+    }
+    if (*length > parser->length - parser->pos) {
+        return parse_error(parser, "String runs past end of buffer");
+    }
+    *str = parser->data + parser->pos;
+    parser->pos += *length;
+    return 0;
+}
+
+// Parse "i<digits>e"
+static int parse_integer(Parser *parser, int64_t *value) {
+    parser->pos++; // Skip 'i'
+
+    bool negative = false;
+    if (parser->pos < parser->length && parser->data[parser->pos] == '-') {
+        negative = true;
+        parser->pos++;
+    }
+
+    size_t magnitude;
+    if (parse_length(parser, 'e', &magnitude) < 0) {
+        return -1;
+    }
+    if (negative ? magnitude > (size_t)INT64_MAX + 1 : magnitude > (size_t)INT64_MAX) {
+        return parse_error(parser, "Integer overflow");
+    }
+
+    *value = negative ? (int64_t)(0 - (uint64_t)magnitude) : (int64_t)magnitude;
+    return 0;
+}
+
+// Skip over one value without materializing it
+static int skip_value(Parser *parser) {
+    if (parser->pos >= parser->length) {
+        return parse_error(parser, "Unexpected end of buffer");
+    }
+
+    char c = parser->data[parser->pos];
+    if (is_digit(c)) {
+        const char *str;
+        size_t length;
+        return parse_string_span(parser, &str, &length);
+    } else if (c == 'i') {
+        int64_t value;
+        return parse_integer(parser, &value);
+    } else if (c == 'l' || c == 'd') {
+        if (++parser->depth > MAX_DECODE_DEPTH) {
+            return parse_error(parser, "Nesting too deep");
+        }
+        parser->pos++;
+        while (parser->pos < parser->length && parser->data[parser->pos] != 'e') {
+            if (skip_value(parser) < 0) {
+                return -1;
+            }
+        }
+        if (parser->pos >= parser->length) {
+            return parse_error(parser, "Unterminated list or dictionary");
+        }
+        parser->pos++; // Skip 'e'
+        parser->depth--;
+        return 0;
+    }
+    return parse_error(parser, "Unsupported encoded value");
+}
+
 // Find the length of the bencoded value
 size_t find_value_length(const char *bencoded_string) {
-    if (bencoded_string[0] == 'i') {
-        // Integer value
-        char *ptr = strchr(bencoded_string, 'e');
-        if (ptr != NULL) {
-            return (ptr - bencoded_string) + 1;
-        }
-    } else if (is_digit(bencoded_string[0])) {
-        // String value
-        const char *colon = strchr(bencoded_string, ':');
-        if (colon != NULL) {
-            int length = atoi(bencoded_string);
-            return (colon - bencoded_string + 1) + length;
+    Parser parser = {.data = bencoded_string, .length = strlen(bencoded_string)};
+    if (skip_value(&parser) < 0) {
+        return 0;
+    }
+    return parser.pos;
+}
+
+static int parse_value(Parser *parser, DecodedValue *decoded);
+
+// Allocate node memory from the document arena, or the heap for standalone trees
+static void *parser_alloc(Parser *parser, size_t size) {
+    return parser->arena != NULL ? arena_alloc(parser->arena, size) : malloc(size);
+}
+
+// Give a string payload its storage: a view into the source, or a NUL-terminated copy
+static char *parser_store_string(Parser *parser, const char *start, size_t length) {
+    if (parser->mode == DECODE_MODE_VIEW) {
+        return (char *)start;
+    }
+
+    char *copy = parser_alloc(parser, length + 1);
+    if (copy != NULL) {
+        memcpy(copy, start, length); // Use memcpy for binary data
+        copy[length] = '\0';
+    }
+    return copy;
+}
+
+// Release a scratch entry that never made it into a finished container
+static void parser_discard(Parser *parser, DecodedValue value) {
+    if (parser->arena == NULL) {
+        free_decoded_value(value);
+    }
+}
+
+// Push a finished element on the scratch stack shared by every open list
+static int push_value(Parser *parser, const DecodedValue *value) {
+    if (parser->values_count == parser->values_capacity) {
+        size_t capacity = parser->values_capacity ? parser->values_capacity * 2 : 64;
+        DecodedValue *grown = realloc(parser->values, capacity * sizeof(DecodedValue));
+        if (grown == NULL) {
+            return parse_error(parser, "Memory reallocation failed");
         }
-    } else if (bencoded_string[0] == 'l' || bencoded_string[0] == 'd') {
-        // List or dictionary value
-        size_t i = 1;
-        while (bencoded_string[i] != 'e') {
-            size_t value_length = find_value_length(&bencoded_string[i]);
-            if (value_length == 0) return 0;
-            i += value_length;
+        parser->values = grown;
+        parser->values_capacity = capacity;
+    }
+    parser->values[parser->values_count++] = *value;
+    return 0;
+}
+
+// Push a finished key-value pair on the scratch stack shared by every open dict
+static int push_pair(Parser *parser, const KeyValPair *pair) {
+    if (parser->pairs_count == parser->pairs_capacity) {
+        size_t capacity = parser->pairs_capacity ? parser->pairs_capacity * 2 : 64;
+        KeyValPair *grown = realloc(parser->pairs, capacity * sizeof(KeyValPair));
+        if (grown == NULL) {
+            return parse_error(parser, "Memory reallocation failed");
         }
-        return i + 1;
+        parser->pairs = grown;
+        parser->pairs_capacity = capacity;
     }
+    parser->pairs[parser->pairs_count++] = *pair;
     return 0;
 }
 
-// Decode a bencoded string
-DecodedValue decode_string(const char *bencoded_value) {
-    DecodedValue decoded = {};
-    if (is_digit(bencoded_value[0])) {
-        decoded.type = DECODED_VALUE_TYPE_STR;
-        int length = atoi(bencoded_value);
-        const char *colon_index = strchr(bencoded_value, ':');
-        if (colon_index != NULL) {
-            const char *start = colon_index + 1;
-            decoded.val.str = (char *)malloc(length);
-            if (decoded.val.str == NULL) {
-                fprintf(stderr, "Memory allocation failed\n");
-                exit(1);
-            }
-            memcpy(decoded.val.str, start, length); // Use memcpy for binary data
-            decoded.val.length = length;
-        } else {
-            fprintf(stderr, "Invalid encoded value: %s\n", bencoded_value);
-            exit(1);
+// Order two binary keys the way bencode sorts them: raw bytes, shorter prefix first
+int compare_keys(const char *a, size_t a_length, const char *b, size_t b_length) {
+    size_t common = a_length < b_length ? a_length : b_length;
+    int order = memcmp(a, b, common);
+    if (order != 0) {
+        return order;
+    }
+    return (a_length > b_length) - (a_length < b_length);
+}
+
+// FNV-1a over the key bytes
+static uint64_t hash_key(const char *key, size_t key_length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key_length; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Build the hash index of a finished dict, slots are kept at most half full
+DictIndex *build_dict_index(Arena *arena, const KeyValPair *pairs, size_t count) {
+    size_t slots = 1;
+    while (slots < count * 2) {
+        slots <<= 1;
+    }
+
+    size_t size = sizeof(DictIndex) + slots * sizeof(uint32_t);
+    DictIndex *index = arena != NULL ? arena_alloc(arena, size) : malloc(size);
+    if (index == NULL) {
+        return NULL;
+    }
+    index->mask = slots - 1;
+    memset(index->slots, 0, slots * sizeof(uint32_t));
+
+    for (size_t i = 0; i < count; i++) {
+        size_t slot = hash_key(pairs[i].key, pairs[i].key_length) & index->mask;
+        while (index->slots[slot] != 0) {
+            slot = (slot + 1) & index->mask;
         }
-    } else {
-        fprintf(stderr, "Invalid string format: %s\n", bencoded_value);
-        exit(1);
+        index->slots[slot] = (uint32_t)(i + 1);
     }
-    return decoded;
+    return index;
+}
+
+// Decode a bencoded string
+static int decode_string(Parser *parser, DecodedValue *decoded) {
+    const char *start;
+    size_t length;
+    if (parse_string_span(parser, &start, &length) < 0) {
+        return -1;
+    }
+
+    decoded->val.str = parser_store_string(parser, start, length);
+    if (decoded->val.str == NULL) {
+        return parse_error(parser, "Memory allocation failed");
+    }
+    decoded->val.length = length;
+    decoded->type = DECODED_VALUE_TYPE_STR;
+    return 0;
 }
 
 // Decode a bencoded integer
-DecodedValue decode_integer(const char *bencoded_value) {
-    DecodedValue decoded = {};
-    size_t value_length = find_value_length(bencoded_value);
-    if (value_length != 0) {
-        decoded.type = DECODED_VALUE_TYPE_INT;
-        const char *int_start = bencoded_value + 1; // Skip 'i'
-        size_t int_length = value_length - 2; // Exclude 'i' and 'e'
-        char *int_str = strndup(int_start, int_length);
-        if (int_str == NULL) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(1);
+static int decode_integer(Parser *parser, DecodedValue *decoded) {
+    if (parse_integer(parser, &decoded->val.integer) < 0) {
+        return -1;
+    }
+    decoded->type = DECODED_VALUE_TYPE_INT;
+    return 0;
+}
+
+// Decode a bencoded list. elements collect on the scratch stack and are moved into one exact-size array at 'e'
+static int decode_list(Parser *parser, DecodedValue *decoded) {
+    size_t base = parser->values_count;
+    decoded->type = DECODED_VALUE_TYPE_LIST;
+    decoded->val.list = NULL;
+    decoded->size = 0;
+    parser->pos++; // Skip 'l'
+
+    while (parser->pos < parser->length && parser->data[parser->pos] != 'e') {
+        DecodedValue element;
+        if (parse_value(parser, &element) < 0) {
+            goto fail;
         }
-        decoded.val.integer = atoll(int_str);
-        free(int_str);
-    } else {
-        fprintf(stderr, "Invalid integer format: %s\n", bencoded_value);
-        exit(1);
-    }
-    return decoded;
-}
-
-// Decode a bencoded list
-DecodedValue decode_list(const char *bencoded_value) {
-    DecodedValue decoded = {};
-    if (bencoded_value[0] == 'l') {
-        decoded.type = DECODED_VALUE_TYPE_LIST;
-        decoded.val.list = NULL;
-        decoded.size = 0;
-        size_t index = 1; // Skip 'l'
-        while (bencoded_value[index] != 'e') {
-            const char *element_start = &bencoded_value[index];
-            DecodedValue element = decode_bencode(element_start);
-            size_t element_length = find_value_length(element_start);
-
-            // Append the decoded element to the list
-            decoded.val.list = (DecodedValue *)realloc(decoded.val.list, (decoded.size + 1) * sizeof(DecodedValue));
-            if (decoded.val.list == NULL) {
-                fprintf(stderr, "Memory reallocation failed\n");
-                exit(1);
-            }
-            decoded.val.list[decoded.size++] = element;
+        if (push_value(parser, &element) < 0) {
+            parser_discard(parser, element);
+            goto fail;
+        }
+    }
+
+    if (parser->pos >= parser->length) {
+        parse_error(parser, "Unterminated list");
+        goto fail;
+    }
+    parser->pos++; // Skip 'e'
 
-            // Move index past the decoded element
-            index += element_length;
+    size_t count = parser->values_count - base;
+    if (count > 0) {
+        decoded->val.list = parser_alloc(parser, count * sizeof(DecodedValue));
+        if (decoded->val.list == NULL) {
+            parse_error(parser, "Memory allocation failed");
+            goto fail;
         }
-    } else {
-        fprintf(stderr, "Invalid list format: %s\n", bencoded_value);
-        exit(1);
-    }
-    return decoded;
-}
-
-// Decode a bencoded dictionary
-DecodedValue decode_dict(const char *bencoded_value) {
-    DecodedValue decoded = {};
-    if (bencoded_value[0] == 'd') {
-        decoded.type = DECODED_VALUE_TYPE_DICT;
-        decoded.val.dict = NULL;
-        decoded.size = 0;
-        size_t index = 1; // Skip 'd'
-        
-        while (bencoded_value[index] != 'e') {
-            // Decode the key
-            DecodedValue key_obj = decode_bencode(&bencoded_value[index]);
-            if (key_obj.type != DECODED_VALUE_TYPE_STR) {
-                fprintf(stderr, "Dictionary key is not a string: %s\n", bencoded_value);
-                exit(1);
+        memcpy(decoded->val.list, &parser->values[base], count * sizeof(DecodedValue));
+    }
+    decoded->size = count;
+    parser->values_count = base;
+    return 0;
+
+fail:
+    while (parser->values_count > base) {
+        parser_discard(parser, parser->values[--parser->values_count]);
+    }
+    return -1;
+}
+
+// Decode a bencoded dictionary. pairs collect on the scratch stack and are moved into one exact-size array at 'e'
+static int decode_dict(Parser *parser, DecodedValue *decoded) {
+    size_t base = parser->pairs_count;
+    decoded->type = DECODED_VALUE_TYPE_DICT;
+    decoded->val.dict = NULL;
+    decoded->val.index = NULL;
+    decoded->val.sorted = true;
+    decoded->size = 0;
+    parser->pos++; // Skip 'd'
+
+    while (parser->pos < parser->length && parser->data[parser->pos] != 'e') {
+        if (!is_digit(parser->data[parser->pos])) {
+            parse_error(parser, "Dictionary key is not a string");
+            goto fail;
+        }
+
+        const char *key;
+        KeyValPair pair;
+        if (parse_string_span(parser, &key, &pair.key_length) < 0) {
+            goto fail;
+        }
+
+        // Remember whether keys arrive in canonical order, lookups can then binary search
+        if (decoded->val.sorted && parser->pairs_count > base) {
+            const KeyValPair *previous = &parser->pairs[parser->pairs_count - 1];
+            if (compare_keys(previous->key, previous->key_length, key, pair.key_length) >= 0) {
+                decoded->val.sorted = false;
             }
-            index += find_value_length(&bencoded_value[index]);
-
-            // Decode the value
-            DecodedValue value = decode_bencode(&bencoded_value[index]);
-            size_t value_length = find_value_length(&bencoded_value[index]);
-            index += value_length;
-
-            // Append the key-value pair to the dictionary
-            decoded.val.dict = (KeyValPair *)realloc(decoded.val.dict, (decoded.size + 1) * sizeof(KeyValPair));
-            if (decoded.val.dict == NULL) {
-                fprintf(stderr, "Memory reallocation failed\n");
-                exit(1);
+        }
+        pair.key = parser_store_string(parser, key, pair.key_length);
+        if (pair.key == NULL) {
+            parse_error(parser, "Memory allocation failed");
+            goto fail;
+        }
+
+        if (parse_value(parser, &pair.val) < 0) {
+            if (parser->arena == NULL) {
+                free(pair.key);
             }
-            decoded.val.dict[decoded.size].key = strndup(key_obj.val.str, key_obj.val.length);
-            if (decoded.val.dict[decoded.size].key == NULL) {
-                fprintf(stderr, "Memory allocation failed\n");
-                exit(1);
+            goto fail;
+        }
+        if (push_pair(parser, &pair) < 0) {
+            if (parser->arena == NULL) {
+                free(pair.key);
             }
-            decoded.val.dict[decoded.size].val = value;
-            decoded.size++;
+            parser_discard(parser, pair.val);
+            goto fail;
         }
+    }
+
+    if (parser->pos >= parser->length) {
+        parse_error(parser, "Unterminated dictionary");
+        goto fail;
+    }
+    parser->pos++; // Skip 'e'
+
+    size_t count = parser->pairs_count - base;
+    if (count > 0) {
+        decoded->val.dict = parser_alloc(parser, count * sizeof(KeyValPair));
+        if (decoded->val.dict == NULL) {
+            parse_error(parser, "Memory allocation failed");
+            goto fail;
+        }
+        memcpy(decoded->val.dict, &parser->pairs[base], count * sizeof(KeyValPair));
+    }
+    if (count >= DICT_INDEX_THRESHOLD && count < UINT32_MAX) {
+        decoded->val.index = build_dict_index(parser->arena, decoded->val.dict, count);
+        if (decoded->val.index == NULL) {
+            if (parser->arena == NULL) {
+                free(decoded->val.dict);
+            }
+            decoded->val.dict = NULL;
+            parse_error(parser, "Memory allocation failed");
+            goto fail;
+        }
+    }
+    decoded->size = count;
+    parser->pairs_count = base;
+    return 0;
+
+fail:
+    while (parser->pairs_count > base) {
+        KeyValPair pair = parser->pairs[--parser->pairs_count];
+        if (parser->arena == NULL) {
+            free(pair.key);
+        }
+        parser_discard(parser, pair.val);
+    }
+    return -1;
+}
+
+// Decode one value at the cursor and record its byte range. on failure nothing is left allocated for it
+static int parse_value(Parser *parser, DecodedValue *decoded) {
+    memset(decoded, 0, sizeof(*decoded));
+    if (parser->pos >= parser->length) {
+        return parse_error(parser, "Unexpected end of buffer");
+    }
+
+    size_t start = parser->pos;
+    char c = parser->data[parser->pos];
+    int status;
+    if (is_digit(c)) {
+        status = decode_string(parser, decoded);
+    } else if (c == 'i') {
+        status = decode_integer(parser, decoded);
+    } else if (c == 'l' || c == 'd') {
+        if (++parser->depth > MAX_DECODE_DEPTH) {
+            return parse_error(parser, "Nesting too deep");
+        }
+        status = (c == 'l') ? decode_list(parser, decoded) : decode_dict(parser, decoded);
+        parser->depth--;
     } else {
-        fprintf(stderr, "Invalid dictionary format: %s\n", bencoded_value);
-        exit(1);
+        return parse_error(parser, "Unsupported encoded value");
+    }
+
+    decoded->raw_offset = start;
+    decoded->raw_length = parser->pos - start;
+    return status;
+}
+
+// Run the parser over a whole buffer and release its scratch stacks
+static size_t run_parser(Parser *parser, DecodedValue *decoded) {
+    int status = parse_value(parser, decoded);
+    free(parser->values);
+    free(parser->pairs);
+    if (status < 0) {
+        return 0;
+    }
+    decode_error_message[0] = '\0';
+    return parser->pos;
+}
+
+size_t decode_bencode_buffer(const char *data, size_t length, DecodedValue *decoded) {
+    Parser parser = {.data = data, .length = length, .mode = DECODE_MODE_COPY};
+    return run_parser(&parser, decoded);
+}
+
+size_t decode_bencode_document(const char *data, size_t length, DecodeMode mode, BencodeDocument *document) {
+    // A small first block: view-mode nodes are a fraction of the input, and the arena doubles as it grows
+    arena_init(&document->arena, DOCUMENT_FIRST_BLOCK);
+
+    Parser parser = {.data = data, .length = length, .mode = mode, .arena = &document->arena};
+    size_t consumed = run_parser(&parser, &document->root);
+    if (consumed == 0) {
+        arena_free(&document->arena);
     }
-    return decoded;
+    return consumed;
+}
+
+void free_bencode_document(BencodeDocument *document) {
+    arena_free(&document->arena);
+    memset(&document->root, 0, sizeof(document->root));
 }
 
 // Decode a bencoded value (string, integer, list, or dictionary)
-DecodedValue decode_bencode(const char *bencoded_value) {
-    if (is_digit(bencoded_value[0])) {
-        return decode_string(bencoded_value);
-    } else if (bencoded_value[0] == 'i') {
-        return decode_integer(bencoded_value);
-    } else if (bencoded_value[0] == 'l') {
-        return decode_list(bencoded_value);
-    } else if (bencoded_value[0] == 'd') {
-        return decode_dict(bencoded_value);
-    } else {
-        fprintf(stderr, "Unsupported encoded value: %s\n", bencoded_value);
-        exit(1);
+int decode_bencode(const char *bencoded_value, DecodedValue *decoded) {
+    return decode_bencode_buffer(bencoded_value, strlen(bencoded_value), decoded) == 0 ? -1 : 0;
+}
+
+int find_key(DecodedValue object, const char *key, size_t key_length) {
+    if (object.type != DECODED_VALUE_TYPE_DICT) {
+        return -1;
     }
+
+    const KeyValPair *pairs = object.val.dict;
+    if (object.val.index != NULL) {
+        const DictIndex *index = object.val.index;
+        size_t slot = hash_key(key, key_length) & index->mask;
+        while (index->slots[slot] != 0) {
+            const KeyValPair *pair = &pairs[index->slots[slot] - 1];
+            if (pair->key_length == key_length && memcmp(pair->key, key, key_length) == 0) {
+                return index->slots[slot] - 1;
+            }
+            slot = (slot + 1) & index->mask;
+        }
+        return -1;
+    }
+
+    if (object.val.sorted) {
+        size_t low = 0, high = object.size;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            int order = compare_keys(pairs[mid].key, pairs[mid].key_length, key, key_length);
+            if (order == 0) {
+                return mid;
+            }
+            if (order < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return -1;
+    }
+
+    for (size_t i = 0; i < object.size; i++) {
+        if (pairs[i].key_length == key_length && memcmp(pairs[i].key, key, key_length) == 0) {
+            return i;
+        }
+    }
+    return -1;
 }
 
 // Free the memory allocated for a decoded value
@@ -188,6 +534,7 @@ void free_decoded_value(DecodedValue decoded) {
             free_decoded_value(decoded.val.dict[i].val);
         }
         free(decoded.val.dict);
+        free(decoded.val.index);
     }
 }
 
@@ -196,13 +543,11 @@ void print_decoded_value(DecodedValue decoded) {
     switch (decoded.type) {
         case DECODED_VALUE_TYPE_STR:
             printf("\"");
-            for (size_t i = 0; i < decoded.val.length; i++) {
-                printf("%c", decoded.val.str[i]);
-            }
+            fwrite(decoded.val.str, 1, decoded.val.length, stdout);
             printf("\"");
             break;
         case DECODED_VALUE_TYPE_INT:
-            printf("%lld", decoded.val.integer);
+            printf("%" PRId64, decoded.val.integer);
             break;
         case DECODED_VALUE_TYPE_LIST:
             printf("[");
@@ -217,7 +562,7 @@ void print_decoded_value(DecodedValue decoded) {
         case DECODED_VALUE_TYPE_DICT:
             printf("{");
             for (size_t i = 0; i < decoded.size; i++) {
-                printf("\"%s\": ", decoded.val.dict[i].key);
+                printf("\"%.*s\": ", (int)decoded.val.dict[i].key_length, decoded.val.dict[i].key);
                 print_decoded_value(decoded.val.dict[i].val);
                 if (i < decoded.size - 1) {
                     printf(", ");
@@ -231,67 +576,112 @@ void print_decoded_value(DecodedValue decoded) {
     }
 }
 
-char *decode_value_to_string(DecodedValue decoded) {
-    if (decoded.type == DECODED_VALUE_TYPE_STR) {
-        return strdup(decoded.val.str);
-    } else if (decoded.type == DECODED_VALUE_TYPE_INT) {
-        int length = snprintf(NULL, 0, "%d", decoded.val.integer);
-        char *str = (char *)malloc(length + 1);
-        snprintf(str, length + 1, "%d", decoded.val.integer);
-        return str;
-    } else if (decoded.type == DECODED_VALUE_TYPE_LIST) {
-        // Estimate required buffer size
-        size_t total_length = 2; // For '[' and ']'
-        for (size_t i = 0; i < decoded.size; ++i) {
-            char *element_str = decode_value_to_string(decoded.val.list[i]);
-            total_length += strlen(element_str) + 2; // For element and ", "
-            free(element_str);
-        }
-
-        char *str = (char *)malloc(total_length);
-        str[0] = '[';
-        str[1] = '\0';
+// Write a literal string to the sink
+static int sink_puts(Sink sink, const char *str) {
+    return sink_write(sink, str, strlen(str));
+}
 
-        for (size_t i = 0; i < decoded.size; ++i) {
-            char *element_str = decode_value_to_string(decoded.val.list[i]);
-            strcat(str, element_str);
-            if (i < decoded.size - 1) {
-                strcat(str, ", ");
+int render_decoded_value(DecodedValue decoded, Sink sink) {
+    char number[24];
+    switch (decoded.type) {
+        case DECODED_VALUE_TYPE_STR:
+            return sink_write(sink, decoded.val.str, decoded.val.length);
+        case DECODED_VALUE_TYPE_INT:
+            return sink_write(sink, number, snprintf(number, sizeof(number), "%" PRId64, decoded.val.integer));
+        case DECODED_VALUE_TYPE_LIST:
+            if (sink_puts(sink, "[") < 0) return -1;
+            for (size_t i = 0; i < decoded.size; i++) {
+                if (i > 0 && sink_puts(sink, ", ") < 0) return -1;
+                if (render_decoded_value(decoded.val.list[i], sink) < 0) return -1;
             }
-            free(element_str);
+            return sink_puts(sink, "]");
+        case DECODED_VALUE_TYPE_DICT:
+            if (sink_puts(sink, "{") < 0) return -1;
+            for (size_t i = 0; i < decoded.size; i++) {
+                if (i > 0 && sink_puts(sink, ", ") < 0) return -1;
+                if (sink_write(sink, decoded.val.dict[i].key, decoded.val.dict[i].key_length) < 0) return -1;
+                if (sink_puts(sink, ": ") < 0) return -1;
+                if (render_decoded_value(decoded.val.dict[i].val, sink) < 0) return -1;
+            }
+            return sink_puts(sink, "}");
+        default:
+            return sink_puts(sink, "unknown");
+    }
+}
+
+// Write a JSON string literal. bytes are taken as Latin-1 so binary values stay lossless
+static int render_json_string(const char *str, size_t length, Sink sink) {
+    static const char hex[] = "0123456789abcdef";
+    char chunk[256];
+    size_t used = 0;
+
+    chunk[used++] = '"';
+    for (size_t i = 0; i < length; i++) {
+        // Flush before an escape sequence could overflow the chunk
+        if (used > sizeof(chunk) - 8) {
+            if (sink_write(sink, chunk, used) < 0) return -1;
+            used = 0;
         }
 
-        strcat(str, "]");
-        return str;
-    } else if (decoded.type == DECODED_VALUE_TYPE_DICT) {
-        // Estimate required buffer size
-        size_t total_length = 2; // For '{' and '}'
-        for (size_t i = 0; i < decoded.size; ++i) {
-            char *key_str = decoded.val.dict[i].key;
-            char *value_str = decode_value_to_string(decoded.val.dict[i].val);
-            total_length += strlen(key_str) + strlen(value_str) + 4; // For key, value, ": ", and ", "
-            free(value_str);
+        unsigned char c = (unsigned char)str[i];
+        if (c == '"' || c == '\\') {
+            chunk[used++] = '\\';
+            chunk[used++] = c;
+        } else if (c >= 0x20 && c < 0x7f) {
+            chunk[used++] = c;
+        } else {
+            memcpy(chunk + used, "\\u00", 4);
+            chunk[used + 4] = hex[c >> 4];
+            chunk[used + 5] = hex[c & 0xf];
+            used += 6;
         }
+    }
+    chunk[used++] = '"';
+    return sink_write(sink, chunk, used);
+}
 
-        char *str = (char *)malloc(total_length);
-        str[0] = '{';
-        str[1] = '\0';
-
-        for (size_t i = 0; i < decoded.size; ++i) {
-            char *key_str = decoded.val.dict[i].key;
-            char *value_str = decode_value_to_string(decoded.val.dict[i].val);
-            strcat(str, key_str);
-            strcat(str, ": ");
-            strcat(str, value_str);
-            if (i < decoded.size - 1) {
-                strcat(str, ", ");
+int render_decoded_value_json(DecodedValue decoded, Sink sink) {
+    char number[24];
+    switch (decoded.type) {
+        case DECODED_VALUE_TYPE_STR:
+            return render_json_string(decoded.val.str, decoded.val.length, sink);
+        case DECODED_VALUE_TYPE_INT:
+            return sink_write(sink, number, snprintf(number, sizeof(number), "%" PRId64, decoded.val.integer));
+        case DECODED_VALUE_TYPE_LIST:
+            if (sink_puts(sink, "[") < 0) return -1;
+            for (size_t i = 0; i < decoded.size; i++) {
+                if (i > 0 && sink_puts(sink, ",") < 0) return -1;
+                if (render_decoded_value_json(decoded.val.list[i], sink) < 0) return -1;
             }
-            free(value_str);
-        }
+            return sink_puts(sink, "]");
+        case DECODED_VALUE_TYPE_DICT:
+            if (sink_puts(sink, "{") < 0) return -1;
+            for (size_t i = 0; i < decoded.size; i++) {
+                if (i > 0 && sink_puts(sink, ",") < 0) return -1;
+                if (render_json_string(decoded.val.dict[i].key, decoded.val.dict[i].key_length, sink) < 0) return -1;
+                if (sink_puts(sink, ":") < 0) return -1;
+                if (render_decoded_value_json(decoded.val.dict[i].val, sink) < 0) return -1;
+            }
+            return sink_puts(sink, "}");
+        default:
+            return sink_puts(sink, "null");
+    }
+}
 
-        strcat(str, "}");
-        return str;
-    } else {
-        return strdup("unknown");
+// Render into a fresh heap string with a single growable buffer
+static char *render_to_string(DecodedValue decoded, int (*render)(DecodedValue, Sink)) {
+    Buffer buffer = {0};
+    if (render(decoded, buffer_sink(&buffer)) < 0) {
+        buffer_free(&buffer);
+        return NULL;
     }
+    return buffer.data != NULL ? buffer.data : strdup("");
+}
+
+char *decode_value_to_string(DecodedValue decoded) {
+    return render_to_string(decoded, render_decoded_value);
+}
+
+char *decode_value_to_json(DecodedValue decoded) {
+    return render_to_string(decoded, render_decoded_value_json);
 }
@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include "arena.h"
+#include "sink.h"
 
 // Enum for the type of data that DecodedValue can hold
 typedef enum DecodedValueType {
@@ -29,32 +31,95 @@ typedef struct DecodedValue {
         };
         struct {
             struct KeyValPair *dict;
+            struct DictIndex *index;  // Hash index over the keys, only built for large dicts
+            bool sorted;              // Keys are in strictly ascending order, as bencode requires
         };
     } val;
     size_t size;  // Number of elements in the list, dict or strings
+    size_t raw_offset;  // Where the encoded value starts in the buffer it was decoded from
+    size_t raw_length;  // Encoded length, so the exact source bytes can be hashed or re-sent
 } DecodedValue;
 
 // Structure to implement a type of key and value pair (for the dictionary)
 typedef struct KeyValPair { 
     char *key;
+    size_t key_length;  // Keys are binary safe and not NUL-terminated in view mode
     struct DecodedValue val;
 } KeyValPair;
 
+// Open-addressing hash table over the keys of one dict
+typedef struct DictIndex {
+    size_t mask;        // Number of slots minus one, slots are a power of two
+    uint32_t slots[];   // Position of the pair + 1, 0 marks an empty slot
+} DictIndex;
+
+// Dicts with at least this many keys get a DictIndex while they are decoded
+#define DICT_INDEX_THRESHOLD 16
+
+// First arena block of a document, later blocks double in size
+#define DOCUMENT_FIRST_BLOCK (16 * 1024)
+
+// How the strings of a decoded document are stored
+typedef enum DecodeMode {
+    DECODE_MODE_COPY,  // Strings and keys are NUL-terminated copies, the source buffer may be released
+    DECODE_MODE_VIEW,  // Strings and keys point into the source buffer, which must outlive the document
+} DecodeMode;
+
+// A decoded tree whose nodes all live in a single arena
+typedef struct BencodeDocument {
+    DecodedValue root;
+    Arena arena;
+} BencodeDocument;
+
 // Check if a character is a digit
 bool is_digit(char c);
 
 // Find the length of the bencoded value
 size_t find_value_length(const char *bencoded_string);
 
-// Decode a bencoded value
-DecodedValue decode_bencode(const char *bencoded_value);
+// Decode a bencoded value from a buffer of known length (binary safe, single pass).
+// returns the number of bytes consumed, or 0 on error (see bencode_error)
+size_t decode_bencode_buffer(const char *data, size_t length, DecodedValue *decoded);
+
+// Decode a buffer into an arena-backed document, in view or owning-copy mode.
+// returns the number of bytes consumed, or 0 on error (nothing is left allocated)
+size_t decode_bencode_document(const char *data, size_t length, DecodeMode mode, BencodeDocument *document);
+
+// Release every node of a document at once
+void free_bencode_document(BencodeDocument *document);
+
+// Describes why the last decode on this thread failed
+const char *bencode_error(void);
 
-// Free the memory allocated for a decoded value
+// Decode a NUL-terminated bencoded value. returns 0 on success and -1 on malformed input (see bencode_error)
+int decode_bencode(const char *bencoded_value, DecodedValue *decoded);
+
+// Build the hash index of a finished dict, from 'arena' (or the heap when NULL). NULL when out of memory
+DictIndex *build_dict_index(Arena *arena, const KeyValPair *pairs, size_t count);
+
+// Order two binary keys the way bencode sorts them, returns <0, 0 or >0 like memcmp
+int compare_keys(const char *a, size_t a_length, const char *b, size_t b_length);
+
+// Find the position of a (binary safe) key inside a dict, -1 if missing or not a dict.
+// uses the hash index when present, binary search when the keys are sorted
+int find_key(DecodedValue object, const char *key, size_t key_length);
+
+// Free the memory allocated for a decoded value (not for values owned by a BencodeDocument)
 void free_decoded_value(DecodedValue decoded);
 
 // Print the decoded value
 void print_decoded_value(DecodedValue decoded);
 
+// Render a decoded value as text ("{key: value, ...}") into a sink, in one linear pass
+int render_decoded_value(DecodedValue decoded, Sink sink);
+
+// Render a decoded value as JSON into a sink, non-printable bytes are \u00XX escaped
+int render_decoded_value_json(DecodedValue decoded, Sink sink);
+
+// constructs a string of the decoded value (allocated on the heap)
 char *decode_value_to_string(DecodedValue decoded);
 
+// constructs a JSON string of the decoded value (allocated on the heap)
+char *decode_value_to_json(DecodedValue decoded);
+
 #endif // DECODE_H
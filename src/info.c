@@ -1,14 +1,19 @@
+#define _GNU_SOURCE // asprintf
 #include "info.h"
-#include "bencode.h"
 #include "sha1.h"
+#include "tape.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
 
-char *read_torrent_file(const char *file_name) {
+static _Thread_local char info_error_message[256] = "";
+
+char *read_torrent_file(const char *file_name, size_t *file_size_out) {
     FILE *file = fopen(file_name, "rb");
     if (file == NULL) {
-        fprintf(stderr, "Failed to open file: %s\n", file_name);
+        info_set_error("Failed to open file: %s", file_name);
         return NULL;
     }
 
@@ -19,14 +24,14 @@ char *read_torrent_file(const char *file_name) {
 
     char *content = malloc(file_size + 1);
     if (content == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
+        info_set_error("Memory allocation failed");
         fclose(file);
         return NULL;
     }
 
     size_t read_size = fread(content, 1, file_size, file);
     if (read_size != file_size) {
-        fprintf(stderr, "Error reading file\n");
+        info_set_error("Error reading file: %s", file_name);
         free(content);
         fclose(file);
         return NULL;
@@ -34,218 +39,676 @@ char *read_torrent_file(const char *file_name) {
 
     content[file_size] = '\0';
     fclose(file);
+    *file_size_out = read_size;
     return content;
 }
 
 int find_index(DecodedValue object, const char *str) {
-    if (object.type != DECODED_VALUE_TYPE_DICT) {
-        fprintf(stderr, "Decoded object is not a dictionary\n");
-        exit(1);
+    return find_key(object, str, strlen(str)); // -1 for a missing key and for anything that is not a dict
+}
+
+const char *info_error(void) {
+    return info_error_message;
+}
+
+void info_set_error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(info_error_message, sizeof(info_error_message), format, args);
+    va_end(args);
+}
+
+// Look up a key of the expected type, NULL if it is missing or has another type
+static const DecodedValue *dict_lookup(DecodedValue dict, const char *key, DecodedValueType type) {
+    int index = find_key(dict, key, strlen(key));
+    if (index < 0 || dict.val.dict[index].val.type != type) {
+        return NULL;
     }
+    return &dict.val.dict[index].val;
+}
 
-    for (size_t i = 0; i < object.size; i++) {
-        if (strcmp(object.val.dict[i].key, str) == 0) {
-            return i;
+// A path component must stay inside the download directory
+static bool valid_path_component(const char *str, size_t length) {
+    if (length == 0 || memchr(str, '/', length) != NULL || memchr(str, '\0', length) != NULL) {
+        return false;
+    }
+    return !(length == 1 && str[0] == '.') && !(length == 2 && str[0] == '.' && str[1] == '.');
+}
+
+// Join the components of a 'path' list with '/', NULL if the list is empty or a component is unsafe
+static char *join_path(DecodedValue path) {
+    size_t total = 0;
+    for (size_t i = 0; i < path.size; i++) {
+        DecodedValue component = path.val.list[i];
+        if (component.type != DECODED_VALUE_TYPE_STR || !valid_path_component(component.val.str, component.val.length)) {
+            return NULL;
         }
+        total += component.val.length + 1;
+    }
+    if (total == 0) {
+        return NULL;
     }
 
-    return -1;
+    char *joined = malloc(total);
+    if (joined == NULL) {
+        return NULL;
+    }
+    char *p = joined;
+    for (size_t i = 0; i < path.size; i++) {
+        memcpy(p, path.val.list[i].val.str, path.val.list[i].val.length);
+        p += path.val.list[i].val.length;
+        *p++ = '/';
+    }
+    p[-1] = '\0';
+    return joined;
 }
 
-MetaInfo info_extract(const char *content) {
-    MetaInfo file_contents = {};
-    DecodedValue decoded_content = decode_bencode(content);
-    if (decoded_content.type != DECODED_VALUE_TYPE_DICT) {
-        fprintf(stderr, "Torrent file is not a valid bencode dictionary\n");
-        exit(1);
+// Fill the file table from either 'length' (single file named after the torrent) or the 'files' list
+static int extract_files(DecodedValue info_dict, MetaInfo *info) {
+    const DecodedValue *length = dict_lookup(info_dict, "length", DECODED_VALUE_TYPE_INT);
+    const DecodedValue *files = dict_lookup(info_dict, "files", DECODED_VALUE_TYPE_LIST);
+    if ((length == NULL) == (files == NULL)) {
+        info_set_error("Torrent must have exactly one of 'length' or 'files'");
+        return -1;
     }
 
-    // Check for index
-    int announce_index = find_index(decoded_content, "announce");
-    int info_index = find_index(decoded_content, "info");
+    if (length != NULL) {
+        if (length->val.integer < 0) {
+            info_set_error("Length value is negative");
+            return -1;
+        }
+        info->files = calloc(1, sizeof(*info->files));
+        if (info->files == NULL || (info->files[0].path = strdup(info->name)) == NULL) {
+            info_set_error("Memory allocation for the file table failed");
+            return -1;
+        }
+        info->num_files = 1;
+        info->files[0].length = info->length = length->val.integer;
+        return 0;
+    }
 
-    if (announce_index == -1) {
-        fprintf(stderr, "Announce key not found\n");
-        exit(1);
+    if (files->size == 0) {
+        info_set_error("Files list is empty");
+        return -1;
+    }
+    info->files = calloc(files->size, sizeof(*info->files));
+    if (info->files == NULL) {
+        info_set_error("Memory allocation for the file table failed");
+        return -1;
     }
+    info->multi_file = true;
+
+    size_t offset = 0;
+    for (size_t i = 0; i < files->size; i++) {
+        DecodedValue entry = files->val.list[i];
+        const DecodedValue *file_length = entry.type == DECODED_VALUE_TYPE_DICT ? dict_lookup(entry, "length", DECODED_VALUE_TYPE_INT) : NULL;
+        const DecodedValue *path = entry.type == DECODED_VALUE_TYPE_DICT ? dict_lookup(entry, "path", DECODED_VALUE_TYPE_LIST) : NULL;
+        if (file_length == NULL || file_length->val.integer < 0 || path == NULL) {
+            info_set_error("File %zu has no valid length or path", i);
+            return -1;
+        }
+        if ((size_t)file_length->val.integer > SIZE_MAX - offset) {
+            info_set_error("Total length of the files overflows");
+            return -1;
+        }
 
-    if (info_index == -1) {
-        fprintf(stderr, "Info key not found\n");
-        exit(1);
+        TorrentFile *file = &info->files[info->num_files++];
+        const DecodedValue *attr = dict_lookup(entry, "attr", DECODED_VALUE_TYPE_STR);
+        file->padding = attr != NULL && memchr(attr->val.str, 'p', attr->val.length) != NULL;
+        file->path = join_path(*path);
+        if (file->path == NULL) {
+            info_set_error("File %zu has an empty or unsafe path", i);
+            return -1;
+        }
+        file->length = file_length->val.integer;
+        file->offset = offset;
+        offset += file->length;
     }
+    info->length = offset;
+    return 0;
+}
 
-    DecodedValue info_dict = decoded_content.val.dict[info_index].val;
-    int pieces_index = find_index(info_dict, "pieces");
-    int length_index = find_index(info_dict, "length");
+// Piece tables are cache-line aligned so verification loops run over whole lines
+static unsigned char *alloc_piece_table(size_t size) {
+    size_t aligned_size = (size + PIECE_HASHES_ALIGNMENT - 1) & ~(size_t)(PIECE_HASHES_ALIGNMENT - 1);
+    return aligned_alloc(PIECE_HASHES_ALIGNMENT, aligned_size ? aligned_size : PIECE_HASHES_ALIGNMENT);
+}
 
-    // Assign URL
-    if (decoded_content.val.dict[announce_index].val.type == DECODED_VALUE_TYPE_STR) {
-        const char *announce_value = decoded_content.val.dict[announce_index].val.val.str;
-        file_contents.url = malloc(strlen(announce_value) + 1);
-        if (file_contents.url != NULL) {
-            strcpy(file_contents.url, announce_value);
-        } else {
-            fprintf(stderr, "Memory allocation for URL failed\n");
-            exit(1);
+// Files of a v2 'file tree', in tree order
+typedef struct FileTreeList {
+    TorrentFile *files;
+    size_t count;
+    size_t capacity;
+} FileTreeList;
+
+// Collect the files under a 'file tree' node depth first. a file is a node whose only key is ""
+static int walk_file_tree(DecodedValue node, Buffer *path, FileTreeList *list) {
+    const DecodedValue *leaf = dict_lookup(node, "", DECODED_VALUE_TYPE_DICT);
+    if (leaf != NULL) {
+        const DecodedValue *length = dict_lookup(*leaf, "length", DECODED_VALUE_TYPE_INT);
+        const DecodedValue *root = dict_lookup(*leaf, "pieces root", DECODED_VALUE_TYPE_STR);
+        if (node.size != 1 || path->length == 0 || length == NULL || length->val.integer < 0 ||
+            (length->val.integer > 0 && (root == NULL || root->val.length != SHA256_DIGEST_LENGTH))) {
+            info_set_error("Invalid file entry in the file tree: %s", path->data ? path->data : "");
+            return -1;
         }
-    } else {
-        fprintf(stderr, "Announce value is not a string\n");
-        exit(1);
+        if (list->count == list->capacity) {
+            size_t capacity = list->capacity ? list->capacity * 2 : 16;
+            TorrentFile *grown = realloc(list->files, capacity * sizeof(*grown));
+            if (grown == NULL) {
+                info_set_error("Memory allocation for the file tree failed");
+                return -1;
+            }
+            list->files = grown;
+            list->capacity = capacity;
+        }
+        TorrentFile *file = &list->files[list->count];
+        memset(file, 0, sizeof(*file));
+        if ((file->path = strdup(path->data)) == NULL) {
+            info_set_error("Memory allocation for the file tree failed");
+            return -1;
+        }
+        list->count++;
+        file->length = length->val.integer;
+        if (file->length > 0) {
+            memcpy(file->pieces_root, root->val.str, SHA256_DIGEST_LENGTH);
+        }
+        return 0;
     }
 
-    // Assign length
-    if (length_index != -1 && info_dict.val.dict[length_index].val.type == DECODED_VALUE_TYPE_INT) {
-        file_contents.length = info_dict.val.dict[length_index].val.val.integer;
-    } else {
-        fprintf(stderr, "Length value not found or not an integer\n");
-        exit(1);
+    size_t prefix = path->length;
+    for (size_t i = 0; i < node.size; i++) {
+        KeyValPair *pair = &node.val.dict[i];
+        if (pair->val.type != DECODED_VALUE_TYPE_DICT || !valid_path_component(pair->key, pair->key_length)) {
+            info_set_error("Invalid name in the file tree");
+            return -1;
+        }
+        if ((prefix > 0 && buffer_append(path, "/", 1) < 0) || buffer_append(path, pair->key, pair->key_length) < 0 ||
+            walk_file_tree(pair->val, path, list) < 0) {
+            return -1;
+        }
+        path->length = prefix;
+        path->data[prefix] = '\0';
+    }
+    return 0;
+}
+
+// Lay the v2 files out in piece space: every file starts on a piece boundary, the gaps become padding
+static int layout_v2_files(MetaInfo *info, FileTreeList *list) {
+    info->files = calloc(list->count * 2, sizeof(*info->files));
+    if (info->files == NULL) {
+        info_set_error("Memory allocation for the file table failed");
+        return -1;
+    }
+    info->multi_file = !(list->count == 1 && strcmp(list->files[0].path, info->name) == 0);
+
+    size_t offset = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        TorrentFile *file = &info->files[info->num_files++];
+        *file = list->files[i];
+        list->files[i].path = NULL; // Moved
+        file->offset = offset;
+        if (file->length > SIZE_MAX - offset - info->piece_length) {
+            info_set_error("Total length of the files overflows");
+            return -1;
+        }
+        offset += file->length;
+
+        size_t tail = file->length % info->piece_length;
+        if (tail != 0 && i + 1 < list->count) {
+            TorrentFile *pad = &info->files[info->num_files++];
+            pad->padding = true;
+            pad->length = info->piece_length - tail;
+            pad->offset = offset;
+            if (asprintf(&pad->path, ".pad/%zu", pad->length) < 0) {
+                pad->path = NULL;
+                info_set_error("Memory allocation for the file table failed");
+                return -1;
+            }
+            offset += pad->length;
+        }
+    }
+    info->length = offset;
+    info->num_pieces = (offset + info->piece_length - 1) / info->piece_length;
+    return 0;
+}
+
+// A hybrid torrent describes the same files twice, the v1 list (with pad files) must match the tree
+static int match_v1_files(MetaInfo *info, FileTreeList *list) {
+    size_t next = 0;
+    for (size_t i = 0; i < info->num_files; i++) {
+        TorrentFile *file = &info->files[i];
+        if (file->padding) {
+            continue;
+        }
+        if (next == list->count || strcmp(file->path, list->files[next].path) != 0 ||
+            file->length != list->files[next].length || (file->length > 0 && file->offset % info->piece_length != 0)) {
+            info_set_error("The v1 and v2 file lists of the hybrid torrent differ at %s", file->path);
+            return -1;
+        }
+        memcpy(file->pieces_root, list->files[next++].pieces_root, SHA256_DIGEST_LENGTH);
+    }
+    if (next != list->count) {
+        info_set_error("The v1 and v2 file lists of the hybrid torrent differ");
+        return -1;
+    }
+    return 0;
+}
+
+// Fill piece_roots from the 'piece layers' of the torrent, checking every layer against its file's root
+static int extract_piece_roots(MetaInfo *info, const DecodedValue *layers) {
+    unsigned char pad[SHA256_DIGEST_LENGTH];
+    if (!merkle_pad_hash(info->piece_length / MERKLE_BLOCK_SIZE, pad)) {
+        info_set_error("SHA-256 hash computation failed");
+        return -1;
+    }
+    info->piece_roots = alloc_piece_table(info->num_pieces * SHA256_DIGEST_LENGTH);
+    if (info->piece_roots == NULL) {
+        info_set_error("Memory allocation for piece roots failed");
+        return -1;
+    }
+    memset(info->piece_roots, 0, info->num_pieces * SHA256_DIGEST_LENGTH);
+
+    for (size_t i = 0; i < info->num_files; i++) {
+        const TorrentFile *file = &info->files[i];
+        if (file->padding || file->length == 0) {
+            continue;
+        }
+        size_t first = file->offset / info->piece_length;
+        size_t count = (file->length + info->piece_length - 1) / info->piece_length;
+        unsigned char *roots = info->piece_roots + first * SHA256_DIGEST_LENGTH;
+        if (first + count > info->num_pieces) {
+            info_set_error("File %s reaches past the last piece", file->path);
+            return -1;
+        }
+        if (count == 1) {
+            memcpy(roots, file->pieces_root, SHA256_DIGEST_LENGTH); // The file's root is its only piece
+            continue;
+        }
+
+        int index = layers != NULL ? find_key(*layers, (const char *)file->pieces_root, SHA256_DIGEST_LENGTH) : -1;
+        const DecodedValue *layer = index >= 0 ? &layers->val.dict[index].val : NULL;
+        unsigned char root[SHA256_DIGEST_LENGTH];
+        if (layer == NULL || layer->type != DECODED_VALUE_TYPE_STR || layer->val.length != count * SHA256_DIGEST_LENGTH) {
+            info_set_error("Piece layer of %s is missing or has the wrong size", file->path);
+            return -1;
+        }
+        if (!merkle_root((const unsigned char *)layer->val.str, count, merkle_width(count), pad, root) ||
+            memcmp(root, file->pieces_root, SHA256_DIGEST_LENGTH) != 0) {
+            info_set_error("Piece layer of %s does not match its pieces root", file->path);
+            return -1;
+        }
+        memcpy(roots, layer->val.str, layer->val.length);
+    }
+    return 0;
+}
+
+// Parse the v2 (BEP 52) half of a torrent: the file tree, and the piece layers from the outer dict (NULL if absent)
+static int extract_v2(DecodedValue info_dict, const DecodedValue *layers, MetaInfo *info, bool hybrid) {
+    const DecodedValue *tree = dict_lookup(info_dict, "file tree", DECODED_VALUE_TYPE_DICT);
+    if (tree == NULL || tree->size == 0) {
+        info_set_error("File tree not found or empty");
+        return -1;
+    }
+    if (info->piece_length < MERKLE_BLOCK_SIZE || (info->piece_length & (info->piece_length - 1)) != 0) {
+        info_set_error("v2 piece length must be a power of two of at least %d", MERKLE_BLOCK_SIZE);
+        return -1;
+    }
+
+    Buffer path = {0};
+    FileTreeList list = {0};
+    int status = walk_file_tree(*tree, &path, &list);
+    if (status == 0) {
+        status = hybrid ? match_v1_files(info, &list) : layout_v2_files(info, &list);
+    }
+    if (status == 0) {
+        status = extract_piece_roots(info, layers);
+    }
+
+    for (size_t i = 0; i < list.count; i++) {
+        free(list.files[i].path);
+    }
+    free(list.files);
+    buffer_free(&path);
+    return status;
+}
+
+int info_extract(const char *content, size_t length, MetaInfo *info) {
+    MetaInfo file_contents = {.owns_piece_hashes = true};
+    // Index the whole file in one pass, then build trees only for the parts that are read below. they
+    // borrow from 'content', everything needed is copied out
+    BencodeTape tape;
+    BencodeDocument document = {0}, layers_document = {0};
+    if (tape_build(&tape, content, length) == 0) {
+        info_set_error("Torrent file is not valid bencode: %s", tape.error);
+        tape_free(&tape);
+        return -1;
+    }
+    if (tape.entries[0].type != DECODED_VALUE_TYPE_DICT) {
+        info_set_error("Torrent file is not a valid bencode dictionary");
+        goto fail;
+    }
+
+    size_t url_length;
+    const char *url = tape_string(&tape, tape_find_key(&tape, 0, "announce", strlen("announce")), &url_length);
+    long info_entry = tape_find_key(&tape, 0, "info", strlen("info"));
+    if (url == NULL) {
+        info_set_error("Announce key not found or not a string");
+        goto fail;
+    }
+    if (info_entry < 0 || tape.entries[info_entry].type != DECODED_VALUE_TYPE_DICT) {
+        info_set_error("Info key not found or not a dictionary");
+        goto fail;
+    }
+    if (tape_materialize(&tape, info_entry, DECODE_MODE_VIEW, &document) == 0) {
+        info_set_error("Memory allocation for the info dictionary failed");
+        goto fail;
+    }
+    DecodedValue info_dict = document.root;
+
+    // Assign URL
+    file_contents.url = strndup(url, url_length);
+    if (file_contents.url == NULL) {
+        info_set_error("Memory allocation for URL failed");
+        goto fail;
     }
 
     // Assign piece length
-    int piece_length_index = find_index(info_dict, "piece length");
-    if (piece_length_index != -1 && info_dict.val.dict[piece_length_index].val.type == DECODED_VALUE_TYPE_INT) {
-        file_contents.piece_length = info_dict.val.dict[piece_length_index].val.val.integer;
-    } else {
-        fprintf(stderr, "Piece length value not found or not an integer\n");
-        exit(1);
+    const DecodedValue *piece_length = dict_lookup(info_dict, "piece length", DECODED_VALUE_TYPE_INT);
+    if (piece_length == NULL || piece_length->val.integer <= 0) {
+        info_set_error("Piece length value not found or not a positive integer");
+        goto fail;
+    }
+    file_contents.piece_length = piece_length->val.integer;
+
+    // v1 torrents carry 'pieces', v2 ones 'meta version' 2 and a file tree, hybrids both
+    const DecodedValue *meta_version = dict_lookup(info_dict, "meta version", DECODED_VALUE_TYPE_INT);
+    const DecodedValue *pieces = dict_lookup(info_dict, "pieces", DECODED_VALUE_TYPE_STR);
+    bool v2 = meta_version != NULL && meta_version->val.integer == 2;
+    if (meta_version != NULL && !v2) {
+        info_set_error("Unsupported meta version %lld", (long long)meta_version->val.integer);
+        goto fail;
+    }
+    if (pieces == NULL && !v2) {
+        info_set_error("Pieces value not found or not a string");
+        goto fail;
     }
 
-    // Assign info hash
-    EncodedString bencoded_info = encode_decode(decoded_content.val.dict[info_index].val);
-    unsigned char hash[SHA1_DIGEST_LENGTH];
-    if (!sha1_hash((const unsigned char *)bencoded_info.str, bencoded_info.length, hash)) {
-        fprintf(stderr, "SHA-1 hash computation failed\n");
-        free(bencoded_info.str);
-        exit(1);
+    // Assign name and the file layout, which also gives the total length
+    const DecodedValue *name = dict_lookup(info_dict, "name", DECODED_VALUE_TYPE_STR);
+    if (name == NULL || !valid_path_component(name->val.str, name->val.length)) {
+        info_set_error("Name value not found or not a valid file name");
+        goto fail;
+    }
+    file_contents.name = strndup(name->val.str, name->val.length);
+    if (file_contents.name == NULL) {
+        info_set_error("Memory allocation for name failed");
+        goto fail;
+    }
+    if (pieces != NULL) {
+        if (extract_files(info_dict, &file_contents) < 0) goto fail;
+        if (pieces->val.length % SHA1_DIGEST_LENGTH != 0) {
+            info_set_error("Pieces value is not a multiple of %d bytes", SHA1_DIGEST_LENGTH);
+            goto fail;
+        }
+        file_contents.num_pieces = pieces->val.length / SHA1_DIGEST_LENGTH;
+        if (file_contents.num_pieces != (file_contents.length + file_contents.piece_length - 1) / file_contents.piece_length) {
+            info_set_error("Piece count does not match the torrent length");
+            goto fail;
+        }
+    }
+    if (v2) {
+        long layers = tape_find_key(&tape, 0, "piece layers", strlen("piece layers"));
+        if (layers >= 0 && tape.entries[layers].type == DECODED_VALUE_TYPE_DICT &&
+            tape_materialize(&tape, layers, DECODE_MODE_VIEW, &layers_document) == 0) {
+            info_set_error("Memory allocation for the piece layers failed");
+            goto fail;
+        }
+        if (extract_v2(info_dict, layers_document.root.type == DECODED_VALUE_TYPE_DICT ? &layers_document.root : NULL,
+                       &file_contents, pieces != NULL) < 0) {
+            goto fail;
+        }
     }
 
-    // Allocate memory for the hash and copy it
+    // Assign info hashes, straight from the info dict's bytes in the file so they match byte for byte.
+    // a v2-only torrent is known to trackers and peers by its SHA-256 truncated to 20 bytes
+    const unsigned char *info_bytes = (const unsigned char *)content + tape.entries[info_entry].offset;
     file_contents.info_hash = malloc(SHA1_DIGEST_LENGTH);
     if (file_contents.info_hash == NULL) {
-        fprintf(stderr, "Memory allocation for info hash failed\n");
-        free(bencoded_info.str);
-        exit(1);
-    }
-    memcpy(file_contents.info_hash, hash, SHA1_DIGEST_LENGTH);
-
-    // Assign pieces hashes
-    if (pieces_index != -1 && info_dict.val.dict[pieces_index].val.type == DECODED_VALUE_TYPE_STR) {
-        const char *pieces_value = info_dict.val.dict[pieces_index].val.val.str;
-        size_t pieces_length = info_dict.val.dict[pieces_index].val.val.length;
-
-        file_contents.num_pieces = pieces_length / SHA1_DIGEST_LENGTH;
-        file_contents.pieces_hashes = malloc(file_contents.num_pieces * sizeof(unsigned char *));
-        if (file_contents.pieces_hashes == NULL) {
-            fprintf(stderr, "Memory allocation for pieces hashes array failed\n");
-            free(bencoded_info.str);
-            exit(1);
-        }
-
-        for (size_t i = 0; i < file_contents.num_pieces; i++) {
-            file_contents.pieces_hashes[i] = malloc(SHA1_DIGEST_LENGTH);
-            if (file_contents.pieces_hashes[i] == NULL) {
-                fprintf(stderr, "Memory allocation for piece hash failed\n");
-                for (size_t j = 0; j < i; j++) {
-                    free(file_contents.pieces_hashes[j]);
-                }
-                free(file_contents.pieces_hashes);
-                free(bencoded_info.str);
-                exit(1);
-            }
-            memcpy(file_contents.pieces_hashes[i], pieces_value + i * 20, 20);
+        info_set_error("Memory allocation for info hash failed");
+        goto fail;
+    }
+    if (v2) {
+        file_contents.info_hash_v2 = malloc(SHA256_DIGEST_LENGTH);
+        if (file_contents.info_hash_v2 == NULL || !sha256_hash(info_bytes, info_dict.raw_length, file_contents.info_hash_v2)) {
+            info_set_error("SHA-256 hash computation failed");
+            goto fail;
         }
-    } else {
-        fprintf(stderr, "Pieces value not found or not a string\n");
-        free(bencoded_info.str);
-        exit(1);
+        memcpy(file_contents.info_hash, file_contents.info_hash_v2, SHA1_DIGEST_LENGTH);
+    }
+    if (pieces != NULL && !sha1_hash(info_bytes, info_dict.raw_length, file_contents.info_hash)) {
+        info_set_error("SHA-1 hash computation failed");
+        goto fail;
+    }
+
+    // Assign pieces hashes, one contiguous table instead of an allocation per piece
+    if (pieces != NULL) {
+        size_t table_size = file_contents.num_pieces * SHA1_DIGEST_LENGTH;
+        file_contents.piece_hashes = alloc_piece_table(table_size);
+        if (file_contents.piece_hashes == NULL) {
+            info_set_error("Memory allocation for pieces hashes failed");
+            goto fail;
+        }
+        memcpy(file_contents.piece_hashes, pieces->val.str, table_size);
     }
 
-    // Free the encoded string
-    free(bencoded_info.str);
+    // Free the decoded trees and the index
+    free_bencode_document(&layers_document);
+    free_bencode_document(&document);
+    tape_free(&tape);
 
-    return file_contents;
+    *info = file_contents;
+    return 0;
+
+fail:
+    free_info(file_contents);
+    free_bencode_document(&layers_document);
+    free_bencode_document(&document);
+    tape_free(&tape);
+    return -1;
 }
 
 void free_info(MetaInfo info) {
+    for (size_t i = 0; i < info.num_files; i++) {
+        free(info.files[i].path);
+    }
+    free(info.files);
     free(info.url);
     free(info.name);
     free(info.pieces);
-    for (size_t i = 0; i < info.num_pieces; i++) {
-        free(info.pieces_hashes[i]);
+    if (info.owns_piece_hashes) {
+        free(info.piece_hashes);
+        free(info.piece_roots);
     }
-    free(info.pieces_hashes);
+    unmap_file(&info.backing);
     free(info.info_hash);
+    free(info.info_hash_v2);
 }
 
-void print_meta_info(MetaInfo info) {
-    if (info.url != NULL) {
-        printf("Tracker URL: %s\n", info.url);
-    }
-    printf("Length: %zu\n", info.length);
-    if (info.info_hash != NULL) {
-        printf("Info Hash: ");
-        for (int i = 0; i < SHA1_DIGEST_LENGTH; i++) {
-            printf("%02x", (unsigned char)info.info_hash[i]);
+size_t info_file_at(const MetaInfo *info, size_t position) {
+    // Files are sorted by offset and a zero-length file shares its offset with the next one,
+    // so the last file starting at or before 'position' is always the non-empty one
+    size_t low = 0, high = info->num_files;
+    while (high - low > 1) {
+        size_t middle = low + (high - low) / 2;
+        if (info->files[middle].offset <= position) {
+            low = middle;
+        } else {
+            high = middle;
         }
-        printf("\n");
     }
-    printf("Piece Length: %zu\n", info.piece_length);
-    printf("Piece Hashes:\n");
-    for (size_t i = 0; i < info.num_pieces; i++) {
-        for (int j = 0; j < SHA1_DIGEST_LENGTH; j++) {
-            printf("%02x", (unsigned char)info.pieces_hashes[i][j]);
+    return low;
+}
+
+size_t info_piece_tree_width(const MetaInfo *info, size_t index) {
+    const TorrentFile *file = &info->files[info_file_at(info, index * info->piece_length)];
+    if (file->length <= info->piece_length) {
+        return merkle_width((file->length + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE);
+    }
+    return info->piece_length / MERKLE_BLOCK_SIZE;
+}
+
+// Write bytes as lowercase hex, staged through a stack buffer so the sink sees large writes
+static int render_hex(Sink sink, const unsigned char *bytes, size_t length, size_t group, const char *separator) {
+    static const char hex[] = "0123456789abcdef";
+    char chunk[4096];
+    size_t used = 0;
+    size_t separator_length = strlen(separator);
+
+    for (size_t i = 0; i < length; i++) {
+        if (used + 2 + separator_length > sizeof(chunk)) {
+            if (sink_write(sink, chunk, used) < 0) return -1;
+            used = 0;
+        }
+        chunk[used++] = hex[bytes[i] >> 4];
+        chunk[used++] = hex[bytes[i] & 0xf];
+        if ((i + 1) % group == 0) {
+            memcpy(chunk + used, separator, separator_length);
+            used += separator_length;
         }
-        printf("\n");
     }
+    return sink_write(sink, chunk, used);
 }
 
-// Convert meta info to string
-char* meta_info_to_string(MetaInfo info) {
-    char *result = NULL;
-    size_t result_size = 0;
-    char buffer[1024];
+int render_meta_info(MetaInfo info, Sink sink) {
+    Buffer header = {0};
+    int status = 0;
 
     if (info.url != NULL) {
-        result_size = snprintf(NULL, 0, "Tracker URL: %s\n", info.url) + 1;
-        result = (char*)malloc(result_size);
-        snprintf(result, result_size, "Tracker URL: %s\n", info.url);
-    } else {
-        result = (char*)malloc(1);
-        result[0] = '\0';
+        status |= buffer_printf(&header, "Tracker URL: %s\n", info.url);
     }
-
-    result_size += snprintf(buffer, sizeof(buffer), "Length: %zu\n", info.length);
-    result = (char*)realloc(result, result_size + 1);
-    strcat(result, buffer);
+    if (info.name != NULL) {
+        status |= buffer_printf(&header, "Name: %s\n", info.name);
+    }
+    status |= buffer_printf(&header, "Length: %zu\n", info.length);
+    if (info.multi_file) {
+        status |= buffer_printf(&header, "Files:\n");
+        for (size_t i = 0; i < info.num_files; i++) {
+            status |= buffer_printf(&header, "  %s (%zu)\n", info.files[i].path, info.files[i].length);
+        }
+    }
+    if (status < 0 || sink_write(sink, header.data, header.length) < 0) {
+        buffer_free(&header);
+        return -1;
+    }
+    buffer_free(&header);
 
     if (info.info_hash != NULL) {
-        strcat(result, "Info Hash: ");
-        result_size += 11; // Length of "Info Hash: "
+        if (sink_write(sink, "Info Hash: ", 11) < 0) return -1;
+        if (render_hex(sink, info.info_hash, SHA1_DIGEST_LENGTH, SHA1_DIGEST_LENGTH, "\n") < 0) return -1;
+    }
+    if (info.info_hash_v2 != NULL) {
+        if (sink_write(sink, "Info Hash v2: ", 14) < 0) return -1;
+        if (render_hex(sink, info.info_hash_v2, SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH, "\n") < 0) return -1;
+    }
 
-        for (int i = 0; i < SHA1_DIGEST_LENGTH; i++) {
-            snprintf(buffer, sizeof(buffer), "%02x", (unsigned char)info.info_hash[i]);
-            result_size += 2;
-            result = (char*)realloc(result, result_size + 1);
-            strcat(result, buffer);
+    // One hash per line, straight from the contiguous table (the v2 roots when there are no SHA-1s)
+    bool v1 = info.piece_hashes != NULL;
+    char line[128];
+    int length = snprintf(line, sizeof(line), "Piece Length: %zu\n%s:\n", info.piece_length, v1 ? "Piece Hashes" : "Piece Roots");
+    if (sink_write(sink, line, length) < 0) return -1;
+
+    size_t digest_length = v1 ? SHA1_DIGEST_LENGTH : SHA256_DIGEST_LENGTH;
+    return render_hex(sink, v1 ? info.piece_hashes : info.piece_roots, info.num_pieces * digest_length, digest_length, "\n");
+}
+
+// Write a NUL-terminated string as a JSON string literal
+static int render_json_string(const char *str, Sink sink) {
+    DecodedValue value = {.type = DECODED_VALUE_TYPE_STR, .val.str = (char *)str, .val.length = strlen(str)};
+    return render_decoded_value_json(value, sink);
+}
+
+// A hash as a JSON hex string, or null when there is none (NULL, or all zero bytes)
+static int render_json_hash(Sink sink, const unsigned char *hash, size_t length) {
+    bool present = false;
+    for (size_t i = 0; hash != NULL && i < length && !present; i++) {
+        present = hash[i] != 0;
+    }
+    if (!present) {
+        return sink_write(sink, "null", 4);
+    }
+    if (sink_write(sink, "\"", 1) < 0 || render_hex(sink, hash, length, length, "\"") < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int render_meta_info_json(MetaInfo info, Sink sink) {
+    Buffer buffer = {0};
+    Sink out = buffer_sink(&buffer);
+    int status = buffer_printf(&buffer, "{\"announce\":");
+    if (info.url != NULL) {
+        status |= render_json_string(info.url, out);
+    } else {
+        status |= buffer_printf(&buffer, "null");
+    }
+    if (info.name != NULL) {
+        status |= buffer_printf(&buffer, ",\"name\":");
+        status |= render_json_string(info.name, out);
+    }
+    status |= buffer_printf(&buffer, ",\"length\":%zu,\"files\":[", info.length);
+    for (size_t i = 0; i < info.num_files; i++) {
+        status |= buffer_printf(&buffer, "%s{\"path\":", i ? "," : "");
+        status |= render_json_string(info.files[i].path, out);
+        status |= buffer_printf(&buffer, ",\"length\":%zu", info.files[i].length);
+        if (info.info_hash_v2 != NULL) { // v2 and hybrid: the root of every file, null for empty and pad files
+            status |= buffer_printf(&buffer, ",\"pieces_root\":");
+            status |= render_json_hash(out, info.files[i].pieces_root, SHA256_DIGEST_LENGTH);
         }
-        strcat(result, "\n");
-        result_size++;
+        status |= buffer_printf(&buffer, "}");
     }
+    status |= buffer_printf(&buffer, "],\"piece_length\":%zu,\"info_hash\":", info.piece_length);
+    status |= render_json_hash(out, info.info_hash, SHA1_DIGEST_LENGTH);
+    status |= buffer_printf(&buffer, ",\"info_hash_v2\":");
+    status |= render_json_hash(out, info.info_hash_v2, SHA256_DIGEST_LENGTH);
+    status |= buffer_printf(&buffer, ",\"pieces\":[");
+    if (status < 0 || sink_write(sink, buffer.data, buffer.length) < 0) {
+        buffer_free(&buffer);
+        return -1;
+    }
+    buffer_free(&buffer);
 
-    result_size += snprintf(buffer, sizeof(buffer), "Piece Length: %zu\nPiece Hashes:\n", info.piece_length);
-    result = (char*)realloc(result, result_size + 1);
-    strcat(result, buffer);
+    if (info.num_pieces > 0 && info.piece_hashes != NULL) {
+        if (sink_write(sink, "\"", 1) < 0) return -1;
+        size_t table_size = (info.num_pieces - 1) * SHA1_DIGEST_LENGTH;
+        if (render_hex(sink, info.piece_hashes, table_size, SHA1_DIGEST_LENGTH, "\",\"") < 0) return -1;
+        if (render_hex(sink, info_piece_hash(&info, info.num_pieces - 1), SHA1_DIGEST_LENGTH, SHA1_DIGEST_LENGTH, "\"") < 0) return -1;
+    }
+    return sink_write(sink, "]}\n", 3);
+}
 
-    for (size_t i = 0; i < info.num_pieces; i++) {
-        for (int j = 0; j < SHA1_DIGEST_LENGTH; j++) {
-            snprintf(buffer, sizeof(buffer), "%02x", (unsigned char)info.pieces_hashes[i][j]);
-            result_size += 2;
-            result = (char*)realloc(result, result_size + 1);
-            strcat(result, buffer);
-        }
-        strcat(result, "\n");
-        result_size++;
+void print_meta_info(MetaInfo info) {
+    render_meta_info(info, file_sink(stdout));
+}
+
+// Convert meta info to string
+char* meta_info_to_string(MetaInfo info) {
+    Buffer buffer = {0};
+    if (buffer_reserve(&buffer, 128 + info.num_pieces * (SHA1_DIGEST_LENGTH * 2 + 1)) < 0 ||
+        render_meta_info(info, buffer_sink(&buffer)) < 0) {
+        buffer_free(&buffer);
+        return NULL;
     }
+    return buffer.data;
+}
 
-    return result;
+// Convert meta info to a JSON document
+char* meta_info_to_json(MetaInfo info) {
+    Buffer buffer = {0};
+    if (buffer_reserve(&buffer, 128 + info.num_pieces * (SHA1_DIGEST_LENGTH * 2 + 3)) < 0 ||
+        render_meta_info_json(info, buffer_sink(&buffer)) < 0) {
+        buffer_free(&buffer);
+        return NULL;
+    }
+    return buffer.data;
 }
@@ -2,30 +2,90 @@
 #define INFO_H
 
 #include "decode.h"
+#include "sink.h"
+#include "mapped_file.h"
 #include <stddef.h>
 
+// One file of the torrent's content, laid end to end with the others in piece space
+typedef struct TorrentFile {
+    char *path;       // Relative path, components joined with '/'
+    size_t length;
+    size_t offset;    // Offset of the file's first byte in the concatenated content
+    bool padding;     // Alignment filler (BEP 47 pad file or implied by v2), never written to disk
+    unsigned char pieces_root[32];  // v2 Merkle root of the file's blocks, zero for v1 and empty files
+} TorrentFile;
+
 typedef struct MetaInfo {
     char *url;
-    size_t length;
+    size_t length;                 // Total length of all files
     char *name;
     size_t piece_length;
     char *pieces;
-    unsigned char *info_hash;
-    unsigned char **pieces_hashes; // Array of pointers to piece hashes
+    unsigned char *info_hash;      // 20 bytes: SHA-1 of the info dict, or the truncated SHA-256 for v2-only torrents
+    unsigned char *info_hash_v2;   // 32-byte SHA-256 of the info dict for v2 and hybrid torrents, NULL otherwise
+    unsigned char *piece_hashes;   // num_pieces x 20 bytes back to back, cache-line aligned when owned
     size_t num_pieces;             // Number of pieces
+    TorrentFile *files;            // Sorted by offset, the extent map pieces are resolved against
+    size_t num_files;
+    bool multi_file;               // 'files' list torrent (a directory) rather than a single 'length' file
+    unsigned char *piece_roots;    // v2: num_pieces x 32-byte Merkle roots of each piece's blocks, NULL for v1 only
+    bool owns_piece_hashes;        // false when the piece tables borrow memory owned elsewhere (e.g. a mapped file)
+    MappedFile backing;            // Mapped cache file borrowed fields point into, unmapped by free_info
 } MetaInfo;
 
-// find the index(location) inside a decoded value by string
+// Alignment of the piece hash table, keeps verification loops on whole cache lines
+#define PIECE_HASHES_ALIGNMENT 64
+
+// returns the 20-byte SHA-1 of piece 'index', NULL if out of range or the torrent is v2 only
+static inline const unsigned char *info_piece_hash(const MetaInfo *info, size_t index) {
+    return index < info->num_pieces && info->piece_hashes != NULL ? info->piece_hashes + index * 20 : NULL;
+}
+
+// returns the 32-byte Merkle root of piece 'index', NULL if out of range or the torrent has no v2 part
+static inline const unsigned char *info_piece_root(const MetaInfo *info, size_t index) {
+    return index < info->num_pieces && info->piece_roots != NULL ? info->piece_roots + index * 32 : NULL;
+}
+
+// returns the size in bytes of piece 'index' (the last piece may be shorter)
+static inline size_t info_piece_size(const MetaInfo *info, size_t index) {
+    size_t begin = index * info->piece_length;
+    return (index + 1 == info->num_pieces) ? info->length - begin : info->piece_length;
+}
+
+// returns the index of the file holding content byte 'position' (< length), never a zero-length file
+size_t info_file_at(const MetaInfo *info, size_t position);
+
+// number of 16 KiB leaves under piece 'index''s Merkle root: the piece's share of the file's tree,
+// or the whole (power of two rounded) tree when the file fits in one piece
+size_t info_piece_tree_width(const MetaInfo *info, size_t index);
+
+// find the index(location) inside a decoded value by string, -1 if it is missing or 'object' is not a dict
 int find_index(DecodedValue object, const char *str);
 
 // constucts a string of the Meta info (useful for ncurses)
 char* meta_info_to_string(MetaInfo info);
 
-// reads the contents of a file and making it a string (allocated on the heap)
-char *read_torrent_file(const char *file_name);
+// constucts a JSON document of the Meta info (for machine consumption)
+char* meta_info_to_json(MetaInfo info);
+
+// writes the Meta info as text into a sink, in one linear pass
+int render_meta_info(MetaInfo info, Sink sink);
+
+// writes the Meta info as JSON into a sink
+int render_meta_info_json(MetaInfo info, Sink sink);
+
+// reads the contents of a file and making it a string (allocated on the heap), stores its size in 'file_size'
+char *read_torrent_file(const char *file_name, size_t *file_size);
+
+// takes away and orgenaize the meta info inside a (torrent) file of 'length' bytes.
+// returns 0 on success, -1 on a malformed torrent (see info_error), nothing is left allocated then
+int info_extract(const char *content, size_t length, MetaInfo *info);
+
+// describes why the last torrent load on this thread failed
+const char *info_error(void);
 
-// takes away and orgenaize the meta info inside a (torrent) file
-MetaInfo info_extract(const char *content);
+// records the reason a torrent load failed, for info_error
+void info_set_error(const char *format, ...) __attribute__((format(printf, 1, 2)));
 
 // free the memory of the info allocated on the heap
 void free_info(MetaInfo info);
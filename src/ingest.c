@@ -0,0 +1,262 @@
+#define _GNU_SOURCE // asprintf
+#include "ingest.h"
+#include "metacache.h"
+#include "sha1.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// A slot is claimed (EMPTY -> BUSY) with a CAS, filled by its owner and then published as READY,
+// so workers insert without locks and readers only ever look at published entries
+enum {
+    SLOT_EMPTY,
+    SLOT_BUSY,
+    SLOT_READY
+};
+
+// Shared by the workers of one load
+typedef struct IngestJob {
+    TorrentLibrary *library;
+    char **paths;
+    char **messages;  // messages[i] is set by whichever worker took paths[i], NULL on success
+    size_t count;
+    atomic_size_t next;
+} IngestJob;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Info hashes are SHA-1 digests, so their first bytes are already uniformly spread
+static size_t slot_of(const TorrentLibrary *library, const unsigned char *info_hash) {
+    uint64_t key;
+    memcpy(&key, info_hash, sizeof(key));
+    return key & (library->capacity - 1);
+}
+
+// Claim the slot for 'info_hash'. returns the entry to fill (BUSY, owned by the caller) or,
+// when the hash is already present, the published entry holding it with 'duplicate' set
+static TorrentEntry *index_claim(TorrentLibrary *library, const unsigned char *info_hash, bool *duplicate) {
+    size_t mask = library->capacity - 1;
+    for (size_t i = slot_of(library, info_hash);; i = (i + 1) & mask) {
+        TorrentEntry *entry = &library->entries[i];
+        int state = SLOT_EMPTY;
+        if (atomic_compare_exchange_strong_explicit(&entry->state, &state, SLOT_BUSY, memory_order_acquire, memory_order_acquire)) {
+            *duplicate = false;
+            return entry;
+        }
+        // Another worker is filling this slot, it may be the same torrent
+        while (state == SLOT_BUSY) {
+            sched_yield();
+            state = atomic_load_explicit(&entry->state, memory_order_acquire);
+        }
+        if (memcmp(entry->info.info_hash, info_hash, SHA1_DIGEST_LENGTH) == 0) {
+            *duplicate = true;
+            return entry;
+        }
+    }
+}
+
+const TorrentEntry *library_find(const TorrentLibrary *library, const unsigned char *info_hash) {
+    if (library->capacity == 0) {
+        return NULL;
+    }
+    size_t mask = library->capacity - 1;
+    for (size_t i = slot_of(library, info_hash);; i = (i + 1) & mask) {
+        const TorrentEntry *entry = &library->entries[i];
+        int state = atomic_load_explicit(&entry->state, memory_order_acquire);
+        if (state == SLOT_EMPTY) {
+            return NULL;
+        }
+        if (state == SLOT_READY && memcmp(entry->info.info_hash, info_hash, SHA1_DIGEST_LENGTH) == 0) {
+            return entry;
+        }
+    }
+}
+
+// Load one file, returns NULL on success or the reason it was rejected
+static char *ingest_file(TorrentLibrary *library, const char *path) {
+    MetaInfo info;
+    if (load_meta_info(path, &info) < 0) {
+        return strdup(info_error());
+    }
+
+    bool duplicate;
+    TorrentEntry *entry = index_claim(library, info.info_hash, &duplicate);
+    if (duplicate) {
+        char *message = NULL;
+        if (asprintf(&message, "Duplicate of %s", entry->path) < 0) {
+            message = NULL;
+        }
+        free_info(info);
+        return message != NULL ? message : strdup("Duplicate info hash");
+    }
+
+    entry->path = strdup(path);
+    entry->info = info;
+    atomic_store_explicit(&entry->state, SLOT_READY, memory_order_release);
+    atomic_fetch_add_explicit(&library->count, 1, memory_order_relaxed);
+    return NULL;
+}
+
+// Workers pull the next unclaimed file until none are left
+static void *ingest_worker(void *arg) {
+    IngestJob *job = arg;
+    for (;;) {
+        size_t i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed);
+        if (i >= job->count) {
+            break;
+        }
+        job->messages[i] = ingest_file(job->library, job->paths[i]);
+    }
+    return NULL;
+}
+
+static bool has_torrent_suffix(const char *name) {
+    size_t length = strlen(name);
+    return length > strlen(".torrent") && strcmp(name + length - strlen(".torrent"), ".torrent") == 0;
+}
+
+// Collect the paths of every *.torrent file directly inside 'directory'
+static char **scan_directory(const char *directory, size_t *count_out) {
+    DIR *dir = opendir(directory);
+    if (dir == NULL) {
+        info_set_error("Failed to open directory: %s", directory);
+        return NULL;
+    }
+
+    char **paths = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (!has_torrent_suffix(ent->d_name) || ent->d_type == DT_DIR) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char **grown = realloc(paths, capacity * sizeof(*paths));
+            if (grown == NULL) {
+                break;
+            }
+            paths = grown;
+        }
+        if (asprintf(&paths[count], "%s/%s", directory, ent->d_name) < 0) {
+            break;
+        }
+        count++;
+    }
+    closedir(dir);
+
+    *count_out = count;
+    return paths != NULL ? paths : calloc(1, sizeof(*paths));
+}
+
+int ingest_directory(const char *directory, int threads, TorrentLibrary *library) {
+    memset(library, 0, sizeof(*library));
+
+    size_t count;
+    char **paths = scan_directory(directory, &count);
+    if (paths == NULL) {
+        return -1;
+    }
+
+    // Half full at most, so probes stay short and a free slot always exists
+    library->capacity = 16;
+    while (library->capacity < count * 2) {
+        library->capacity *= 2;
+    }
+    library->entries = calloc(library->capacity, sizeof(*library->entries));
+    char **messages = calloc(count ? count : 1, sizeof(*messages));
+    if (library->entries == NULL || messages == NULL) {
+        info_set_error("Memory allocation for the torrent index failed");
+        free(messages);
+        for (size_t i = 0; i < count; i++) free(paths[i]);
+        free(paths);
+        free_library(library);
+        return -1;
+    }
+
+    if (threads <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (int)cores : 1;
+    }
+    if ((size_t)threads > count) {
+        threads = count ? (int)count : 1;
+    }
+
+    IngestJob job = {
+        .library = library,
+        .paths = paths,
+        .messages = messages,
+        .count = count,
+    };
+    atomic_init(&job.next, 0);
+
+    double start = now_seconds();
+    pthread_t *workers = malloc(threads * sizeof(*workers));
+    int started = 0;
+    while (workers != NULL && started < threads && pthread_create(&workers[started], NULL, ingest_worker, &job) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        ingest_worker(&job); // No threads available, load on the caller instead
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    library->seconds = now_seconds() - start;
+    library->threads = started ? started : 1;
+    library->files_scanned = count;
+
+    // Errors keep the directory order, whichever worker hit them
+    size_t failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (messages[i] != NULL) failed++;
+    }
+    library->errors = calloc(failed ? failed : 1, sizeof(*library->errors));
+    for (size_t i = 0; i < count; i++) {
+        if (messages[i] == NULL) {
+            free(paths[i]);
+        } else if (library->errors != NULL) {
+            library->errors[library->error_count++] = (IngestError){ .path = paths[i], .message = messages[i] };
+        } else {
+            free(paths[i]);
+            free(messages[i]);
+        }
+    }
+    free(messages);
+    free(paths);
+    return 0;
+}
+
+double library_files_per_second(const TorrentLibrary *library) {
+    return library->seconds > 0 ? library->files_scanned / library->seconds : 0;
+}
+
+void free_library(TorrentLibrary *library) {
+    for (size_t i = 0; i < library->capacity; i++) {
+        TorrentEntry *entry = &library->entries[i];
+        if (atomic_load_explicit(&entry->state, memory_order_relaxed) == SLOT_READY) {
+            free(entry->path);
+            free_info(entry->info);
+        }
+    }
+    free(library->entries);
+    for (size_t i = 0; i < library->error_count; i++) {
+        free(library->errors[i].path);
+        free(library->errors[i].message);
+    }
+    free(library->errors);
+    memset(library, 0, sizeof(*library));
+}
@@ -0,0 +1,46 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include "info.h"
+#include <stdatomic.h>
+#include <stddef.h>
+
+// One loaded torrent, owned by the library's index
+typedef struct TorrentEntry {
+    atomic_int state;  // Slot claim state, see ingest.c
+    char *path;
+    MetaInfo info;
+} TorrentEntry;
+
+// A file that could not be loaded, with the reason
+typedef struct IngestError {
+    char *path;
+    char *message;
+} IngestError;
+
+// Every torrent of a directory, indexed by info hash
+typedef struct TorrentLibrary {
+    TorrentEntry *entries;  // Open-addressing table, 'capacity' is a power of two
+    size_t capacity;
+    atomic_size_t count;
+    IngestError *errors;
+    size_t error_count;
+    size_t files_scanned;
+    int threads;
+    double seconds;  // Wall time of the load
+} TorrentLibrary;
+
+// loads every *.torrent file of 'directory' on 'threads' workers (0 = one per online core).
+// a bad file is recorded in 'errors' and never stops the others; returns -1 only if the directory can't be read
+int ingest_directory(const char *directory, int threads, TorrentLibrary *library);
+
+// finds a loaded torrent by its 20-byte info hash, NULL if there is none
+const TorrentEntry *library_find(const TorrentLibrary *library, const unsigned char *info_hash);
+
+// files loaded (or rejected) per second during the load
+double library_files_per_second(const TorrentLibrary *library);
+
+// free every torrent and error held by the library
+void free_library(TorrentLibrary *library);
+
+#endif
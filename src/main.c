@@ -1,7 +1,16 @@
 #include "info.h"
 #include "decode.h"
+#include "bencode.h"
 #include "tracker.h"
 #include "peer.h"
+#include "metacache.h"
+#include "ingest.h"
+#include "storage.h"
+#include "bench.h"
+#include "recheck.h"
+#include "reactor.h"
+#include "bitfield.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,7 +23,9 @@ void print_usage() {
     printw("  3. List peers from torrent file\n");
     printw("  4. Download specific piece\n");
     printw("  5. Download entire file\n");
-    printw("  6. Quit\n");
+    printw("  6. Load torrent directory\n");
+    printw("  7. Recheck downloaded data\n");
+    printw("  8. Quit\n");
 }
 
 void ncurses_decode() {
@@ -24,12 +35,27 @@ void ncurses_decode() {
     getnstr(encoded_str, sizeof(encoded_str));
     noecho();
 
-    DecodedValue decoded = decode_bencode(encoded_str);
+    DecodedValue decoded;
+    if (decode_bencode_buffer(encoded_str, strlen(encoded_str), &decoded) == 0) {
+        clear();
+        printw("Invalid bencoded string: %s\n", bencode_error());
+        printw("Press any key to continue...");
+        getch();
+        return;
+    }
     clear();
     printw("Decoded value:\n");
     char *decoded_result_str = decode_value_to_string(decoded);
-    printw(decoded_result_str);
+    char *decoded_json_str = decode_value_to_json(decoded);
+    printw("%s\n\nJSON:\n%s", decoded_result_str, decoded_json_str);
+    // Encoding the tree again gives the canonical form, dict keys sorted
+    Buffer canonical = {0};
+    if (bencode_encode_to_sink(decoded, buffer_sink(&canonical)) == 0) {
+        printw("\n\nCanonical bencode:\n%.*s", (int)canonical.length, canonical.data);
+    }
     printw("\nPress any key to continue...");
+    buffer_free(&canonical);
+    free(decoded_json_str);
     free(decoded_result_str);
     free_decoded_value(decoded);
     getch();
@@ -42,21 +68,19 @@ void ncurses_info() {
     getnstr(file_name, sizeof(file_name));
     noecho();
 
-    char *content = read_torrent_file(file_name);
-    if (content == NULL) {
-        printw("Failed to read torrent file: %s\n", file_name);
+    MetaInfo info;
+    if (load_meta_info(file_name, &info) < 0) {
+        printw("Failed to read torrent file %s: %s\n", file_name, info_error());
         printw("Press any key to continue...");
         getch();
         return;
     }
 
-    MetaInfo info = info_extract(content);
     clear();
     char *info_str_result = meta_info_to_string(info);
-    printw(info_str_result);
+    printw("%s", info_str_result);
     free(info_str_result);
     free_info(info);
-    free(content);
     printw("\nPress any key to continue...");
     getch();
 }
@@ -68,22 +92,28 @@ void ncurses_peers() {
     getnstr(file_name, sizeof(file_name));
     noecho();
 
-    char *content = read_torrent_file(file_name);
-    if (content == NULL) {
-        printw("Failed to read torrent file: %s\n", file_name);
+    MetaInfo info;
+    if (load_meta_info(file_name, &info) < 0) {
+        printw("Failed to read torrent file %s: %s\n", file_name, info_error());
         printw("Press any key to continue...");
         getch();
         return;
     }
 
-    MetaInfo info = info_extract(content);
-    PeersList peers = get_peers(info);
+    PeersList peers;
+    if (get_peers(info, &peers) < 0) {
+        printw("Tracker announce failed: %s\n", tracker_error());
+        free_info(info);
+        printw("Press any key to continue...");
+        getch();
+        return;
+    }
     clear();
     char *peers_str_result = peers_list_to_string(peers);
-    printw(peers_str_result);
+    printw("%s", peers_str_result);
+    free(peers_str_result);
     free_peers(peers);
     free_info(info);
-    free(content);
     printw("\nPress any key to continue...");
     getch();
 }
@@ -101,25 +131,38 @@ void ncurses_download_piece() {
     getnstr(torrent_file, sizeof(torrent_file));
     noecho();
 
-    // Read the torrent file content
-    char *content = read_torrent_file(torrent_file);
-    if (content == NULL) {
-        printw("Failed to read torrent file: %s\n", torrent_file);
+    // Load the torrent meta info (cached after the first load)
+    MetaInfo info;
+    if (load_meta_info(torrent_file, &info) < 0) {
+        printw("Failed to read torrent file %s: %s\n", torrent_file, info_error());
         printw("Press any key to continue...");
         getch();
         return;
     }
 
-    // Extract metadata information from the torrent file
-    MetaInfo info = info_extract(content);
-    PeersList peers_list = get_peers(info);
+    if (piece_index < 0 || (size_t)piece_index >= info.num_pieces) {
+        printw("Piece index %d out of range (torrent has %zu pieces)\n", piece_index, info.num_pieces);
+        free_info(info);
+        printw("Press any key to continue...");
+        getch();
+        return;
+    }
+    PeersList peers_list;
+    int announced = get_peers(info, &peers_list);
+    if (announced < 0 || peers_list.count == 0) {
+        printw("%s\n", announced < 0 ? tracker_error() : "The tracker knows no peers");
+        free_peers(peers_list);
+        free_info(info);
+        printw("Press any key to continue...");
+        getch();
+        return;
+    }
 
     // Handshake with the proper peer
     int sockfd = create_socket();
     if (sockfd < 0) {
         free_peers(peers_list);
         free_info(info);
-        free(content);
         return;
     }
 
@@ -130,7 +173,6 @@ void ncurses_download_piece() {
         close(sockfd);
         free_peers(peers_list);
         free_info(info);
-        free(content);
         printw("Press any key to continue...");
         getch();
         return;
@@ -138,18 +180,23 @@ void ncurses_download_piece() {
     free(response);
 
     // Calculate the piece length
-    uint32_t piece_length = (piece_index == info.num_pieces - 1) ? 
-                            info.length - (piece_index * info.piece_length) : 
-                            info.piece_length;
-
-    // Download the specified piece
-    char *piece_data = download_piece(sockfd, piece_index, piece_length);
-    if (!verify_piece(piece_data, piece_length, info.pieces_hashes[piece_index])) {
+    uint32_t piece_length = info_piece_size(&info, piece_index);
+
+    // Download the specified piece, the wire reads its blocks straight into place
+    PeerWire wire;
+    char *piece_data = NULL;
+    int valid = 0;
+    if (wire_init(&wire, sockfd) == 0) {
+        piece_data = download_piece(&wire, piece_index, piece_length);
+        valid = verify_piece(&info, piece_index, piece_data, piece_length) ||
+                repair_piece(&wire, &info, piece_index, piece_data, piece_length);
+        wire_free(&wire);
+    }
+    if (!valid) {
         printw("Failed to verify piece\n");
         free(piece_data);
         free_peers(peers_list);
         free_info(info);
-        free(content);
         close(sockfd);
         printw("Press any key to continue...");
         getch();
@@ -163,7 +210,6 @@ void ncurses_download_piece() {
         free(piece_data);
         free_peers(peers_list);
         free_info(info);
-        free(content);
         close(sockfd);
         printw("Press any key to continue...");
         getch();
@@ -178,7 +224,6 @@ void ncurses_download_piece() {
         free(piece_data);
         free_peers(peers_list);
         free_info(info);
-        free(content);
         close(sockfd);
         printw("Press any key to continue...");
         getch();
@@ -189,7 +234,6 @@ void ncurses_download_piece() {
     free(piece_data);
     free_peers(peers_list);
     free_info(info);
-    free(content);
     close(sockfd);
 
     printw("Piece %d downloaded to %s\n", piece_index, target_file);
@@ -197,93 +241,348 @@ void ncurses_download_piece() {
     getch();
 }
 
+// One status line for a running download, redrawn in place on row '*context'
+static bool show_download_progress(const Reactor *reactor, void *context) {
+    int row = *(int *)context;
+    size_t transferring = 0, parked = 0;
+    for (size_t i = 0; i < reactor->num_connections; i++) {
+        transferring += reactor->connections[i]->state == PEER_TRANSFERRING;
+        parked += reactor->connections[i]->state == PEER_PARKED;
+    }
+    move(row, 0);
+    clrtoeol();
+    printw("%zu/%zu pieces, %.1f MB received, %.1f MB sent, %zu peers connected (%zu unchoked, %zu retrying)", reactor->pieces_done,
+           reactor->info->num_pieces, reactor->bytes_received / 1e6, reactor->bytes_sent / 1e6, reactor_active_peers(reactor) - parked,
+           transferring, parked);
+    if (reactor->blocks_free == 0 && reactor->pieces_done < reactor->info->num_pieces) {
+        printw(", endgame");
+    }
+    refresh();
+    return true;
+}
+
+// The status line while seeding, until a key is pressed (getch doesn't wait, see nodelay)
+static bool show_seed_progress(const Reactor *reactor, void *context) {
+    int row = *(int *)context;
+    move(row, 0);
+    clrtoeol();
+    printw("Seeding: %.1f MB sent, %zu peers connected (%d unchoked). press any key to stop", reactor->bytes_sent / 1e6,
+           reactor_active_peers(reactor), reactor->unchoked);
+    refresh();
+    return getch() == ERR;
+}
+
+// Connect to a peer the moment the tracker response names it
+static void add_tracker_peer(void *context, const Peer *peer) {
+    reactor_add_peer((Reactor *)context, peer);
+}
+
 void ncurses_download_file() {
     char target_file[256], torrent_file[256];
 
     echo();
-    printw("Enter target file: ");
+    printw("Enter target file (a directory for multi-file torrents): ");
     getnstr(target_file, sizeof(target_file));
     printw("Enter torrent file: ");
     getnstr(torrent_file, sizeof(torrent_file));
     noecho();
 
-    // Get peers' IP
-    char *content = read_torrent_file(torrent_file);
-    if (content == NULL) {
-        printw("Failed to read torrent file: %s\n", torrent_file);
+    // Read the torrent
+    MetaInfo info;
+    if (load_meta_info(torrent_file, &info) < 0) {
+        printw("Failed to read torrent file %s: %s\n", torrent_file, info_error());
         printw("Press any key to continue...");
         getch();
         return;
     }
-    MetaInfo info = info_extract(content);
-    PeersList peers_list = get_peers(info);
 
-    // Open the target file for writing
-    FILE *file = fopen(target_file, "wb");
-    if (file == NULL) {
-        perror("Failed to open target file for writing");
+    // Create the target file(s), pieces are written straight to their place in them
+    Storage storage;
+    if (storage_open(&storage, &info, target_file) < 0) {
+        printw("Failed to open target for writing: %s\n", strerror(errno));
+        free_info(info);
+        printw("Press any key to continue...");
+        getch();
+        return;
+    }
+
+    // Every peer is connected at once, one event loop drives them all. blocks are assembled in their
+    // piece's buffer (hashed as they become contiguous), and finish_piece writes the piece once it verifies
+    Reactor reactor;
+    PeersList peers_list = {};
+    long missing = -1;
+    bool announced = true; // Cleared when the first announce fails, nobody to download from then
+    if (reactor_init(&reactor, &info, &storage) == 0) {
+        // Peers that got our address from the tracker connect to us as well
+        if (reactor_listen(&reactor, LISTEN_PORT, DEFAULT_MAX_HALF_OPEN, MAX_PEER_CONNECTIONS) < 0) {
+            printw("Not accepting incoming peers on port %d: %s\n", LISTEN_PORT, strerror(errno));
+        }
+        // Connects start while the tracker is still sending the rest of the list
+        AnnounceTotals totals = { .left = info.length };
+        announced = get_peers_streaming(info, totals, add_tracker_peer, &reactor, &peers_list) == 0;
+        int row, col;
+        getyx(stdscr, row, col);
+        (void)col;
+        if (announced) {
+            missing = reactor_run(&reactor, show_download_progress, &row);
+        }
+
+        // Complete: tell the tracker, then keep serving the pieces until a key is pressed
+        if (missing == 0) {
+            totals = (AnnounceTotals){ reactor.bytes_sent, reactor.bytes_received, 0, "completed" };
+            free_peers(peers_list);
+            // The download is done whatever the tracker says, it just won't send leechers our way
+            if (get_peers_streaming(info, totals, add_tracker_peer, &reactor, &peers_list) < 0) {
+                printw("\nCompleted announce failed: %s", tracker_error());
+            }
+            printw("\n");
+            getyx(stdscr, row, col);
+            nodelay(stdscr, TRUE);
+            if (reactor_seed(&reactor, show_seed_progress, &row) < 0) {
+                printw("\nSeeding failed: %s", strerror(errno));
+            }
+            nodelay(stdscr, FALSE);
+            totals = (AnnounceTotals){ reactor.bytes_sent, reactor.bytes_received, 0, "stopped" };
+            PeersList last;
+            if (get_peers_streaming(info, totals, NULL, NULL, &last) < 0) {
+                printw("\nStopped announce failed: %s", tracker_error());
+            }
+            free_peers(last);
+        }
+        reactor_free(&reactor);
+    }
+
+    if (missing != 0) {
+        if (missing > 0) {
+            printw("\nFailed to download %ld pieces, no peer had them\n", missing);
+        } else if (!announced) {
+            printw("\nTracker announce failed: %s\n", tracker_error());
+        } else {
+            printw("\nDownload failed: %s\n", strerror(errno));
+        }
+        storage_close(&storage);
         free_peers(peers_list);
         free_info(info);
-        free(content);
         printw("Press any key to continue...");
         getch();
         return;
     }
+    printw("\n");
 
-    for (uint32_t piece_index = 0; piece_index < info.num_pieces; piece_index++) {
-        uint32_t piece_length = (piece_index == info.num_pieces - 1) ? 
-                                info.length - (piece_index * info.piece_length) : 
-                                info.piece_length;
+    storage_close(&storage);
+    free_peers(peers_list);
+    free_info(info);
+    printw("File downloaded successfully\n");
+    printw("Press any key to continue...");
+    getch();
+}
 
-        char *piece_data = NULL;
-        int sockfd = -1;
-        for (int peer_index = 0; peer_index < peers_list.count; peer_index++) {
-            sockfd = create_socket();
-            if (sockfd < 0) continue;
+// Print the outcome of one directory load
+static void print_library_summary(const TorrentLibrary *library) {
+    printw("Loaded %zu of %zu torrents in %.3f s on %d threads (%.0f files/s)\n", (size_t)library->count,
+           library->files_scanned, library->seconds, library->threads, library_files_per_second(library));
 
-            char *response = perform_peer_handshake(sockfd, info.info_hash, peers_list.peers[peer_index].ip, peers_list.peers[peer_index].port);
-            if (response == NULL) {
-                close(sockfd);
-                continue;
-            }
+    const size_t shown = 10;
+    for (size_t i = 0; i < library->error_count && i < shown; i++) {
+        printw("  %s: %s\n", library->errors[i].path, library->errors[i].message);
+    }
+    if (library->error_count > shown) {
+        printw("  ... and %zu more errors\n", library->error_count - shown);
+    }
+}
 
-            piece_data = download_piece(sockfd, piece_index, piece_length);
-            free(response);
-            close(sockfd);
+void ncurses_ingest() {
+    char directory[256];
+    int threads = 0;
 
-            if (piece_data != NULL && verify_piece(piece_data, piece_length, info.pieces_hashes[piece_index])) {
-                break;
-            }
+    echo();
+    printw("Enter torrent directory: ");
+    getnstr(directory, sizeof(directory));
+    printw("Worker threads (0 = scaling report across all cores): ");
+    scanw("%d", &threads);
+    noecho();
+    clear();
 
-            free(piece_data);
-            piece_data = NULL;
+    TorrentLibrary library;
+    if (threads > 0) {
+        if (ingest_directory(directory, threads, &library) < 0) {
+            printw("%s\n", info_error());
+        } else {
+            print_library_summary(&library);
+            free_library(&library);
         }
+        printw("Press any key to continue...");
+        getch();
+        return;
+    }
 
-        if (piece_data == NULL) {
-            printw("Failed to download piece %u\n", piece_index);
-            fclose(file);
-            free_peers(peers_list);
-            free_info(info);
-            free(content);
-            printw("Press any key to continue...");
-            getch();
-            return;
+    // Untimed warm-up so every timed run sees the same page cache and metainfo cache state
+    if (ingest_directory(directory, 0, &library) < 0) {
+        printw("%s\n", info_error());
+        printw("Press any key to continue...");
+        getch();
+        return;
+    }
+    print_library_summary(&library);
+    free_library(&library);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    double baseline = 0;
+    printw("\nthreads   files/s   speedup\n");
+    for (long n = 1; n <= cores; n = (n * 2 > cores && n < cores) ? cores : n * 2) {
+        if (ingest_directory(directory, n, &library) < 0) {
+            break;
+        }
+        double rate = library_files_per_second(&library);
+        if (baseline == 0) baseline = rate;
+        printw("%7d %9.0f %8.2fx\n", library.threads, rate, baseline > 0 ? rate / baseline : 0);
+        free_library(&library);
+        refresh();
+    }
+    printw("Press any key to continue...");
+    getch();
+}
+
+// Shows the progress of a running recheck until its workers are done
+void show_recheck_progress(Recheck *recheck) {
+    const MetaInfo *info = recheck->info;
+    int row, col;
+    getyx(stdscr, row, col);
+    (void)col;
+    for (;;) {
+        size_t checked = atomic_load_explicit(&recheck->pieces_checked, memory_order_relaxed);
+        size_t valid = atomic_load_explicit(&recheck->pieces_valid, memory_order_relaxed);
+        int width = 40;
+        int filled = info->num_pieces ? (int)(checked * width / info->num_pieces) : width;
+        move(row, 0);
+        clrtoeol();
+        printw("[%.*s%*s] %zu/%zu pieces, %zu valid", filled, "########################################",
+               width - filled, "", checked, info->num_pieces, valid);
+        refresh();
+        if (checked == info->num_pieces) {
+            break;
         }
+        napms(100);
+    }
+    recheck_wait(recheck);
+    printw("\n");
+}
 
-        fwrite(piece_data, 1, piece_length, file);
-        free(piece_data);
+void print_recheck_summary(const Recheck *recheck) {
+    const MetaInfo *info = recheck->info;
+    size_t valid = atomic_load_explicit(&recheck->pieces_valid, memory_order_relaxed);
+    printw("%zu of %zu pieces complete (%.1f%%), %d threads, %.2f s, %.1f MB/s\n", valid, info->num_pieces,
+           info->num_pieces ? 100.0 * valid / info->num_pieces : 100.0, recheck->threads, recheck->seconds,
+           recheck_bytes_per_second(recheck) / 1e6);
+
+    // Runs of missing pieces, the first few of them
+    int shown = 0;
+    for (size_t i = 0; i < info->num_pieces && shown < 10; i++) {
+        if (bitfield_get(recheck->bitfield, i)) continue;
+        size_t first = i;
+        while (i + 1 < info->num_pieces && !bitfield_get(recheck->bitfield, i + 1)) i++;
+        printw(first == i ? "  missing piece %zu\n" : "  missing pieces %zu-%zu\n", first, i);
+        shown++;
     }
+}
 
-    fclose(file);
-    free_peers(peers_list);
+void ncurses_recheck() {
+    char torrent_file[256], target_file[256];
+    int threads = 0;
+
+    echo();
+    printw("Enter torrent file: ");
+    getnstr(torrent_file, sizeof(torrent_file));
+    printw("Enter downloaded file (a directory for multi-file torrents): ");
+    getnstr(target_file, sizeof(target_file));
+    printw("Worker threads (0 = scaling report across all cores): ");
+    scanw("%d", &threads);
+    noecho();
+    clear();
+
+    MetaInfo info;
+    if (load_meta_info(torrent_file, &info) < 0) {
+        printw("Failed to read torrent file %s: %s\n", torrent_file, info_error());
+        printw("Press any key to continue...");
+        getch();
+        return;
+    }
+
+    Recheck recheck;
+    if (recheck_start(&recheck, &info, target_file, threads) < 0) {
+        printw("%s\n", info_error());
+    } else {
+        show_recheck_progress(&recheck);
+        print_recheck_summary(&recheck);
+        recheck_free(&recheck);
+
+        // The run above warmed the page cache, so these compare hashing and not the disk
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        double baseline = 0;
+        if (threads == 0) {
+            printw("\nthreads      MB/s   speedup\n");
+        }
+        for (long n = 1; threads == 0 && n <= cores; n = (n * 2 > cores && n < cores) ? cores : n * 2) {
+            if (recheck_files(&recheck, &info, target_file, n) < 0) {
+                break;
+            }
+            double rate = recheck_bytes_per_second(&recheck) / 1e6;
+            if (baseline == 0) baseline = rate;
+            printw("%7d %9.1f %8.2fx\n", recheck.threads, rate, baseline > 0 ? rate / baseline : 0);
+            recheck_free(&recheck);
+            refresh();
+        }
+    }
     free_info(info);
-    free(content);
-    printw("File downloaded successfully\n");
     printw("Press any key to continue...");
     getch();
 }
 
+// Non-interactive mode: print the meta info of a torrent as JSON on stdout
+int print_info_json(const char *file_name) {
+    MetaInfo info;
+    if (load_meta_info(file_name, &info) < 0) {
+        fprintf(stderr, "Failed to read torrent file %s: %s\n", file_name, info_error());
+        return 1;
+    }
+
+    int status = render_meta_info_json(info, file_sink(stdout));
+    free_info(info);
+    return status < 0 ? 1 : 0;
+}
+
 int main(int argc, char *argv[]) {
+    if (argc == 3 && strcmp(argv[1], "--json") == 0) {
+        return print_info_json(argv[2]);
+    }
+    if (argc == 2 && strcmp(argv[1], "--bench-decode") == 0) {
+        return bench_decode();
+    }
+    if (argc == 2 && strcmp(argv[1], "--bench-cache") == 0) {
+        return bench_cache();
+    }
+    if (argc == 2 && strcmp(argv[1], "--bench-ingest") == 0) {
+        return bench_ingest();
+    }
+    if (argc == 2 && strcmp(argv[1], "--bench-recheck") == 0) {
+        return bench_recheck();
+    }
+    if (argc == 2 && strcmp(argv[1], "--bench-render") == 0) {
+        return bench_render();
+    }
+    if (argc == 2 && strcmp(argv[1], "--bench-tape") == 0) {
+        return bench_tape();
+    }
+    if (argc == 2 && strcmp(argv[1], "--bench-sha1") == 0) {
+        return bench_sha1();
+    }
+    if (argc == 2 && strcmp(argv[1], "--bench-pipeline") == 0) {
+        return bench_pipeline();
+    }
+    if (argc == 2 && strcmp(argv[1], "--bench-picker") == 0) {
+        return bench_picker();
+    }
+
     initscr();
     noecho();
     cbreak();
@@ -317,6 +616,14 @@ int main(int argc, char *argv[]) {
                 ncurses_download_file();
                 break;
             case '6':
+                clear();
+                ncurses_ingest();
+                break;
+            case '7':
+                clear();
+                ncurses_recheck();
+                break;
+            case '8':
                 endwin();
                 return 0;
             default:
@@ -0,0 +1,40 @@
+#include "mapped_file.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int map_file(const char *file_name, MappedFile *mapped) {
+    memset(mapped, 0, sizeof(*mapped));
+
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &mapped->st) < 0 || !S_ISREG(mapped->st.st_mode) || mapped->st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+
+    mapped->size = mapped->st.st_size;
+    void *data = mmap(NULL, mapped->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps its own reference to the file
+    if (data == MAP_FAILED) {
+        mapped->size = 0;
+        return -1;
+    }
+
+    mapped->data = data;
+    return 0;
+}
+
+void unmap_file(MappedFile *mapped) {
+    if (mapped->data != NULL) {
+        munmap(mapped->data, mapped->size);
+    }
+    mapped->data = NULL;
+    mapped->size = 0;
+}
@@ -0,0 +1,21 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+// A whole file mapped read-only into memory
+typedef struct MappedFile {
+    char *data;
+    size_t size;
+    struct stat st;  // Metadata captured when the file was mapped
+} MappedFile;
+
+// maps a regular, non-empty file read-only, returns 0 on success and -1 on failure (errno is kept)
+int map_file(const char *file_name, MappedFile *mapped);
+
+// unmaps a file mapped with map_file, safe to call on a zeroed MappedFile
+void unmap_file(MappedFile *mapped);
+
+#endif // MAPPED_FILE_H
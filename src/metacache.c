@@ -0,0 +1,290 @@
+#include "metacache.h"
+#include "sha1.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define METACACHE_BYTE_ORDER 0x01020304u
+
+const char *metacache_directory(void) {
+    static _Thread_local char directory[PATH_MAX];
+    const char *override = getenv("BITTORRENT_CACHE_DIR");
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (override != NULL && override[0] != '\0') {
+        snprintf(directory, sizeof(directory), "%s", override);
+    } else if (xdg != NULL && xdg[0] != '\0') {
+        snprintf(directory, sizeof(directory), "%s/bittorrent-client", xdg);
+    } else if (home != NULL && home[0] != '\0') {
+        snprintf(directory, sizeof(directory), "%s/.cache/bittorrent-client", home);
+    } else {
+        return NULL;
+    }
+    return directory;
+}
+
+// Create a directory and its missing parents
+static int make_directories(const char *path) {
+    char partial[PATH_MAX];
+    snprintf(partial, sizeof(partial), "%s", path);
+    for (char *p = partial + 1; *p != '\0'; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(partial, 0755) < 0 && errno != EEXIST) return -1;
+            *p = '/';
+        }
+    }
+    return (mkdir(partial, 0755) < 0 && errno != EEXIST) ? -1 : 0;
+}
+
+// The cache entry of a torrent is named after the SHA-1 of its canonical path
+static int cache_entry_path(const char *canonical, char *out, size_t out_size) {
+    const char *directory = metacache_directory();
+    unsigned char digest[SHA1_DIGEST_LENGTH];
+    if (directory == NULL || !sha1_hash((const unsigned char *)canonical, strlen(canonical), digest)) {
+        return -1;
+    }
+
+    int written = snprintf(out, out_size, "%s/", directory);
+    for (int i = 0; i < SHA1_DIGEST_LENGTH && written > 0 && (size_t)written < out_size; i++) {
+        written += snprintf(out + written, out_size - written, "%02x", digest[i]);
+    }
+    if (written < 0 || (size_t)written + 6 >= out_size) {
+        return -1;
+    }
+    strcpy(out + written, ".meta");
+    return 0;
+}
+
+// Try to use a cache entry, it must be intact and describe exactly this version of the torrent
+static int read_cache(const char *entry_path, const char *canonical, const struct stat *source, MetaInfo *info) {
+    MappedFile mapped;
+    if (access(entry_path, R_OK) < 0 || map_file(entry_path, &mapped) < 0) {
+        return -1;
+    }
+
+    const MetaCacheHeader *header = (const MetaCacheHeader *)mapped.data;
+    size_t path_length = strlen(canonical);
+    if (mapped.size < sizeof(*header) ||
+        memcmp(header->magic, METACACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != METACACHE_VERSION ||
+        header->byte_order != METACACHE_BYTE_ORDER ||
+        header->source_size != (uint64_t)source->st_size ||
+        header->source_mtime_sec != source->st_mtim.tv_sec ||
+        header->source_mtime_nsec != source->st_mtim.tv_nsec ||
+        header->path_length != path_length ||
+        header->piece_length == 0 ||
+        header->num_pieces != header->length / header->piece_length + (header->length % header->piece_length != 0) ||
+        header->files_length > mapped.size ||
+        sizeof(*header) + header->url_length + header->path_length + header->name_length + header->files_length > header->piece_hashes_offset ||
+        header->piece_hashes_offset % PIECE_HASHES_ALIGNMENT != 0 ||
+        header->piece_roots_offset % PIECE_HASHES_ALIGNMENT != 0 ||
+        header->piece_hashes_offset > header->piece_roots_offset ||
+        header->piece_roots_offset > mapped.size ||
+        ((header->flags & METACACHE_V1) && header->num_pieces > (header->piece_roots_offset - header->piece_hashes_offset) / SHA1_DIGEST_LENGTH) ||
+        ((header->flags & METACACHE_V2) && header->num_pieces > (mapped.size - header->piece_roots_offset) / SHA256_DIGEST_LENGTH) ||
+        header->num_files > header->files_length / sizeof(MetaCacheFile)) {
+        unmap_file(&mapped);
+        return -1;
+    }
+
+    const char *url = mapped.data + sizeof(*header);
+    if (memcmp(url + header->url_length, canonical, path_length) != 0) {
+        unmap_file(&mapped); // Hash collision between two paths
+        return -1;
+    }
+    const char *name = url + header->url_length + path_length;
+
+    memset(info, 0, sizeof(*info));
+    info->url = strndup(url, header->url_length);
+    info->name = strndup(name, header->name_length);
+    info->info_hash = malloc(SHA1_DIGEST_LENGTH);
+    info->files = calloc(header->num_files ? header->num_files : 1, sizeof(*info->files));
+    if (info->url == NULL || info->name == NULL || info->info_hash == NULL || info->files == NULL) {
+        goto fail;
+    }
+    memcpy(info->info_hash, header->info_hash, SHA1_DIGEST_LENGTH);
+    if (header->flags & METACACHE_V2) {
+        if ((info->info_hash_v2 = malloc(SHA256_DIGEST_LENGTH)) == NULL) goto fail;
+        memcpy(info->info_hash_v2, header->info_hash_v2, SHA256_DIGEST_LENGTH);
+    }
+    info->length = header->length;
+    info->piece_length = header->piece_length;
+    info->num_pieces = header->num_pieces;
+    info->multi_file = (header->flags & METACACHE_MULTI_FILE) != 0;
+
+    // Rebuild the file table, offsets follow from the lengths
+    const char *record = name + header->name_length;
+    const char *records_end = record + header->files_length;
+    size_t offset = 0;
+    for (uint64_t i = 0; i < header->num_files; i++) {
+        MetaCacheFile entry;
+        if ((size_t)(records_end - record) < sizeof(entry)) goto fail;
+        memcpy(&entry, record, sizeof(entry));
+        record += sizeof(entry);
+        if ((size_t)(records_end - record) < entry.path_length) goto fail;
+
+        TorrentFile *file = &info->files[info->num_files++];
+        file->path = strndup(record, entry.path_length);
+        if (file->path == NULL) goto fail;
+        file->length = entry.length;
+        file->offset = offset;
+        file->padding = (entry.flags & METACACHE_FILE_PADDING) != 0;
+        memcpy(file->pieces_root, entry.pieces_root, sizeof(file->pieces_root));
+        offset += entry.length;
+        record += entry.path_length;
+    }
+    if (offset != info->length) {
+        goto fail;
+    }
+
+    // The piece tables are used in place, the mapping lives as long as the MetaInfo
+    if (header->flags & METACACHE_V1) {
+        info->piece_hashes = (unsigned char *)mapped.data + header->piece_hashes_offset;
+    }
+    if (header->flags & METACACHE_V2) {
+        info->piece_roots = (unsigned char *)mapped.data + header->piece_roots_offset;
+    }
+    info->owns_piece_hashes = false;
+    info->backing = mapped;
+    return 0;
+
+fail:
+    free_info(*info);
+    unmap_file(&mapped);
+    return -1;
+}
+
+// Serialize the file table as MetaCacheFile records, each followed by its path
+static int append_file_table(Buffer *buffer, const MetaInfo *info) {
+    for (size_t i = 0; i < info->num_files; i++) {
+        const TorrentFile *file = &info->files[i];
+        MetaCacheFile entry = {
+            .length = file->length,
+            .path_length = strlen(file->path),
+            .flags = file->padding ? METACACHE_FILE_PADDING : 0,
+        };
+        memcpy(entry.pieces_root, file->pieces_root, sizeof(entry.pieces_root));
+        if (buffer_append(buffer, &entry, sizeof(entry)) < 0 ||
+            buffer_append(buffer, file->path, entry.path_length) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static size_t align_table(size_t offset) {
+    return (offset + PIECE_HASHES_ALIGNMENT - 1) & ~(size_t)(PIECE_HASHES_ALIGNMENT - 1);
+}
+
+// Write a cache entry next to its final name and rename it into place, so readers never see half an entry
+static int write_cache(const char *entry_path, const char *canonical, const struct stat *source, const MetaInfo *info) {
+    MetaCacheHeader header = {};
+    memcpy(header.magic, METACACHE_MAGIC, sizeof(header.magic));
+    header.version = METACACHE_VERSION;
+    header.byte_order = METACACHE_BYTE_ORDER;
+    header.source_size = source->st_size;
+    header.source_mtime_sec = source->st_mtim.tv_sec;
+    header.source_mtime_nsec = source->st_mtim.tv_nsec;
+    header.length = info->length;
+    header.piece_length = info->piece_length;
+    header.num_pieces = info->num_pieces;
+    memcpy(header.info_hash, info->info_hash, SHA1_DIGEST_LENGTH);
+    if (info->info_hash_v2 != NULL) {
+        memcpy(header.info_hash_v2, info->info_hash_v2, SHA256_DIGEST_LENGTH);
+    }
+    header.url_length = strlen(info->url);
+    header.path_length = strlen(canonical);
+    header.name_length = strlen(info->name);
+    header.num_files = info->num_files;
+    header.flags = (info->multi_file ? METACACHE_MULTI_FILE : 0) |
+                   (info->piece_hashes != NULL ? METACACHE_V1 : 0) |
+                   (info->piece_roots != NULL ? METACACHE_V2 : 0);
+    for (size_t i = 0; i < info->num_files; i++) {
+        header.files_length += sizeof(MetaCacheFile) + strlen(info->files[i].path);
+    }
+    size_t strings_end = sizeof(header) + header.url_length + header.path_length + header.name_length + header.files_length;
+    size_t hashes_size = info->piece_hashes != NULL ? info->num_pieces * SHA1_DIGEST_LENGTH : 0;
+    size_t roots_size = info->piece_roots != NULL ? info->num_pieces * SHA256_DIGEST_LENGTH : 0;
+    header.piece_hashes_offset = align_table(strings_end);
+    header.piece_roots_offset = align_table(header.piece_hashes_offset + hashes_size);
+
+    Buffer buffer = {0};
+    static const char padding[PIECE_HASHES_ALIGNMENT] = {0};
+    if (buffer_reserve(&buffer, header.piece_roots_offset + roots_size) < 0 ||
+        buffer_append(&buffer, &header, sizeof(header)) < 0 ||
+        buffer_append(&buffer, info->url, header.url_length) < 0 ||
+        buffer_append(&buffer, canonical, header.path_length) < 0 ||
+        buffer_append(&buffer, info->name, header.name_length) < 0 ||
+        append_file_table(&buffer, info) < 0 ||
+        buffer_append(&buffer, padding, header.piece_hashes_offset - strings_end) < 0 ||
+        buffer_append(&buffer, info->piece_hashes, hashes_size) < 0 ||
+        buffer_append(&buffer, padding, header.piece_roots_offset - header.piece_hashes_offset - hashes_size) < 0 ||
+        buffer_append(&buffer, info->piece_roots, roots_size) < 0) {
+        buffer_free(&buffer);
+        return -1;
+    }
+
+    char temp_path[PATH_MAX];
+    // Unique per process and per call, so concurrent loaders never share a temp file
+    static atomic_uint temp_serial;
+    int written = snprintf(temp_path, sizeof(temp_path), "%s.%d.%u.tmp", entry_path, (int)getpid(), atomic_fetch_add(&temp_serial, 1));
+    if (written < 0 || (size_t)written >= sizeof(temp_path)) {
+        buffer_free(&buffer); // A truncated name could collide with another writer's temp file
+        return -1;
+    }
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        buffer_free(&buffer);
+        return -1;
+    }
+    int status = sink_write(fd_sink(fd), buffer.data, buffer.length);
+    status |= close(fd);
+    buffer_free(&buffer);
+
+    if (status < 0 || rename(temp_path, entry_path) < 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int load_meta_info(const char *file_name, MetaInfo *info) {
+    char canonical[PATH_MAX];
+    char entry_path[PATH_MAX];
+    struct stat source;
+
+    if (realpath(file_name, canonical) == NULL || stat(canonical, &source) < 0) {
+        info_set_error("Failed to open file: %s", file_name);
+        return -1;
+    }
+
+    bool cacheable = cache_entry_path(canonical, entry_path, sizeof(entry_path)) == 0;
+    if (cacheable && read_cache(entry_path, canonical, &source, info) == 0) {
+        return 0;
+    }
+
+    // Cache miss: parse the mapped torrent, then remember the result for the next start
+    MappedFile torrent;
+    if (map_file(canonical, &torrent) < 0) {
+        info_set_error("Failed to map file: %s", file_name);
+        return -1;
+    }
+    int status = info_extract(torrent.data, torrent.size, info);
+    unmap_file(&torrent);
+    if (status < 0) {
+        return -1;
+    }
+
+    if (cacheable && make_directories(metacache_directory()) == 0) {
+        write_cache(entry_path, canonical, &source, info); // Best effort, a failed write only costs a re-parse
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef METACACHE_H
+#define METACACHE_H
+
+#include "info.h"
+#include <stdint.h>
+
+// Bump whenever the layout below changes, older cache files are then ignored and rewritten
+#define METACACHE_VERSION 3
+#define METACACHE_MAGIC "BTMETA\r\n"
+
+// MetaCacheHeader.flags
+#define METACACHE_MULTI_FILE 0x1
+#define METACACHE_V1 0x2          // The SHA-1 piece table is present
+#define METACACHE_V2 0x4          // info_hash_v2 and the Merkle piece roots are present
+
+// MetaCacheFile.flags
+#define METACACHE_FILE_PADDING 0x1
+
+// Header of a cache file. it is followed by the announce URL, the torrent's canonical path, the
+// torrent name, the file table and then, each cache-line aligned, the SHA-1 piece table at
+// 'piece_hashes_offset' and the v2 piece roots at 'piece_roots_offset'
+typedef struct MetaCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;          // 0x01020304 as written by the host, guards against foreign caches
+    uint64_t source_size;         // Size and mtime of the .torrent file the entry was built from
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint64_t length;
+    uint64_t piece_length;
+    uint64_t num_pieces;
+    uint8_t info_hash[20];
+    uint32_t url_length;
+    uint32_t path_length;
+    uint32_t name_length;
+    uint64_t num_files;
+    uint64_t files_length;        // Size in bytes of the file table
+    uint32_t flags;
+    uint32_t reserved;
+    uint8_t info_hash_v2[32];
+    uint64_t piece_hashes_offset;
+    uint64_t piece_roots_offset;
+} MetaCacheHeader;
+
+// One file table record, followed by 'path_length' bytes of path. offsets follow from the lengths
+typedef struct MetaCacheFile {
+    uint64_t length;
+    uint32_t path_length;
+    uint32_t flags;
+    uint8_t pieces_root[32];
+} MetaCacheFile;
+
+// loads the meta info of a torrent file: straight from a mapped cache entry when one matches the
+// file's path, size and mtime, otherwise by mapping and parsing the file and then caching the result.
+// returns 0 on success and -1 on failure (see info_error)
+int load_meta_info(const char *file_name, MetaInfo *info);
+
+// directory holding the cache entries ($BITTORRENT_CACHE_DIR, $XDG_CACHE_HOME or ~/.cache)
+const char *metacache_directory(void);
+
+#endif // METACACHE_H
@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include "info.h"
+#include "wire.h"
 
 #define PROTOCOL_STRING "BitTorrent protocol"
 #define PEER_ID "00112233445566778899"
@@ -13,22 +15,114 @@
 #define BLOCK_LENGTH 16384
 
 #define LENGTH_PREFIX_SIZE 4 
+#define CHOKE 0              // no payload
 #define UNCHOKE 1            // no payload
 #define INTERESTED 2          // no payload
+#define NOT_INTERESTED 3      // no payload
+#define HAVE 4                // piece index
 #define BITFIELD 5    
 #define REQUEST 6     
 #define PIECE 7       
+#define CANCEL 8              // piece index, begin, length: a REQUEST taken back
+#define HASH_REQUEST 21       // BEP 52: pieces root, base layer, index, length, proof layers
+#define HASHES 22             // BEP 52: the request's fields followed by the hashes
+#define HASH_REJECT 23
+#define HASH_REQUEST_LENGTH (LENGTH_PREFIX_SIZE + 1 + 32 + 16) // Whole message, length prefix included
+#define HANDSHAKE_V2_FLAG 0x10 // BEP 52: set in the last reserved byte (handshake[27]) by peers that speak v2
+
+// Block requests kept in flight per connection, so a block costs bandwidth rather than a round trip
+#define DEFAULT_PIPELINE_DEPTH 5
+#define MAX_PIPELINE_DEPTH 64
+
+// A block asked for with REQUEST
+typedef struct BlockRequest {
+    uint32_t piece_index;
+    uint32_t begin;
+    uint32_t length;
+} BlockRequest;
+
+// The requests of one connection that have not been answered yet, oldest first.
+// the last 'unsent' of them are still waiting for request_queue_flush
+typedef struct RequestQueue {
+    BlockRequest pending[MAX_PIPELINE_DEPTH];
+    int count;
+    int unsent;
+    int depth;           // How many may be outstanding at once
+} RequestQueue;
 
 int create_socket();
 
+// builds the 68-byte handshake for 'info_hash' (20 bytes)
+void construct_handshake_packet(char *handshake_packet, const char *info_hash);
+
+// builds a 17-byte REQUEST message
+void construct_request_message(char *request_packet, uint32_t index, uint32_t begin, uint32_t length);
+
+// builds a 17-byte CANCEL message for a block asked for with REQUEST
+void construct_cancel_message(char *cancel_packet, uint32_t index, uint32_t begin, uint32_t length);
+
 // sends handshake packet to peer, get back a response (same format)
 char *perform_peer_handshake(int sockfd, const unsigned char *info_hash, const char *peer_ip, int peer_port);
 
 // handle peer messanging - recv bitfield, send intrested, recv unchoke, loop(send request, recv piece). return the contents of the piece (bytes)
-char *download_piece(int sockfd, uint32_t piece_index, uint32_t piece_length);
+char *download_piece(PeerWire *wire, uint32_t piece_index, uint32_t piece_length);
+
+// requests one block and reads it into 'destination'. returns 0 on success and -1 on failure
+int download_block(PeerWire *wire, uint32_t piece_index, uint32_t begin, uint32_t length, char *destination);
+
+// compares the hash of the piece we have gotten to the hash of piece 'piece_index' in the metainfo
+// (its v2 Merkle root when the torrent has one, the SHA-1 otherwise)
+int verify_piece(const MetaInfo *info, uint32_t piece_index, const char *piece_recived, size_t piece_length);
+
+// One piece of a batch handed to verify_pieces
+typedef struct PieceCheck {
+    uint32_t piece_index;
+    const char *data;
+    size_t length;
+    int valid;           // Set by verify_pieces, as verify_piece would return it
+} PieceCheck;
+
+// verify_piece for a batch: full-size SHA-1 pieces are hashed several at a time by the multi-buffer
+// engine (sha1_multi.h), everything else goes through verify_piece. returns the number of valid pieces
+size_t verify_pieces(const MetaInfo *info, PieceCheck *batch, size_t count);
+
+// builds the HASH_REQUEST (HASH_REQUEST_LENGTH bytes) for the SHA-256 of every block of v2 piece
+// 'piece_index'. returns 0, or -1 if the piece has no v2 root
+int construct_hash_request(char *request, const MetaInfo *info, uint32_t piece_index);
+
+// checks a HASHES message ('payload' from the message id on, 'length' bytes) against the request for
+// 'piece_index' and the piece's root, and copies the info_piece_tree_width() block hashes into
+// 'block_hashes'. returns 0 if they are the right ones and -1 otherwise
+int parse_block_hashes(const MetaInfo *info, uint32_t piece_index, const char *payload, size_t length, unsigned char *block_hashes);
+
+// asks the peer for the SHA-256 of every block of a v2 piece and checks them against the piece's root.
+// 'block_hashes' gets info_piece_tree_width() hashes. returns 0 on success and -1 on failure
+int request_block_hashes(PeerWire *wire, const MetaInfo *info, uint32_t piece_index, unsigned char *block_hashes);
+
+// fixes a v2 piece that failed verification by downloading again only the blocks whose hash is wrong.
+// returns 1 if the piece verifies afterwards, 0 otherwise (always 0 for v1 torrents)
+int repair_piece(PeerWire *wire, const MetaInfo *info, uint32_t piece_index, char *piece_data, size_t piece_length);
+
+// the pipeline depth to use: $BITTORRENT_PIPELINE_DEPTH if set (1 to MAX_PIPELINE_DEPTH), DEFAULT_PIPELINE_DEPTH otherwise
+int pipeline_depth(void);
+
+void request_queue_init(RequestQueue *queue, int depth);
+
+// true while fewer than 'depth' requests are outstanding
+bool request_queue_has_room(const RequestQueue *queue);
+
+// queues a REQUEST, sent with the others by the next request_queue_flush. returns -1 if the window is full
+int request_queue_push(RequestQueue *queue, uint32_t piece_index, uint32_t begin, uint32_t length);
+
+// encodes every queued REQUEST into 'packets' (room for MAX_PIPELINE_DEPTH x 17 bytes) and counts them
+// as sent, for callers that do their own writing. returns the number of bytes encoded
+size_t request_queue_encode(RequestQueue *queue, char *packets);
 
-// compares the hash of the piece we have gotten to the hash piece from the metainfo
-int verify_piece(const char *piece_recived, size_t piece_length, const unsigned char *piece_hash);
+// sends every queued REQUEST in one write. returns 0 on success and -1 on failure
+int request_queue_flush(int sockfd, RequestQueue *queue);
 
+// removes the outstanding request a PIECE message answers, in whatever order they come back.
+// returns 0, or -1 if nothing like it was asked for
+int request_queue_match(RequestQueue *queue, uint32_t piece_index, uint32_t begin, uint32_t length);
 
 #endif // PEER_H
@@ -0,0 +1,206 @@
+#include "picker.h"
+#include "bitfield.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+int picker_init(PiecePicker *picker, size_t num_pieces, int max_peers) {
+    memset(picker, 0, sizeof(*picker));
+    picker->num_pieces = num_pieces;
+    picker->done_level = max_peers + 1;
+    size_t count = num_pieces ? num_pieces : 1;
+    picker->availability = calloc(count, sizeof(*picker->availability));
+    picker->order = malloc(count * sizeof(*picker->order));
+    picker->position = malloc(count * sizeof(*picker->position));
+    picker->buckets = malloc((picker->done_level + 2) * sizeof(*picker->buckets));
+    picker->done = calloc(bitfield_bytes(count), 1);
+    picker->partial = malloc(count * sizeof(*picker->partial));
+    if (picker->availability == NULL || picker->order == NULL || picker->position == NULL || picker->buckets == NULL ||
+        picker->done == NULL || picker->partial == NULL) {
+        picker_free(picker);
+        return -1;
+    }
+
+    // Nobody has anything yet: every piece in bucket 0, the others empty
+    for (size_t i = 0; i < num_pieces; i++) {
+        picker->order[i] = picker->position[i] = i;
+    }
+    picker->buckets[0] = 0;
+    for (int level = 1; level <= picker->done_level + 1; level++) {
+        picker->buckets[level] = num_pieces;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    picker->seed = ((uint64_t)ts.tv_nsec << 32 ^ (uint64_t)ts.tv_sec ^ (uint64_t)getpid()) | 1;
+    return 0;
+}
+
+void picker_free(PiecePicker *picker) {
+    free(picker->availability);
+    free(picker->order);
+    free(picker->position);
+    free(picker->buckets);
+    free(picker->done);
+    free(picker->partial);
+    memset(picker, 0, sizeof(*picker));
+}
+
+static uint64_t next_random(PiecePicker *picker) {
+    picker->seed ^= picker->seed << 13;
+    picker->seed ^= picker->seed >> 7;
+    picker->seed ^= picker->seed << 17;
+    return picker->seed;
+}
+
+static void swap_entries(PiecePicker *picker, size_t a, size_t b) {
+    uint32_t first = picker->order[a], second = picker->order[b];
+    picker->order[a] = second;
+    picker->order[b] = first;
+    picker->position[second] = a;
+    picker->position[first] = b;
+}
+
+// Move 'index' from bucket 'level' to the one above: it becomes the last entry of its bucket, and the
+// boundary moves down over it
+static void move_up(PiecePicker *picker, uint32_t index, int level) {
+    size_t last = picker->buckets[level + 1] - 1;
+    swap_entries(picker, picker->position[index], last);
+    picker->buckets[level + 1]--;
+}
+
+// The other way: it becomes the first entry of its bucket, and the boundary moves up past it
+static void move_down(PiecePicker *picker, uint32_t index, int level) {
+    size_t first = picker->buckets[level];
+    swap_entries(picker, picker->position[index], first);
+    picker->buckets[level]++;
+}
+
+void picker_add_piece(PiecePicker *picker, uint32_t index) {
+    if (index >= picker->num_pieces || picker->availability[index] + 1 >= picker->done_level) {
+        return;
+    }
+    if (!bitfield_get(picker->done, index)) {
+        move_up(picker, index, picker->availability[index]);
+    }
+    picker->availability[index]++;
+}
+
+static void remove_piece(PiecePicker *picker, uint32_t index) {
+    if (picker->availability[index] == 0) {
+        return;
+    }
+    if (!bitfield_get(picker->done, index)) {
+        move_down(picker, index, picker->availability[index]);
+    }
+    picker->availability[index]--;
+}
+
+// Call 'apply' for every piece set in 'bits', skipping empty words whole
+static void for_each_piece(PiecePicker *picker, const unsigned char *bits, void (*apply)(PiecePicker *, uint32_t)) {
+    size_t bytes = bitfield_bytes(picker->num_pieces);
+    for (size_t i = 0; i < bytes; i++) {
+        if (i % 8 == 0 && i + 8 <= bytes) {
+            uint64_t word;
+            memcpy(&word, bits + i, 8);
+            if (word == 0) {
+                i += 7;
+                continue;
+            }
+        }
+        for (unsigned char byte = bits[i]; byte != 0; byte &= byte - 1) {
+            size_t index = i * 8 + 7 - __builtin_ctz(byte); // The lowest bit set is the highest piece
+            if (index < picker->num_pieces) {
+                apply(picker, index);
+            }
+        }
+    }
+}
+
+// Whether 'bits' has every piece, as a seed's does
+static bool bitfield_full(const PiecePicker *picker, const unsigned char *bits) {
+    size_t whole = picker->num_pieces / 8;
+    for (size_t i = 0; i < whole; i++) {
+        if (bits[i] != 0xff) return false;
+    }
+    unsigned char tail = 0xff << (8 - picker->num_pieces % 8);
+    return picker->num_pieces % 8 == 0 || (bits[whole] & tail) == tail;
+}
+
+void picker_add_bitfield(PiecePicker *picker, const unsigned char *bits) {
+    // A seed raises every piece by one: the order stays, only the bucket boundaries move
+    if (bitfield_full(picker, bits) && picker->buckets[picker->done_level - 1] == picker->buckets[picker->done_level]) {
+        for (int level = picker->done_level - 1; level >= 1; level--) {
+            picker->buckets[level] = picker->buckets[level - 1];
+        }
+        for (size_t i = 0; i < picker->num_pieces; i++) {
+            picker->availability[i]++;
+        }
+        return;
+    }
+    for_each_piece(picker, bits, picker_add_piece);
+}
+
+void picker_remove_bitfield(PiecePicker *picker, const unsigned char *bits) {
+    if (bitfield_full(picker, bits) && picker->buckets[1] == 0) {
+        for (int level = 1; level < picker->done_level; level++) {
+            picker->buckets[level] = picker->buckets[level + 1];
+        }
+        for (size_t i = 0; i < picker->num_pieces; i++) {
+            picker->availability[i]--;
+        }
+        return;
+    }
+    for_each_piece(picker, bits, remove_piece);
+}
+
+void picker_set_done(PiecePicker *picker, uint32_t index) {
+    if (index >= picker->num_pieces || bitfield_get(picker->done, index)) {
+        return;
+    }
+    for (int level = picker->availability[index]; level < picker->done_level; level++) {
+        move_up(picker, index, level);
+    }
+    bitfield_set(picker->done, index);
+    picker_set_partial(picker, index, false);
+}
+
+void picker_set_partial(PiecePicker *picker, uint32_t index, bool partial) {
+    for (size_t i = 0; i < picker->num_partial; i++) {
+        if (picker->partial[i] == index) {
+            if (!partial) picker->partial[i] = picker->partial[--picker->num_partial];
+            return;
+        }
+    }
+    if (partial && index < picker->num_pieces && !bitfield_get(picker->done, index)) {
+        picker->partial[picker->num_partial++] = index;
+    }
+}
+
+long picker_pick(PiecePicker *picker, const unsigned char *bits, PickFilter filter, void *context) {
+    // Finishing what was started keeps the number of half-done pieces (and the memory they pin) down
+    for (size_t i = 0; i < picker->num_partial; i++) {
+        uint32_t index = picker->partial[i];
+        if (bitfield_get(bits, index) && (filter == NULL || filter(context, index))) {
+            return index;
+        }
+    }
+
+    // Bucket 0 is what nobody has, so it can't be what this peer has either
+    for (int level = 1; level < picker->done_level; level++) {
+        size_t first = picker->buckets[level], size = picker->buckets[level + 1] - first;
+        if (size == 0) {
+            continue;
+        }
+        size_t start = next_random(picker) % size;
+        for (size_t k = 0; k < size; k++) {
+            uint32_t index = picker->order[first + (start + k) % size];
+            if (bitfield_get(bits, index) && (filter == NULL || filter(context, index))) {
+                return index;
+            }
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,50 @@
+#ifndef PICKER_H
+#define PICKER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Whether piece 'index' may be handed out right now (not being fetched already, say)
+typedef bool (*PickFilter)(void *context, uint32_t index);
+
+// Rarest-first piece selection. every piece has an availability count (how many connected peers have
+// it) and the pieces are kept sorted by it in 'order', one bucket per count, so an update is a swap
+// and a pick looks at the rarest bucket first. pieces that are done sit in a last bucket of their own
+typedef struct PiecePicker {
+    size_t num_pieces;
+    int done_level;               // The bucket of finished pieces, above every real count
+    uint16_t *availability;
+    uint32_t *order;              // Pieces by availability, rarest first
+    uint32_t *position;           // Where each piece is in 'order'
+    size_t *buckets;              // buckets[a]: first entry of 'order' with availability a (or more)
+    unsigned char *done;          // bitfield.h layout
+    uint32_t *partial;            // Pieces being assembled
+    size_t num_partial;
+    uint64_t seed;                // xorshift state for the tie-breaks
+} PiecePicker;
+
+// prepares a picker for 'num_pieces' pieces shared by at most 'max_peers' peers. returns 0 on success and -1 on failure
+int picker_init(PiecePicker *picker, size_t num_pieces, int max_peers);
+
+void picker_free(PiecePicker *picker);
+
+// one more peer has piece 'index' (a HAVE)
+void picker_add_piece(PiecePicker *picker, uint32_t index);
+
+// a peer's whole bitfield (bitfield.h layout) joins or leaves the counts, on BITFIELD and on disconnect
+void picker_add_bitfield(PiecePicker *picker, const unsigned char *bits);
+void picker_remove_bitfield(PiecePicker *picker, const unsigned char *bits);
+
+// piece 'index' verified, it is never picked again
+void picker_set_done(PiecePicker *picker, uint32_t index);
+
+// piece 'index' is being assembled (true), or no longer (false). partial pieces are picked first
+void picker_set_partial(PiecePicker *picker, uint32_t index, bool partial);
+
+// the piece to fetch next from a peer with 'bits': a partial piece if the peer has one, otherwise one
+// of the rarest it has, chosen at random among equally rare ones. 'filter' (may be NULL) vetoes
+// candidates. returns the piece index, or -1 if the peer has nothing left to give
+long picker_pick(PiecePicker *picker, const unsigned char *bits, PickFilter filter, void *context);
+
+#endif
@@ -0,0 +1,111 @@
+#include "piece_hasher.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int piece_hasher_init(PieceHasher *hasher, const MetaInfo *info, uint32_t piece_index) {
+    memset(hasher, 0, sizeof(*hasher));
+    if (piece_index >= info->num_pieces) {
+        return -1;
+    }
+    hasher->info = info;
+    hasher->piece_index = piece_index;
+    hasher->piece_length = info_piece_size(info, piece_index);
+
+    if (info_piece_root(info, piece_index) == NULL) {
+        return sha1_init(&hasher->sha1) ? 0 : -1;
+    }
+
+    // v2 pieces never span files, only the bytes up to the end of the piece's file are hashed
+    size_t begin = (size_t)piece_index * info->piece_length;
+    const TorrentFile *file = &info->files[info_file_at(info, begin)];
+    size_t remaining = file->offset + file->length - begin;
+    hasher->file_bytes = remaining < hasher->piece_length ? remaining : hasher->piece_length;
+    hasher->num_leaves = (hasher->file_bytes + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE;
+    hasher->leaves = malloc((hasher->num_leaves ? hasher->num_leaves : 1) * SHA256_DIGEST_LENGTH);
+    hasher->leaf_ready = calloc(hasher->num_leaves ? hasher->num_leaves : 1, sizeof(*hasher->leaf_ready));
+    if (hasher->leaves == NULL || hasher->leaf_ready == NULL) {
+        piece_hasher_free(hasher);
+        return -1;
+    }
+    return 0;
+}
+
+// Hash the whole v2 blocks in [begin, begin + length), anything past the file is padding
+static int update_leaves(PieceHasher *hasher, size_t begin, const unsigned char *data, size_t length) {
+    if (begin % MERKLE_BLOCK_SIZE != 0) {
+        return -1;
+    }
+    size_t end = begin + length < hasher->file_bytes ? begin + length : hasher->file_bytes;
+    for (size_t offset = begin; offset < end; offset += MERKLE_BLOCK_SIZE) {
+        size_t block = offset / MERKLE_BLOCK_SIZE;
+        size_t block_length = hasher->file_bytes - offset < MERKLE_BLOCK_SIZE ? hasher->file_bytes - offset : MERKLE_BLOCK_SIZE;
+        if (offset + block_length > begin + length) {
+            return -1; // Partial block
+        }
+        if (!sha256_hash(data + (offset - begin), block_length, hasher->leaves + block * SHA256_DIGEST_LENGTH)) {
+            return -1;
+        }
+        if (!hasher->leaf_ready[block]) {
+            hasher->leaf_ready[block] = true;
+            hasher->hashed += block_length;
+        }
+    }
+    return 0;
+}
+
+int piece_hasher_update(PieceHasher *hasher, size_t begin, const void *data, size_t length) {
+    if (begin > hasher->piece_length || length > hasher->piece_length - begin) {
+        return -1;
+    }
+    if (hasher->leaves != NULL) {
+        return update_leaves(hasher, begin, data, length);
+    }
+    if (begin != hasher->hashed || hasher->sha1.mdctx == NULL || !sha1_update(&hasher->sha1, data, length)) {
+        return -1;
+    }
+    hasher->hashed += length;
+    return 0;
+}
+
+bool piece_hasher_done(const PieceHasher *hasher) {
+    return hasher->hashed == (hasher->leaves != NULL ? hasher->file_bytes : hasher->piece_length);
+}
+
+int piece_hasher_verify(PieceHasher *hasher) {
+    if (!piece_hasher_done(hasher)) {
+        return 0;
+    }
+
+    if (hasher->leaves == NULL) {
+        unsigned char hash[SHA1_DIGEST_LENGTH];
+        if (hasher->sha1.mdctx == NULL || !sha1_final(&hasher->sha1, hash)) {
+            return 0;
+        }
+        return memcmp(hash, info_piece_hash(hasher->info, hasher->piece_index), SHA1_DIGEST_LENGTH) == 0;
+    }
+
+    // Leaves past the end of the file are zero
+    static const unsigned char zero[SHA256_DIGEST_LENGTH];
+    unsigned char root[SHA256_DIGEST_LENGTH];
+    size_t width = info_piece_tree_width(hasher->info, hasher->piece_index);
+    return merkle_root(hasher->leaves, hasher->num_leaves, width, zero, root) &&
+           memcmp(root, info_piece_root(hasher->info, hasher->piece_index), SHA256_DIGEST_LENGTH) == 0;
+}
+
+const unsigned char *piece_hasher_leaf(const PieceHasher *hasher, size_t block) {
+    if (hasher->leaves == NULL || block >= hasher->num_leaves || !hasher->leaf_ready[block]) {
+        return NULL;
+    }
+    return hasher->leaves + block * SHA256_DIGEST_LENGTH;
+}
+
+void piece_hasher_free(PieceHasher *hasher) {
+    if (hasher->sha1.mdctx != NULL) {
+        sha1_discard(&hasher->sha1);
+    }
+    free(hasher->leaves);
+    free(hasher->leaf_ready);
+    hasher->leaves = NULL;
+    hasher->leaf_ready = NULL;
+}
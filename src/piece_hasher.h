@@ -0,0 +1,45 @@
+#ifndef PIECE_HASHER_H
+#define PIECE_HASHER_H
+
+#include "info.h"
+#include "sha1.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Verifies one piece while its blocks arrive, so nothing has to hold the whole piece.
+// v1 pieces go through one SHA-1 that takes blocks in order; v2 pieces keep a SHA-256 leaf per
+// 16 KiB block, which may arrive in any order and are what a corrupt block is found by
+typedef struct PieceHasher {
+    const MetaInfo *info;
+    uint32_t piece_index;
+    size_t piece_length;
+    size_t hashed;            // Bytes hashed so far (v1: the next block must start here)
+    Sha1Context sha1;         // v1 only
+    unsigned char *leaves;    // v2 only: num_leaves x 32 bytes
+    bool *leaf_ready;
+    size_t num_leaves;
+    size_t file_bytes;        // v2: bytes of the piece inside its file, the rest is padding
+} PieceHasher;
+
+// prepares a hasher for piece 'piece_index'. returns 0 on success and -1 on failure
+int piece_hasher_init(PieceHasher *hasher, const MetaInfo *info, uint32_t piece_index);
+
+// hashes 'length' bytes at offset 'begin' of the piece. v1 blocks must come in order and v2 blocks
+// must be whole 16 KiB blocks (or the file's tail). returns 0 on success and -1 on failure
+int piece_hasher_update(PieceHasher *hasher, size_t begin, const void *data, size_t length);
+
+// true once every byte the piece is checked against has been hashed
+bool piece_hasher_done(const PieceHasher *hasher);
+
+// compares the finished piece to the metainfo, returns 1 on a match and 0 otherwise.
+// v1 can only be checked once, v2 again after corrupt blocks were fed anew
+int piece_hasher_verify(PieceHasher *hasher);
+
+// the SHA-256 of v2 block 'block' as received, NULL if it has not arrived (or the torrent is v1)
+const unsigned char *piece_hasher_leaf(const PieceHasher *hasher, size_t block);
+
+// releases the hasher's digest context and buffers
+void piece_hasher_free(PieceHasher *hasher);
+
+#endif
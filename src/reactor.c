@@ -0,0 +1,1217 @@
+#define _GNU_SOURCE // accept4
+#include "reactor.h"
+#include "bitfield.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_BAD_PIECES 3
+
+enum {
+    BLOCK_MISSING,
+    BLOCK_REQUESTED,
+    BLOCK_RECEIVED
+};
+
+static int abandon_repair(Reactor *reactor, PeerConnection *connection);
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int reactor_init(Reactor *reactor, const MetaInfo *info, Storage *storage) {
+    memset(reactor, 0, sizeof(*reactor));
+    reactor->listen_fd = -1;
+    reactor->info = info;
+    reactor->storage = storage;
+    reactor->max_half_open = DEFAULT_MAX_HALF_OPEN;
+    reactor->max_connections = MAX_PEER_CONNECTIONS;
+    reactor->depth = pipeline_depth();
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->pieces = calloc(info->num_pieces ? info->num_pieces : 1, sizeof(*reactor->pieces));
+    reactor->have = calloc(bitfield_bytes(info->num_pieces) ? bitfield_bytes(info->num_pieces) : 1, 1);
+    if (reactor->epoll_fd < 0 || reactor->pieces == NULL || reactor->have == NULL ||
+        picker_init(&reactor->picker, info->num_pieces, MAX_PEER_CONNECTIONS) < 0) {
+        perror("Failed to set up the download");
+        reactor_free(reactor);
+        return -1;
+    }
+    for (size_t i = 0; i < info->num_pieces; i++) {
+        PieceSlot *slot = &reactor->pieces[i];
+        slot->num_blocks = (info_piece_size(info, i) + BLOCK_LENGTH - 1) / BLOCK_LENGTH;
+        slot->blocks = calloc(slot->num_blocks ? slot->num_blocks : 1, 1);
+        slot->blocks_free = slot->num_blocks;
+        reactor->blocks_free += slot->num_blocks;
+        if (slot->blocks == NULL) {
+            perror("Failed to set up the download");
+            reactor_free(reactor);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Append 'length' bytes to what goes out on the connection
+static int queue_output(PeerConnection *connection, const void *data, size_t length) {
+    if (connection->output_sent > 0) {
+        memmove(connection->output, connection->output + connection->output_sent, connection->output_length - connection->output_sent);
+        connection->output_length -= connection->output_sent;
+        connection->output_sent = 0;
+    }
+    if (connection->output_length + length > connection->output_capacity) {
+        size_t capacity = connection->output_capacity ? connection->output_capacity * 2 : 1024;
+        while (capacity < connection->output_length + length) capacity *= 2;
+        char *output = realloc(connection->output, capacity);
+        if (output == NULL) {
+            return -1;
+        }
+        connection->output = output;
+        connection->output_capacity = capacity;
+    }
+    memcpy(connection->output + connection->output_length, data, length);
+    connection->output_length += length;
+    return 0;
+}
+
+// Write as much of the queued messages as the socket takes. returns 1 once they are all out, 0 if the
+// socket is full and -1 if the connection broke
+static int send_queued(PeerConnection *connection) {
+    while (connection->output_sent < connection->output_length) {
+        ssize_t sent = send(connection->fd, connection->output + connection->output_sent,
+                            connection->output_length - connection->output_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        connection->output_sent += sent;
+        connection->last_sent = now_seconds();
+    }
+    connection->output_length = connection->output_sent = 0;
+    return 1;
+}
+
+// Send more of the oldest block the peer asked for: the 13-byte PIECE header from here, held back with
+// MSG_MORE so it leaves with the data, then the data from the files with sendfile, never copied
+// through our memory. returns like send_queued, 1 meaning progress was made
+static int send_upload(Reactor *reactor, PeerConnection *connection) {
+    const BlockRequest *upload = &connection->uploads[0];
+    ssize_t sent;
+    if (connection->upload_sent < 13) {
+        uint32_t fields[3] = { htonl(9 + upload->length), htonl(upload->piece_index), htonl(upload->begin) };
+        char header[13];
+        memcpy(header, &fields[0], 4);
+        header[4] = PIECE;
+        memcpy(header + 5, &fields[1], 8);
+        sent = send(connection->fd, header + connection->upload_sent, 13 - connection->upload_sent, MSG_NOSIGNAL | MSG_MORE);
+    } else {
+        uint32_t done = connection->upload_sent - 13;
+        sent = storage_send_block(reactor->storage, connection->fd, upload->piece_index, upload->begin + done, upload->length - done);
+        if (sent > 0) reactor->bytes_sent += sent;
+    }
+    if (sent < 0) {
+        return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    connection->upload_sent += sent;
+    connection->last_sent = now_seconds();
+    if (connection->upload_sent == 13 + upload->length) {
+        memmove(&connection->uploads[0], &connection->uploads[1], --connection->num_uploads * sizeof(connection->uploads[0]));
+        connection->upload_sent = 0;
+    }
+    return 1;
+}
+
+// Write out what is queued for the peer: messages and uploads take turns, but a block that has
+// started going out must finish before anything else can. returns -1 if the connection broke
+static int flush_output(Reactor *reactor, PeerConnection *connection) {
+    for (;;) {
+        int status;
+        if (connection->upload_sent == 0 && connection->output_length > 0) {
+            status = send_queued(connection);
+        } else if (connection->num_uploads > 0) {
+            status = send_upload(reactor, connection);
+        } else {
+            return 0;
+        }
+        if (status <= 0) {
+            return status;
+        }
+    }
+}
+
+// Blocks asked for but never answered go back to the pool, for any peer to fetch
+static void release_requests(Reactor *reactor, PeerConnection *connection) {
+    for (int i = 0; i < connection->requests.count; i++) {
+        const BlockRequest *request = &connection->requests.pending[i];
+        PieceSlot *slot = &reactor->pieces[request->piece_index];
+        uint32_t block = request->begin / BLOCK_LENGTH;
+        if (slot->status == PIECE_ACTIVE && slot->blocks[block] == BLOCK_REQUESTED && slot->sources[block] == connection) {
+            slot->blocks[block] = BLOCK_MISSING;
+            slot->sources[block] = NULL;
+            slot->blocks_free++;
+            reactor->blocks_free++;
+        }
+    }
+    request_queue_init(&connection->requests, reactor->depth);
+    wire_detach(&connection->wire); // A block half read into a piece buffer must not land there any more
+}
+
+// Tear down the socket of a session, keeping what is known about the peer
+static void shut_session(Reactor *reactor, PeerConnection *connection) {
+    release_requests(reactor, connection);
+    if (connection->hash_piece >= 0) {
+        abandon_repair(reactor, connection); // Going away anyway, a strike that would drop it changes nothing
+    }
+    if (connection->counted) {
+        picker_remove_bitfield(&reactor->picker, connection->bitfield); // Kept for when it comes back
+        connection->counted = false;
+    }
+    if (connection->fd >= 0) {
+        // Out of the loop explicitly: a copy of the descriptor (a forked child's) would keep it there after
+        // close, reporting events for a session that may be freed by then
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+        close(connection->fd);
+        reactor->num_open--;
+        if (connection->incoming && connection->state == PEER_HANDSHAKE) {
+            reactor->num_half_open--;
+        }
+    }
+    connection->fd = -1;
+    connection->choked = true;
+    connection->interested = false;
+    if (!connection->choking) {
+        reactor->unchoked--;
+    }
+    connection->choking = true;
+    connection->peer_interested = false;
+    connection->num_uploads = 0;
+    connection->upload_sent = 0;
+    wire_free(&connection->wire);
+    free(connection->output);
+    connection->output = NULL;
+    connection->output_length = connection->output_sent = connection->output_capacity = 0;
+}
+
+// Give up on the peer for good (it sent bad data, or is not part of this torrent)
+static void close_connection(Reactor *reactor, PeerConnection *connection) {
+    if (connection->state == PEER_CLOSED) {
+        return;
+    }
+    shut_session(reactor, connection);
+    connection->state = PEER_CLOSED;
+}
+
+// The session broke: reconnect later, waiting twice as long after every failure in a row. a peer
+// that connected to us can't be dialled back, it has to come again by itself
+static void park_connection(Reactor *reactor, PeerConnection *connection) {
+    if (connection->state == PEER_CLOSED) {
+        return;
+    }
+    shut_session(reactor, connection);
+    if (connection->incoming || ++connection->failures > MAX_SESSION_FAILURES) {
+        connection->state = PEER_CLOSED;
+        return;
+    }
+    connection->state = PEER_PARKED;
+    connection->retry_at = now_seconds() + SESSION_RETRY_SECONDS * (double)(1 << (connection->failures - 1));
+}
+
+// Hand the session's socket ('fd', non-blocking) to the loop, starting in 'state'. returns -1 (and
+// closes the socket) on failure
+static int watch_session(Reactor *reactor, PeerConnection *connection, PeerState state) {
+    if (wire_init(&connection->wire, connection->fd) < 0) {
+        close(connection->fd);
+        connection->fd = -1;
+        return -1;
+    }
+    int nodelay = 1;
+    setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = connection };
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, connection->fd, &event) < 0) {
+        close(connection->fd);
+        connection->fd = -1;
+        wire_free(&connection->wire);
+        return -1;
+    }
+    connection->state = state;
+    connection->choked = connection->choking = true;
+    connection->last_activity = connection->last_sent = now_seconds();
+    reactor->num_open++;
+    if (connection->incoming && state == PEER_HANDSHAKE) {
+        reactor->num_half_open++;
+    }
+    return 0;
+}
+
+// Start the non-blocking connect of a session. returns -1 if it could not even begin
+static int open_session(Reactor *reactor, PeerConnection *connection) {
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(connection->peer.port) };
+    if (inet_pton(AF_INET, connection->peer.ip, &address.sin_addr) <= 0) {
+        return -1;
+    }
+    connection->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (connection->fd < 0) {
+        return -1;
+    }
+    if (connect(connection->fd, (struct sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS) {
+        close(connection->fd);
+        connection->fd = -1;
+        return -1;
+    }
+    return watch_session(reactor, connection, PEER_CONNECTING);
+}
+
+// A session with 'peer' that has no socket yet, or NULL if out of memory or slots
+static PeerConnection *new_connection(Reactor *reactor, const Peer *peer) {
+    if (reactor->num_connections == MAX_PEER_CONNECTIONS) {
+        return NULL;
+    }
+    PeerConnection *connection = calloc(1, sizeof(*connection));
+    if (connection == NULL) {
+        return NULL;
+    }
+    connection->peer = *peer;
+    connection->reactor = reactor;
+    connection->fd = -1;
+    connection->hash_piece = -1;
+    request_queue_init(&connection->requests, reactor->depth);
+    connection->bitfield = calloc(bitfield_bytes(reactor->info->num_pieces) ? bitfield_bytes(reactor->info->num_pieces) : 1, 1);
+    if (connection->bitfield == NULL) {
+        free(connection);
+        return NULL;
+    }
+    return connection;
+}
+
+int reactor_add_peer(Reactor *reactor, const Peer *peer) {
+    for (size_t i = 0; i < reactor->num_connections; i++) {
+        const PeerConnection *known = reactor->connections[i];
+        if (!known->incoming && known->peer.port == peer->port && strcmp(known->peer.ip, peer->ip) == 0) {
+            return 0; // A tracker that is asked again names the same peers
+        }
+    }
+    size_t remembered = reactor->num_given_up < MAX_GIVEN_UP ? reactor->num_given_up : MAX_GIVEN_UP;
+    for (size_t i = 0; i < remembered; i++) {
+        if (reactor->given_up[i].port == peer->port && strcmp(reactor->given_up[i].ip, peer->ip) == 0) {
+            return 0;
+        }
+    }
+    PeerConnection *connection = new_connection(reactor, peer);
+    if (connection == NULL) {
+        return -1;
+    }
+    if (reactor->num_open >= reactor->max_connections) {
+        // No socket to spare: parked, it is dialled as soon as one closes (see service_sessions)
+        connection->state = PEER_PARKED;
+        connection->retry_at = now_seconds();
+    } else if (open_session(reactor, connection) < 0) {
+        free(connection->bitfield);
+        free(connection);
+        return -1;
+    }
+    reactor->connections[reactor->num_connections++] = connection;
+    return 0;
+}
+
+int reactor_listen(Reactor *reactor, int port, int max_half_open, int max_connections) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY) };
+    struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL }; // NULL tells it from the sessions
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0 ||
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    if (reactor->listen_fd >= 0) {
+        close(reactor->listen_fd);
+    }
+    reactor->listen_fd = fd;
+    reactor->max_half_open = max_half_open;
+    reactor->max_connections = max_connections < MAX_PEER_CONNECTIONS ? max_connections : MAX_PEER_CONNECTIONS;
+    return 0;
+}
+
+// Take every pending connection off the listening socket (edge-triggered). each becomes a session
+// waiting for the peer's handshake, unless that would break a limit: then it is closed right away,
+// leaving it in the backlog would only have it time out there. out of descriptors, the rest stay in
+// the backlog with no edge left to report them: 'accept_pending' has service_sessions come back for them
+static void accept_peers(Reactor *reactor) {
+    for (;;) {
+        struct sockaddr_in address;
+        socklen_t length = sizeof(address);
+        int fd = accept4(reactor->listen_fd, (struct sockaddr *)&address, &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            reactor->accept_pending = errno != EAGAIN && errno != EWOULDBLOCK;
+            return;
+        }
+        Peer peer = { .port = ntohs(address.sin_port) };
+        inet_ntop(AF_INET, &address.sin_addr, peer.ip, sizeof(peer.ip));
+        PeerConnection *connection = reactor->num_open < reactor->max_connections && reactor->num_half_open < reactor->max_half_open ?
+                                     new_connection(reactor, &peer) : NULL;
+        if (connection == NULL) {
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        connection->incoming = true;
+        if (watch_session(reactor, connection, PEER_HANDSHAKE) < 0) {
+            free(connection->bitfield);
+            free(connection);
+            continue;
+        }
+        reactor->connections[reactor->num_connections++] = connection;
+    }
+}
+
+// Free a closed session, so its slot can take another. pieces it sent blocks of forget it, and the
+// address of a peer we dialled is kept in 'given_up' so reactor_add_peer won't dial it again
+static void forget_connection(Reactor *reactor, size_t index) {
+    PeerConnection *connection = reactor->connections[index];
+    if (!connection->incoming) {
+        reactor->given_up[reactor->num_given_up++ % MAX_GIVEN_UP] = connection->peer;
+    }
+    for (size_t i = 0; i < reactor->picker.num_partial; i++) {
+        PieceSlot *slot = &reactor->pieces[reactor->picker.partial[i]];
+        for (uint32_t b = 0; b < slot->num_blocks; b++) {
+            if (slot->sources[b] == connection) slot->sources[b] = NULL;
+        }
+    }
+    free(connection->bitfield);
+    free(connection);
+    reactor->connections[index] = reactor->connections[--reactor->num_connections];
+}
+
+size_t reactor_active_peers(const Reactor *reactor) {
+    size_t active = 0;
+    for (size_t i = 0; i < reactor->num_connections; i++) {
+        active += reactor->connections[i]->state != PEER_CLOSED;
+    }
+    return active;
+}
+
+// Drop the assembly state of a piece: done, or failed and to be fetched again from scratch
+static void reset_piece(Reactor *reactor, uint32_t piece_index, PieceStatus status) {
+    PieceSlot *slot = &reactor->pieces[piece_index];
+    piece_hasher_free(&slot->hasher);
+    memset(&slot->hasher, 0, sizeof(slot->hasher));
+    free(slot->buffer);
+    free(slot->sources);
+    slot->buffer = NULL;
+    slot->sources = NULL;
+    memset(slot->blocks, BLOCK_MISSING, slot->num_blocks);
+    reactor->blocks_free += (status == PIECE_DONE ? 0 : slot->num_blocks) - slot->blocks_free;
+    slot->blocks_free = slot->num_blocks;
+    slot->blocks_received = 0;
+    slot->status = status;
+    if (status == PIECE_DONE) {
+        picker_set_done(&reactor->picker, piece_index);
+    } else {
+        picker_set_partial(&reactor->picker, piece_index, false);
+    }
+}
+
+// Start assembling a piece. returns -1 if there is no memory for it
+static int activate_piece(Reactor *reactor, uint32_t piece_index) {
+    PieceSlot *slot = &reactor->pieces[piece_index];
+    if (piece_hasher_init(&slot->hasher, reactor->info, piece_index) < 0) {
+        return -1;
+    }
+    slot->buffer = malloc(slot->hasher.piece_length ? slot->hasher.piece_length : 1);
+    slot->sources = calloc(slot->num_blocks ? slot->num_blocks : 1, sizeof(*slot->sources));
+    if (slot->buffer == NULL || slot->sources == NULL) {
+        reset_piece(reactor, piece_index, PIECE_MISSING);
+        return -1;
+    }
+    slot->status = PIECE_ACTIVE;
+    picker_set_partial(&reactor->picker, piece_index, true);
+    return 0;
+}
+
+// Tell every session past its handshake about a piece we can now serve (sessions still connecting
+// get it with the rest of our bitfield). peers that have it already need not hear about it, and one
+// that misses it for lack of memory only misses a piece it could have had from us
+static void announce_piece(Reactor *reactor, uint32_t piece_index) {
+    char message[LENGTH_PREFIX_SIZE + 5] = { 0, 0, 0, 5, HAVE };
+    uint32_t index = htonl(piece_index);
+    memcpy(message + LENGTH_PREFIX_SIZE + 1, &index, 4);
+    for (size_t i = 0; i < reactor->num_connections; i++) {
+        PeerConnection *connection = reactor->connections[i];
+        if (connection->state >= PEER_HANDSHAKE && connection->state < PEER_PARKED && !bitfield_get(connection->bitfield, piece_index)) {
+            queue_output(connection, message, sizeof(message));
+        }
+    }
+}
+
+// Count a piece that failed against a peer that sent part of it, giving up on the peer after
+// MAX_BAD_PIECES. returns true if that is 'connection', which the caller is in the middle of using
+static bool strike_source(Reactor *reactor, PeerConnection *connection, PeerConnection *source) {
+    if (++source->bad_pieces < MAX_BAD_PIECES) {
+        return false;
+    }
+    if (source == connection) {
+        return true;
+    }
+    close_connection(reactor, source);
+    return false;
+}
+
+// No way to tell which block of the piece was bad: it starts over, and every source gets a strike
+// (once per piece). returns 1 if 'connection' itself should be dropped for sending bad data
+static int fail_piece(Reactor *reactor, PeerConnection *connection, uint32_t piece_index) {
+    PieceSlot *slot = &reactor->pieces[piece_index];
+    bool drop = false;
+    for (uint32_t b = 0; b < slot->num_blocks; b++) {
+        PeerConnection *source = slot->sources[b];
+        bool seen = false;
+        for (uint32_t earlier = 0; earlier < b && !seen; earlier++) {
+            seen = slot->sources[earlier] == source;
+        }
+        if (source != NULL && !seen) {
+            drop |= strike_source(reactor, connection, source);
+        }
+    }
+    reset_piece(reactor, piece_index, PIECE_MISSING);
+    return drop ? 1 : 0;
+}
+
+// A failed v2 piece, with 'expected' holding what each of its blocks should hash to (NULL if that
+// could not be had): the blocks whose leaf differs go back to the pool and only their senders get a
+// strike, the rest of the piece stays. returns like fail_piece
+static int repair_piece_blocks(Reactor *reactor, PeerConnection *connection, uint32_t piece_index, const unsigned char *expected) {
+    PieceSlot *slot = &reactor->pieces[piece_index];
+    uint32_t bad = 0;
+    for (uint32_t b = 0; expected != NULL && b < slot->hasher.num_leaves; b++) {
+        const unsigned char *leaf = piece_hasher_leaf(&slot->hasher, b);
+        if (leaf == NULL || memcmp(leaf, expected + (size_t)b * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH) != 0) {
+            slot->blocks[b] = BLOCK_MISSING;
+            bad++;
+        }
+    }
+    if (bad == 0) {
+        return fail_piece(reactor, connection, piece_index);
+    }
+
+    bool drop = false;
+    for (uint32_t b = 0; b < slot->num_blocks; b++) {
+        PeerConnection *source = slot->sources[b];
+        bool seen = false;
+        for (uint32_t earlier = 0; earlier < b && !seen; earlier++) {
+            seen = slot->blocks[earlier] == BLOCK_MISSING && slot->sources[earlier] == source;
+        }
+        if (slot->blocks[b] == BLOCK_MISSING && source != NULL && !seen) {
+            drop |= strike_source(reactor, connection, source);
+        }
+    }
+    for (uint32_t b = 0; b < slot->num_blocks; b++) {
+        if (slot->blocks[b] == BLOCK_MISSING) slot->sources[b] = NULL;
+    }
+    slot->blocks_received -= bad;
+    slot->blocks_free += bad;
+    reactor->blocks_free += bad;
+    return drop ? 1 : 0;
+}
+
+// Ask a peer that has the failed v2 piece what its blocks should hash to (a HASH_REQUEST, answered in
+// receive_hashes), one that says it speaks v2 if there is one. returns -1 if nobody can be asked
+static int request_repair(Reactor *reactor, uint32_t piece_index) {
+    char request[HASH_REQUEST_LENGTH];
+    if (construct_hash_request(request, reactor->info, piece_index) < 0) {
+        return -1;
+    }
+    PeerConnection *asked = NULL;
+    for (size_t i = 0; i < reactor->num_connections; i++) {
+        PeerConnection *connection = reactor->connections[i];
+        if (connection->state < PEER_INTERESTED || connection->state > PEER_TRANSFERRING || connection->hash_piece >= 0 ||
+            !bitfield_get(connection->bitfield, piece_index)) {
+            continue;
+        }
+        if (asked == NULL || (connection->speaks_v2 && !asked->speaks_v2)) {
+            asked = connection;
+        }
+    }
+    if (asked == NULL || queue_output(asked, request, sizeof(request)) < 0) {
+        return -1;
+    }
+    asked->hash_piece = piece_index;
+    asked->hash_asked_at = now_seconds();
+    return 0;
+}
+
+// Every block is in: verify the piece and write it out. a bad v1 piece starts over whole, a bad v2
+// piece (hybrid too) has only its corrupt blocks fetched again once we know which they are.
+// returns -1 if the storage failed and 1 if 'connection' itself should be dropped for sending bad data
+static int finish_piece(Reactor *reactor, PeerConnection *connection, uint32_t piece_index) {
+    PieceSlot *slot = &reactor->pieces[piece_index];
+    if (piece_hasher_verify(&slot->hasher)) {
+        if (storage_write_piece(reactor->storage, piece_index, slot->buffer, slot->hasher.piece_length) < 0) {
+            return -1;
+        }
+        bitfield_set(reactor->have, piece_index);
+        reactor->pieces_done++;
+        reset_piece(reactor, piece_index, PIECE_DONE);
+        announce_piece(reactor, piece_index);
+        return 0;
+    }
+    if (slot->hasher.leaves == NULL) {
+        return fail_piece(reactor, connection, piece_index);
+    }
+    if (info_piece_tree_width(reactor->info, piece_index) == 1) {
+        // A one-block piece: its root is the block's hash
+        return repair_piece_blocks(reactor, connection, piece_index, info_piece_root(reactor->info, piece_index));
+    }
+    return request_repair(reactor, piece_index) == 0 ? 0 : fail_piece(reactor, connection, piece_index);
+}
+
+// The block hashes asked for by request_repair came (HASHES) or were refused (HASH_REJECT).
+// returns like handle_message
+static int receive_hashes(Reactor *reactor, PeerConnection *connection, const WireFrame *frame) {
+    if (connection->hash_piece < 0) {
+        return 0; // Not ours
+    }
+    uint32_t piece_index = connection->hash_piece;
+    connection->hash_piece = -1;
+    unsigned char *expected = malloc(info_piece_tree_width(reactor->info, piece_index) * SHA256_DIGEST_LENGTH);
+    bool valid = expected != NULL && frame->id == HASHES &&
+                 parse_block_hashes(reactor->info, piece_index, frame->payload, frame->size, expected) == 0;
+    int status = repair_piece_blocks(reactor, connection, piece_index, valid ? expected : NULL);
+    free(expected);
+    return status > 0 ? -3 : 0;
+}
+
+// The peer asked for block hashes won't give them (it went away, or took too long): the piece starts
+// over whole. returns like fail_piece
+static int abandon_repair(Reactor *reactor, PeerConnection *connection) {
+    uint32_t piece_index = connection->hash_piece;
+    connection->hash_piece = -1;
+    return fail_piece(reactor, connection, piece_index);
+}
+
+// Whether 'connection' has an outstanding request for the block at 'begin' of 'piece_index'
+static bool requested_from(const PeerConnection *connection, uint32_t piece_index, uint32_t begin) {
+    for (int i = 0; i < connection->requests.count; i++) {
+        const BlockRequest *request = &connection->requests.pending[i];
+        if (request->piece_index == piece_index && request->begin == begin) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// A block is in: take back with CANCEL any other request for it still outstanding, and stop whoever
+// was reading its copy straight into the piece
+static void cancel_duplicates(Reactor *reactor, PeerConnection *connection, const BlockRequest *block) {
+    char *placement = reactor->pieces[block->piece_index].buffer + block->begin;
+    char cancel[17];
+    construct_cancel_message(cancel, block->piece_index, block->begin, block->length);
+    for (size_t i = 0; i < reactor->num_connections; i++) {
+        PeerConnection *other = reactor->connections[i];
+        if (other == connection || other->fd < 0) {
+            continue;
+        }
+        if (other->wire.target == placement && wire_detach(&other->wire) < 0) {
+            park_connection(reactor, other); // Can't leave it writing into the piece
+            continue;
+        }
+        if (request_queue_match(&other->requests, block->piece_index, block->begin, block->length) == 0 &&
+            queue_output(other, cancel, sizeof(cancel)) < 0) {
+            park_connection(reactor, other);
+        }
+    }
+}
+
+// Put a block that answers one of our requests in its piece and hash what can be hashed. returns like finish_piece
+static int receive_block(Reactor *reactor, PeerConnection *connection, const BlockRequest *block, const char *data) {
+    PieceSlot *slot = &reactor->pieces[block->piece_index];
+    uint32_t index = block->begin / BLOCK_LENGTH;
+    if (slot->status != PIECE_ACTIVE || block->begin % BLOCK_LENGTH != 0 || index >= slot->num_blocks ||
+        slot->blocks[index] == BLOCK_RECEIVED) {
+        return 0; // Late duplicate
+    }
+    // Other peers may have it on the way too: asked for in the endgame, or released by a peer that then
+    // sent it anyway. whether that's so is decided per block, by what the other connections have outstanding
+    cancel_duplicates(reactor, connection, block);
+    if (data != slot->buffer + block->begin) {
+        memcpy(slot->buffer + block->begin, data, block->length); // It was in the ring already
+    }
+    if (slot->blocks[index] == BLOCK_MISSING) {
+        slot->blocks_free--;
+        reactor->blocks_free--;
+    }
+    slot->blocks[index] = BLOCK_RECEIVED;
+    slot->sources[index] = connection;
+    slot->blocks_received++;
+    reactor->bytes_received += block->length;
+
+    PieceHasher *hasher = &slot->hasher;
+    if (hasher->leaves != NULL) {
+        piece_hasher_update(hasher, block->begin, slot->buffer + block->begin, block->length);
+    } else {
+        // SHA-1 takes the piece in order: feed it every block that is now contiguous with what it has
+        while (hasher->hashed < hasher->piece_length && slot->blocks[hasher->hashed / BLOCK_LENGTH] == BLOCK_RECEIVED) {
+            size_t length = hasher->piece_length - hasher->hashed < BLOCK_LENGTH ? hasher->piece_length - hasher->hashed : BLOCK_LENGTH;
+            piece_hasher_update(hasher, hasher->hashed, slot->buffer + hasher->hashed, length);
+        }
+    }
+    return slot->blocks_received == slot->num_blocks ? finish_piece(reactor, connection, block->piece_index) : 0;
+}
+
+// Pieces this connection could fetch blocks of: not started, or started with blocks nobody has asked for yet
+static bool piece_has_free_blocks(void *context, uint32_t index) {
+    const PieceSlot *slot = &((const Reactor *)context)->pieces[index];
+    return slot->status == PIECE_MISSING || (slot->status == PIECE_ACTIVE && slot->blocks_free > 0);
+}
+
+// Tell the peer whether it has anything we still need, when that changed
+static int update_interest(Reactor *reactor, PeerConnection *connection) {
+    bool wanted = bitfield_any_missing(connection->bitfield, reactor->have, reactor->info->num_pieces);
+    if (wanted == connection->interested) {
+        return 0;
+    }
+    char message[LENGTH_PREFIX_SIZE + 1] = { 0, 0, 0, 1, wanted ? INTERESTED : NOT_INTERESTED };
+    connection->interested = wanted;
+    return queue_output(connection, message, sizeof(message));
+}
+
+// Endgame: every block left is asked for from somebody already, and the slowest of those peers would
+// decide when the download ends. ask this one too for the blocks it has, the first copy in wins
+static void request_duplicates(Reactor *reactor, PeerConnection *connection) {
+    const PiecePicker *picker = &reactor->picker;
+    for (size_t i = 0; i < picker->num_partial && request_queue_has_room(&connection->requests); i++) {
+        uint32_t piece_index = picker->partial[i];
+        const PieceSlot *slot = &reactor->pieces[piece_index];
+        if (!bitfield_get(connection->bitfield, piece_index)) {
+            continue;
+        }
+        for (uint32_t b = 0; b < slot->num_blocks && request_queue_has_room(&connection->requests); b++) {
+            uint32_t begin = b * BLOCK_LENGTH;
+            if (slot->blocks[b] == BLOCK_REQUESTED && !requested_from(connection, piece_index, begin)) {
+                uint32_t length = slot->hasher.piece_length - begin < BLOCK_LENGTH ? slot->hasher.piece_length - begin : BLOCK_LENGTH;
+                request_queue_push(&connection->requests, piece_index, begin, length);
+            }
+        }
+    }
+}
+
+// Fill the connection's request window block by block. the picker decides which piece to take them
+// from: one already being assembled if the peer has it, so several peers share a piece, otherwise the rarest
+static int schedule_requests(Reactor *reactor, PeerConnection *connection) {
+    if (connection->state != PEER_TRANSFERRING || connection->choked || !connection->interested) {
+        return 0;
+    }
+    bool waiting = connection->requests.count > 0;
+    long piece_index = -1;
+    uint32_t next = 0;
+    while (request_queue_has_room(&connection->requests)) {
+        PieceSlot *slot = piece_index >= 0 ? &reactor->pieces[piece_index] : NULL;
+        if (slot == NULL || slot->blocks_free == 0) {
+            piece_index = picker_pick(&reactor->picker, connection->bitfield, piece_has_free_blocks, reactor);
+            if (piece_index < 0) {
+                break;
+            }
+            slot = &reactor->pieces[piece_index];
+            if (slot->status == PIECE_MISSING && activate_piece(reactor, piece_index) < 0) {
+                break;
+            }
+            next = 0;
+        }
+        while (slot->blocks[next] != BLOCK_MISSING) {
+            next++;
+        }
+        uint32_t begin = next * BLOCK_LENGTH;
+        uint32_t length = slot->hasher.piece_length - begin < BLOCK_LENGTH ? slot->hasher.piece_length - begin : BLOCK_LENGTH;
+        request_queue_push(&connection->requests, piece_index, begin, length);
+        slot->blocks[next] = BLOCK_REQUESTED;
+        slot->sources[next] = connection;
+        slot->blocks_free--;
+        reactor->blocks_free--;
+    }
+    if (reactor->blocks_free == 0) {
+        request_duplicates(reactor, connection);
+    }
+
+    if (connection->requests.count == 0) {
+        return update_interest(reactor, connection); // Nothing left to fetch here, maybe nothing at all
+    }
+    if (!waiting) {
+        connection->last_activity = now_seconds(); // The peer has PEER_TIMEOUT_SECONDS from now to answer
+    }
+    char packets[MAX_PIPELINE_DEPTH * 17];
+    size_t length = request_queue_encode(&connection->requests, packets);
+    return length > 0 ? queue_output(connection, packets, length) : 0;
+}
+
+// The peer told us (more of) what it has
+static int learned_pieces(Reactor *reactor, PeerConnection *connection) {
+    if (!connection->counted) {
+        picker_add_bitfield(&reactor->picker, connection->bitfield);
+        connection->counted = true;
+    }
+    if (connection->state == PEER_BITFIELD) {
+        connection->state = connection->choked ? PEER_INTERESTED : PEER_TRANSFERRING;
+    }
+    return connection->interested ? 0 : update_interest(reactor, connection);
+}
+
+// The peer asked for a block. one of a piece we have is queued for send_upload, one outside its piece
+// or too big gets the peer dropped, anything else (choked, or a piece we lack) is ignored.
+// returns like handle_message
+static int queue_upload(Reactor *reactor, PeerConnection *connection, const BlockRequest *block) {
+    if (block->piece_index >= reactor->info->num_pieces || block->length == 0 || block->length > BLOCK_LENGTH ||
+        block->begin > info_piece_size(reactor->info, block->piece_index) ||
+        block->length > info_piece_size(reactor->info, block->piece_index) - block->begin) {
+        return -3;
+    }
+    if (connection->choking || connection->num_uploads == MAX_UPLOAD_QUEUE || !bitfield_get(reactor->have, block->piece_index)) {
+        return 0;
+    }
+    for (int i = 0; i < connection->num_uploads; i++) {
+        const BlockRequest *upload = &connection->uploads[i];
+        if (upload->piece_index == block->piece_index && upload->begin == block->begin && upload->length == block->length) {
+            return 0; // Asked twice
+        }
+    }
+    connection->uploads[connection->num_uploads++] = *block;
+    return 0;
+}
+
+// The peer no longer wants a block it asked for. one already going out is finished regardless
+static void cancel_upload(PeerConnection *connection, const BlockRequest *block) {
+    for (int i = connection->upload_sent > 0 ? 1 : 0; i < connection->num_uploads; i++) {
+        const BlockRequest *upload = &connection->uploads[i];
+        if (upload->piece_index == block->piece_index && upload->begin == block->begin && upload->length == block->length) {
+            memmove(&connection->uploads[i], &connection->uploads[i + 1], (connection->num_uploads - i - 1) * sizeof(connection->uploads[0]));
+            connection->num_uploads--;
+            return;
+        }
+    }
+}
+
+// Give the peer one of the upload slots
+static int unchoke_peer(Reactor *reactor, PeerConnection *connection) {
+    char unchoke[LENGTH_PREFIX_SIZE + 1] = { 0, 0, 0, 1, UNCHOKE };
+    connection->choking = false;
+    connection->unchoked_at = now_seconds();
+    reactor->unchoked++;
+    return queue_output(connection, unchoke, sizeof(unchoke));
+}
+
+// Take the peer's upload slot back. the requests it has queued are dropped, as the protocol says a
+// CHOKE does, except a block that has started going out
+static int choke_peer(Reactor *reactor, PeerConnection *connection) {
+    char choke[LENGTH_PREFIX_SIZE + 1] = { 0, 0, 0, 1, CHOKE };
+    connection->choking = true;
+    connection->num_uploads = connection->upload_sent > 0 ? 1 : 0;
+    reactor->unchoked--;
+    return queue_output(connection, choke, sizeof(choke));
+}
+
+// Act on one message from the peer. returns 0 to go on, -1 to park the session, -2 if the storage failed
+// and -3 to give up on the peer
+static int handle_message(Reactor *reactor, PeerConnection *connection, const WireFrame *frame) {
+    const MetaInfo *info = reactor->info;
+    const char *payload = frame->payload;
+    uint32_t length = frame->size;
+    uint32_t value;
+    if (connection->state == PEER_BITFIELD && frame->id != BITFIELD && frame->id != HAVE) {
+        // A BITFIELD can only come first, so the peer has nothing yet
+        int status = learned_pieces(reactor, connection);
+        if (status < 0) {
+            return status;
+        }
+    }
+    switch (frame->id) {
+        case CHOKE:
+            connection->choked = true;
+            release_requests(reactor, connection); // The peer drops our requests, others may serve the blocks
+            if (connection->state == PEER_TRANSFERRING) connection->state = PEER_INTERESTED;
+            return 0;
+        case UNCHOKE:
+            connection->choked = false;
+            if (connection->state == PEER_INTERESTED) connection->state = PEER_TRANSFERRING;
+            return 0;
+        case INTERESTED:
+            connection->peer_interested = true; // An upload slot is handed out by assign_upload_slots
+            return 0;
+        case NOT_INTERESTED:
+            connection->peer_interested = false;
+            return connection->choking ? 0 : choke_peer(reactor, connection);
+        case REQUEST:
+        case CANCEL: {
+            if (length < 13) return -1;
+            uint32_t fields[3];
+            memcpy(fields, payload + 1, sizeof(fields));
+            BlockRequest block = { ntohl(fields[0]), ntohl(fields[1]), ntohl(fields[2]) };
+            return frame->id == REQUEST ? queue_upload(reactor, connection, &block) : (cancel_upload(connection, &block), 0);
+        }
+        case HAVE:
+            if (length < 5) return -1;
+            memcpy(&value, payload + 1, 4);
+            value = ntohl(value);
+            if (value < info->num_pieces && !bitfield_get(connection->bitfield, value)) {
+                bitfield_set(connection->bitfield, value);
+                if (connection->counted) picker_add_piece(&reactor->picker, value);
+            }
+            return learned_pieces(reactor, connection);
+        case BITFIELD: {
+            size_t bytes = bitfield_bytes(info->num_pieces);
+            if (connection->counted) {
+                picker_remove_bitfield(&reactor->picker, connection->bitfield);
+                connection->counted = false;
+            }
+            memcpy(connection->bitfield, payload + 1, length - 1 < bytes ? length - 1 : bytes);
+            if (info->num_pieces % 8) {
+                connection->bitfield[bytes - 1] &= 0xff << (8 - info->num_pieces % 8); // Spare bits mean nothing
+            }
+            return learned_pieces(reactor, connection);
+        }
+        case PIECE: {
+            if (length < 9) return -1;
+            BlockRequest block = { frame->piece_index, frame->begin, frame->length };
+            if (request_queue_match(&connection->requests, block.piece_index, block.begin, block.length) < 0) {
+                return 0; // Not asked for (or cancelled by a choke)
+            }
+            connection->failures = 0;
+            int status = receive_block(reactor, connection, &block, frame->data);
+            return status < 0 ? -2 : status > 0 ? -3 : 0;
+        }
+        case HASHES:
+        case HASH_REJECT:
+            return receive_hashes(reactor, connection, frame);
+        default:
+            return 0; // Extensions and the like
+    }
+}
+
+// A block whose header is in but whose data is still on the way is read straight into its piece, if
+// it is one we asked this peer for. blocks already in the ring are copied from there
+static char *block_destination(void *context, uint32_t piece_index, uint32_t begin, uint32_t length) {
+    PeerConnection *connection = context;
+    const RequestQueue *requests = &connection->requests;
+    for (int i = 0; i < requests->count - requests->unsent; i++) {
+        const BlockRequest *request = &requests->pending[i];
+        if (request->piece_index == piece_index && request->begin == begin && request->length == length) {
+            PieceSlot *slot = &connection->reactor->pieces[piece_index];
+            uint32_t block = begin / BLOCK_LENGTH;
+            return slot->status == PIECE_ACTIVE && slot->blocks[block] == BLOCK_REQUESTED && slot->sources[block] == connection ?
+                   slot->buffer + begin : NULL;
+        }
+    }
+    return NULL;
+}
+
+// Queue our handshake, and our bitfield if there is anything in it
+static int send_handshake(Reactor *reactor, PeerConnection *connection) {
+    char handshake[PACKET_LENGTH];
+    construct_handshake_packet(handshake, (const char *)reactor->info->info_hash);
+    if (reactor->info->info_hash_v2 != NULL) {
+        handshake[27] |= HANDSHAKE_V2_FLAG;
+    }
+    if (queue_output(connection, handshake, sizeof(handshake)) < 0) {
+        return -1;
+    }
+    if (reactor->pieces_done == 0) {
+        return 0; // Nothing to offer yet, HAVEs follow as pieces are verified
+    }
+    size_t bytes = bitfield_bytes(reactor->info->num_pieces);
+    uint32_t prefix = htonl(1 + bytes);
+    char header[LENGTH_PREFIX_SIZE + 1];
+    memcpy(header, &prefix, LENGTH_PREFIX_SIZE);
+    header[LENGTH_PREFIX_SIZE] = BITFIELD;
+    return queue_output(connection, header, sizeof(header)) < 0 || queue_output(connection, reactor->have, bytes) < 0 ? -1 : 0;
+}
+
+// Handle every complete message read so far, returns like handle_message
+static int parse_input(Reactor *reactor, PeerConnection *connection) {
+    if (connection->state == PEER_HANDSHAKE) {
+        char handshake[PACKET_LENGTH];
+        if (!wire_take(&connection->wire, handshake, sizeof(handshake))) {
+            return 0;
+        }
+        if (handshake[0] != 19 || memcmp(handshake + 1, PROTOCOL_STRING, 19) != 0 ||
+            memcmp(handshake + 28, reactor->info->info_hash, 20) != 0) {
+            return -3; // Not BitTorrent, or another torrent
+        }
+        connection->speaks_v2 = handshake[27] & HANDSHAKE_V2_FLAG;
+        if (connection->incoming && send_handshake(reactor, connection) < 0) {
+            return -1; // The peer went first, we answer now that we know it wants this torrent
+        }
+        if (connection->incoming) {
+            reactor->num_half_open--;
+        }
+        connection->state = PEER_BITFIELD;
+    }
+
+    WireFrame frame;
+    int more;
+    while ((more = wire_next(&connection->wire, &frame, block_destination, connection)) == 1) {
+        if (frame.size > 0) { // Zero is a keep-alive
+            int status = handle_message(reactor, connection, &frame);
+            if (status < 0) {
+                return status;
+            }
+        }
+    }
+    return more < 0 ? -1 : 0;
+}
+
+// Read everything the socket has (edge-triggered), parsing as it comes. returns like handle_message
+static int read_input(Reactor *reactor, PeerConnection *connection) {
+    for (;;) {
+        int status = parse_input(reactor, connection);
+        if (status < 0) {
+            return status;
+        }
+        ssize_t received = wire_fill(&connection->wire);
+        if (received < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (received == 0) {
+            return -1; // Peer closed
+        }
+        connection->last_activity = now_seconds();
+    }
+}
+
+// The non-blocking connect finished: check how, then send our handshake
+static int finish_connect(Reactor *reactor, PeerConnection *connection) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+        return -1;
+    }
+    connection->state = PEER_HANDSHAKE;
+    connection->last_activity = now_seconds();
+    return send_handshake(reactor, connection);
+}
+
+// Run the state machine of one connection for the events epoll reported, returns like handle_message
+static int handle_events(Reactor *reactor, PeerConnection *connection, uint32_t events) {
+    if (connection->state == PEER_CONNECTING) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return 0;
+        }
+        if (finish_connect(reactor, connection) < 0) {
+            return -1;
+        }
+    }
+    if (events & EPOLLIN) {
+        int status = read_input(reactor, connection);
+        if (status < 0) {
+            return status;
+        }
+    }
+    if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Whether the session went quiet for longer than it may, given what it is waiting for
+static bool session_expired(const PeerConnection *connection, double now) {
+    bool waiting = connection->state < PEER_INTERESTED || connection->requests.count > 0;
+    return now - connection->last_activity > (waiting ? PEER_TIMEOUT_SECONDS : PEER_IDLE_SECONDS);
+}
+
+// Hand the upload slots to interested peers, the one that has waited longest since its last turn first.
+// while somebody waits and every slot is taken, the peer that has held its slot longest gives it up
+// after UNCHOKE_ROTATE_SECONDS, so a few greedy peers can't keep the others out for good
+static void assign_upload_slots(Reactor *reactor, double now) {
+    PeerConnection *longest = NULL;
+    bool waiting = false;
+    for (size_t i = 0; i < reactor->num_connections; i++) {
+        PeerConnection *connection = reactor->connections[i];
+        if (connection->choking) {
+            waiting |= connection->peer_interested;
+        } else if (longest == NULL || connection->unchoked_at < longest->unchoked_at) {
+            longest = connection;
+        }
+    }
+    if (!waiting) {
+        return;
+    }
+    if (reactor->unchoked >= MAX_UNCHOKED && longest != NULL && now - longest->unchoked_at >= UNCHOKE_ROTATE_SECONDS &&
+        choke_peer(reactor, longest) < 0) {
+        park_connection(reactor, longest);
+    }
+    while (reactor->unchoked < MAX_UNCHOKED) {
+        PeerConnection *next = NULL;
+        for (size_t i = 0; i < reactor->num_connections; i++) {
+            PeerConnection *connection = reactor->connections[i];
+            if (connection->choking && connection->peer_interested && (next == NULL || connection->unchoked_at < next->unchoked_at)) {
+                next = connection;
+            }
+        }
+        if (next == NULL) {
+            return;
+        }
+        if (unchoke_peer(reactor, next) < 0) {
+            park_connection(reactor, next);
+        }
+    }
+}
+
+// Look after every session once per loop: hand out the upload slots, reconnect parked ones that are due
+// (while 'max_connections' allows), expire silent ones, top up request windows (a piece freed by a parked
+// session can go to any other peer), keep idle ones alive, then push out whatever is queued
+static void service_sessions(Reactor *reactor, double now) {
+    if (reactor->accept_pending) {
+        accept_peers(reactor); // A session that closed since may have freed a descriptor
+    }
+    assign_upload_slots(reactor, now);
+    for (size_t i = 0; i < reactor->num_connections; i++) {
+        PeerConnection *connection = reactor->connections[i];
+        if (connection->state == PEER_CLOSED) {
+            forget_connection(reactor, i--);
+            continue;
+        }
+        if (connection->state == PEER_PARKED && now >= connection->retry_at && reactor->num_open < reactor->max_connections &&
+            open_session(reactor, connection) < 0) {
+            park_connection(reactor, connection);
+        }
+        if (connection->state == PEER_CLOSED || connection->state == PEER_PARKED) {
+            continue;
+        }
+        // No answer is no reason to park the peer, it may just not speak v2
+        if (connection->hash_piece >= 0 && now - connection->hash_asked_at > PEER_TIMEOUT_SECONDS &&
+            abandon_repair(reactor, connection) > 0) {
+            close_connection(reactor, connection);
+        }
+        if (connection->state == PEER_CLOSED) {
+            continue;
+        }
+        if (connection->state >= PEER_INTERESTED && now - connection->last_sent > KEEPALIVE_SECONDS && connection->output_length == 0) {
+            char keepalive[LENGTH_PREFIX_SIZE] = { 0 };
+            queue_output(connection, keepalive, sizeof(keepalive));
+        }
+        if (session_expired(connection, now) || schedule_requests(reactor, connection) < 0 || flush_output(reactor, connection) < 0) {
+            park_connection(reactor, connection);
+        }
+    }
+}
+
+// One turn of the loop: handle what epoll reports within 250 ms, then look after every session.
+// returns -1 if epoll or the storage failed
+static int run_once(Reactor *reactor) {
+    struct epoll_event events[64];
+    int count = epoll_wait(reactor->epoll_fd, events, 64, 250);
+    if (count < 0) {
+        if (errno == EINTR) return 0;
+        perror("epoll_wait");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        PeerConnection *connection = events[i].data.ptr;
+        if (connection == NULL) {
+            accept_peers(reactor);
+            continue;
+        }
+        if (connection->state == PEER_CLOSED || connection->state == PEER_PARKED) {
+            continue;
+        }
+        int status = handle_events(reactor, connection, events[i].events);
+        if (status == -2) {
+            perror("Failed to write a block");
+            return -1;
+        }
+        if (status == -3) {
+            close_connection(reactor, connection);
+        } else if (status < 0) {
+            park_connection(reactor, connection);
+        }
+    }
+    service_sessions(reactor, now_seconds());
+    return 0;
+}
+
+long reactor_run(Reactor *reactor, ReactorProgress progress, void *context) {
+    const MetaInfo *info = reactor->info;
+    double last_progress = 0;
+    double last_arrival = now_seconds();
+    size_t bytes_seen = reactor->bytes_received;
+
+    while (reactor->pieces_done < info->num_pieces && (reactor_active_peers(reactor) > 0 || reactor->listen_fd >= 0) &&
+           now_seconds() - last_arrival < DOWNLOAD_STALL_SECONDS) {
+        if (run_once(reactor) < 0) {
+            return -1;
+        }
+        double now = now_seconds();
+        if (reactor->bytes_received != bytes_seen) {
+            bytes_seen = reactor->bytes_received;
+            last_arrival = now;
+        }
+        if (progress != NULL && now - last_progress >= 0.25) {
+            last_progress = now;
+            if (!progress(reactor, context)) {
+                break;
+            }
+        }
+    }
+    if (progress != NULL) {
+        progress(reactor, context);
+    }
+    return info->num_pieces - reactor->pieces_done;
+}
+
+int reactor_seed(Reactor *reactor, ReactorProgress progress, void *context) {
+    double last_progress = 0;
+    while (reactor_active_peers(reactor) > 0 || reactor->listen_fd >= 0) {
+        if (run_once(reactor) < 0) {
+            return -1;
+        }
+        double now = now_seconds();
+        if (progress != NULL && now - last_progress >= 0.25) {
+            last_progress = now;
+            if (!progress(reactor, context)) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+void reactor_free(Reactor *reactor) {
+    for (size_t i = 0; i < reactor->num_connections; i++) {
+        close_connection(reactor, reactor->connections[i]);
+        free(reactor->connections[i]->bitfield);
+        free(reactor->connections[i]);
+    }
+    reactor->num_connections = 0;
+    for (size_t i = 0; reactor->pieces != NULL && i < reactor->info->num_pieces; i++) {
+        piece_hasher_free(&reactor->pieces[i].hasher);
+        free(reactor->pieces[i].buffer);
+        free(reactor->pieces[i].sources);
+        free(reactor->pieces[i].blocks);
+    }
+    free(reactor->pieces);
+    free(reactor->have);
+    picker_free(&reactor->picker);
+    reactor->pieces = NULL;
+    reactor->have = NULL;
+    if (reactor->epoll_fd >= 0) {
+        close(reactor->epoll_fd);
+    }
+    reactor->epoll_fd = -1;
+    if (reactor->listen_fd >= 0) {
+        close(reactor->listen_fd);
+    }
+    reactor->listen_fd = -1;
+}
@@ -0,0 +1,152 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "info.h"
+#include "peer.h"
+#include "picker.h"
+#include "piece_hasher.h"
+#include "storage.h"
+#include "tracker.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_PEER_CONNECTIONS 256
+#define PEER_TIMEOUT_SECONDS 30       // Longest wait for a handshake, a bitfield or an outstanding block
+#define PEER_IDLE_SECONDS 180         // A session with nothing outstanding must still hear something this often
+#define KEEPALIVE_SECONDS 90          // Our keep-alive to a session we have nothing else to say to
+#define SESSION_RETRY_SECONDS 2       // First backoff of a failed session, doubled on every further failure
+#define MAX_SESSION_FAILURES 6        // Failures in a row before a peer is given up for good
+#define DOWNLOAD_STALL_SECONDS 120    // reactor_run returns once nothing has arrived for this long
+#define MAX_UPLOAD_QUEUE 64           // REQUESTs of one peer waiting to be served, more are dropped
+#define LISTEN_PORT 6881              // The port announced to trackers
+#define DEFAULT_MAX_HALF_OPEN 8       // Accepted connections still owing us their handshake
+#define MAX_GIVEN_UP 256              // Peers given up on whose address is kept, so they aren't dialled again
+#define MAX_UNCHOKED 4                // Upload slots: interested peers we serve at once
+#define UNCHOKE_ROTATE_SECONDS 30     // How long a peer keeps its upload slot while others wait for one
+
+// Where a connection is in the wire protocol, each state waits for one thing
+typedef enum PeerState {
+    PEER_CONNECTING,      // Non-blocking connect in progress
+    PEER_HANDSHAKE,       // Waiting for the peer's handshake (ours is out, unless the peer connected to us)
+    PEER_BITFIELD,        // Waiting to learn what the peer has (BITFIELD or HAVE)
+    PEER_INTERESTED,      // Knows what the peer has, waiting to be unchoked
+    PEER_TRANSFERRING,    // Unchoked, requests and blocks flowing
+    PEER_PARKED,          // The session failed, reconnected at 'retry_at'
+    PEER_CLOSED           // Given up for good
+} PeerState;
+
+// A session with one peer. it lives across pieces: the handshake happens once, then the reactor hands
+// it piece after piece for as long as the peer is useful. a broken session is parked and reconnected
+// with backoff, keeping what it learned about the peer. a closed one is freed, making room for another
+typedef struct PeerConnection {
+    struct Reactor *reactor;
+    int fd;                       // -1 while parked or closed
+    bool incoming;                // The peer connected to us: never redialled
+    PeerState state;
+    Peer peer;
+    bool choked;                  // Until the peer sends UNCHOKE
+    bool interested;              // Whether we told the peer INTERESTED (and not NOT_INTERESTED since)
+    bool choking;                 // Whether we choke the peer, until it says it is interested
+    bool peer_interested;
+    double unchoked_at;           // When the peer last got an upload slot, 0 if never
+    double last_activity;         // Last time the peer sent something, or we started waiting for it to
+    double last_sent;
+    int failures;                 // Failed sessions in a row, reset by a received block
+    double retry_at;
+    unsigned char *bitfield;      // The pieces the peer has
+    bool counted;                 // Whether 'bitfield' is in the picker's availability counts
+    PeerWire wire;                // Bytes received and not parsed yet
+    char *output;                 // Bytes queued for the socket, sent from 'output_sent' on
+    size_t output_length;
+    size_t output_sent;
+    size_t output_capacity;
+    RequestQueue requests;
+    BlockRequest uploads[MAX_UPLOAD_QUEUE]; // Blocks the peer asked us for, served oldest first
+    int num_uploads;
+    uint32_t upload_sent;         // Bytes of the first upload's PIECE message (header, then data) sent so far
+    int bad_pieces;               // Pieces this peer sent blocks of that failed their hash
+    bool speaks_v2;               // Its handshake has HANDSHAKE_V2_FLAG, it should answer a HASH_REQUEST
+    long hash_piece;              // The failed v2 piece we asked this peer the block hashes of, -1 if none
+    double hash_asked_at;
+} PeerConnection;
+
+typedef enum PieceStatus {
+    PIECE_MISSING,
+    PIECE_ACTIVE,                 // Being assembled, its blocks may come from any number of peers
+    PIECE_DONE
+} PieceStatus;
+
+// Download state of one piece. an active piece has a buffer its blocks are assembled in (read straight
+// into it off the wire where possible), and is verified and written out once every block is in. a v2
+// piece that fails stays active while a peer tells us its block hashes, then only the bad blocks go missing again
+typedef struct PieceSlot {
+    PieceStatus status;
+    PieceHasher hasher;           // v1 pieces are hashed as the blocks become contiguous, v2 block by block
+    char *buffer;                 // The piece, while active
+    PeerConnection **sources;     // Per block, while active: who it is requested from, then who sent it
+    unsigned char *blocks;        // Per block: BLOCK_MISSING, BLOCK_REQUESTED or BLOCK_RECEIVED
+    uint32_t num_blocks;
+    uint32_t blocks_free;         // Neither requested nor received
+    uint32_t blocks_received;
+} PieceSlot;
+
+// A single-threaded, edge-triggered epoll loop downloading one torrent from many peers at once, and
+// serving the verified pieces to those that ask for them
+typedef struct Reactor {
+    const MetaInfo *info;
+    Storage *storage;
+    int epoll_fd;
+    int listen_fd;                // -1 unless reactor_listen was called
+    bool accept_pending;          // Out of descriptors with peers left in the backlog, accept again later
+    int max_half_open;
+    int max_connections;          // Open sockets, incoming and outgoing
+    int depth;                    // Requests in flight per connection
+    PeerConnection *connections[MAX_PEER_CONNECTIONS];
+    size_t num_connections;
+    Peer given_up[MAX_GIVEN_UP];  // Outgoing peers whose session was closed for good, the oldest overwritten once full
+    size_t num_given_up;
+    int num_open;                 // Sessions with a socket in the loop
+    int num_half_open;            // Accepted sessions still owing us their handshake
+    PieceSlot *pieces;
+    PiecePicker picker;
+    unsigned char *have;          // Verified pieces (bitfield.h layout)
+    size_t pieces_done;
+    size_t bytes_received;
+    size_t bytes_sent;            // Block data uploaded
+    int unchoked;                 // Sessions we don't choke, at most MAX_UNCHOKED
+    size_t blocks_free;           // Blocks of unfinished pieces nobody has been asked for, 0 is the endgame
+} Reactor;
+
+// called a few times a second while the loop runs, returns false to stop it
+typedef bool (*ReactorProgress)(const Reactor *reactor, void *context);
+
+// prepares a download of 'info' into 'storage'. returns 0 on success and -1 on failure
+int reactor_init(Reactor *reactor, const MetaInfo *info, Storage *storage);
+
+// starts a non-blocking connection to 'peer', unless there is a session with it already or it was given up on.
+// with 'max_connections' sockets open the session is parked instead, and dialled once one closes. returns 0 on
+// success and -1 if it could not even begin
+int reactor_add_peer(Reactor *reactor, const Peer *peer);
+
+// accepts peers on 'port' (any address) from now on, into the same sessions as the ones we dial: at most
+// 'max_half_open' of them waiting for their handshake, and no more once 'max_connections' sockets are open.
+// returns 0 on success and -1 if the port could not be listened on (errno tells)
+int reactor_listen(Reactor *reactor, int port, int max_half_open, int max_connections);
+
+// number of sessions not given up yet (parked ones included)
+size_t reactor_active_peers(const Reactor *reactor);
+
+// runs the loop until every piece is verified, no session is left (and none can come in), the download stalled
+// or 'progress' (may be NULL) stops it. returns the number of pieces still missing, or -1 if epoll or the storage failed
+long reactor_run(Reactor *reactor, ReactorProgress progress, void *context);
+
+// once the download is complete, keeps the loop running to serve the pieces: to the sessions left and to
+// peers that connect, until 'progress' stops it or no session is left and none can come in. returns 0, or
+// -1 if epoll or the storage failed
+int reactor_seed(Reactor *reactor, ReactorProgress progress, void *context);
+
+// closes every connection and frees the download state (the storage stays open)
+void reactor_free(Reactor *reactor);
+
+#endif
@@ -0,0 +1,291 @@
+#include "recheck.h"
+#include "bitfield.h"
+#include "peer.h"
+#include "storage.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// Pieces a worker claims at once, and hands to verify_pieces as one batch
+#define RECHECK_CHUNK 16
+
+// A worker owns the pieces [next, end). it takes chunks from the front, thieves take the back half
+typedef struct RecheckWorker {
+    Recheck *recheck;
+    pthread_t thread;
+    bool started;
+    pthread_mutex_t lock;
+    size_t next;
+    size_t end;
+} RecheckWorker;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Claims the next chunk of 'self', stealing half of the largest other range once its own is empty.
+// returns false when there is nothing left anywhere
+static bool claim_chunk(RecheckWorker *self, size_t *first, size_t *last) {
+    Recheck *recheck = self->recheck;
+    for (;;) {
+        pthread_mutex_lock(&self->lock);
+        if (self->next < self->end) {
+            *first = self->next;
+            self->next = self->end - self->next > RECHECK_CHUNK ? self->next + RECHECK_CHUNK : self->end;
+            *last = self->next;
+            pthread_mutex_unlock(&self->lock);
+            return true;
+        }
+        pthread_mutex_unlock(&self->lock);
+
+        RecheckWorker *victim = NULL;
+        size_t most = 0;
+        for (int i = 0; i < recheck->threads; i++) {
+            RecheckWorker *worker = &recheck->workers[i];
+            if (worker == self) continue;
+            pthread_mutex_lock(&worker->lock);
+            size_t remaining = worker->end - worker->next;
+            pthread_mutex_unlock(&worker->lock);
+            if (remaining > most) {
+                most = remaining;
+                victim = worker;
+            }
+        }
+        if (victim == NULL) {
+            return false;
+        }
+
+        pthread_mutex_lock(&victim->lock);
+        size_t remaining = victim->end - victim->next;
+        size_t middle = victim->next + remaining / 2;
+        size_t end = victim->end;
+        victim->end = middle;
+        pthread_mutex_unlock(&victim->lock);
+
+        pthread_mutex_lock(&self->lock);
+        self->next = middle;
+        self->end = end;
+        pthread_mutex_unlock(&self->lock);
+    }
+}
+
+// Tells the kernel what to do with the mapped bytes of pieces [first, last)
+static void advise_pieces(const Recheck *recheck, size_t first, size_t last, int advice) {
+    const MetaInfo *info = recheck->info;
+    size_t position = first * info->piece_length;
+    size_t end = last * info->piece_length < info->length ? last * info->piece_length : info->length;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    for (size_t i = position < end ? info_file_at(info, position) : info->num_files; position < end; i++) {
+        const TorrentFile *file = &info->files[i];
+        const MappedFile *mapped = &recheck->files[i];
+        if (file->length == 0) {
+            continue;
+        }
+        size_t file_offset = position - file->offset;
+        size_t run = file->length - file_offset < end - position ? file->length - file_offset : end - position;
+        if (mapped->data != NULL && file_offset < mapped->size) {
+            size_t stop = file_offset + run < mapped->size ? file_offset + run : mapped->size;
+            size_t aligned = file_offset / page * page;
+            madvise(mapped->data + aligned, stop - aligned, advice);
+        }
+        position += run;
+    }
+}
+
+// Points 'check' at piece 'index' inside the mappings. a piece that spans files or padding is copied
+// into '*copy' (freed by the caller). returns -1 if part of the piece is missing on disk
+static int gather_piece(const Recheck *recheck, size_t index, PieceCheck *check, char **copy) {
+    const MetaInfo *info = recheck->info;
+    size_t position = index * info->piece_length;
+    size_t length = info_piece_size(info, index);
+    *check = (PieceCheck){ .piece_index = index, .length = length };
+    *copy = NULL;
+
+    for (size_t i = info_file_at(info, position), done = 0; done < length; i++) {
+        const TorrentFile *file = &info->files[i];
+        const MappedFile *mapped = &recheck->files[i];
+        if (file->length == 0) {
+            continue;
+        }
+        size_t file_offset = position + done - file->offset;
+        size_t run = file->length - file_offset < length - done ? file->length - file_offset : length - done;
+        if (!file->padding && (mapped->data == NULL || file_offset + run > mapped->size)) {
+            free(*copy);
+            *copy = NULL;
+            return -1;
+        }
+        if (run == length && !file->padding) {
+            check->data = mapped->data + file_offset; // The common case: no copy
+            return 0;
+        }
+        if (*copy == NULL && (*copy = calloc(1, length)) == NULL) {
+            return -1;
+        }
+        if (!file->padding) {
+            memcpy(*copy + done, mapped->data + file_offset, run);
+        }
+        done += run;
+    }
+    check->data = *copy;
+    return 0;
+}
+
+static void check_chunk(Recheck *recheck, size_t first, size_t last) {
+    PieceCheck batch[RECHECK_CHUNK];
+    char *copies[RECHECK_CHUNK];
+    size_t count = 0;
+    size_t bytes = 0;
+
+    for (size_t index = first; index < last; index++) {
+        bytes += info_piece_size(recheck->info, index);
+        if (gather_piece(recheck, index, &batch[count], &copies[count]) == 0) {
+            count++;
+        }
+    }
+
+    size_t valid = verify_pieces(recheck->info, batch, count);
+    for (size_t i = 0; i < count; i++) {
+        if (batch[i].valid) {
+            bitfield_set_atomic(recheck->bitfield, batch[i].piece_index);
+        }
+        free(copies[i]);
+    }
+    atomic_fetch_add_explicit(&recheck->pieces_valid, valid, memory_order_relaxed);
+    atomic_fetch_add_explicit(&recheck->bytes_checked, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&recheck->pieces_checked, last - first, memory_order_relaxed);
+}
+
+static void *recheck_worker(void *arg) {
+    RecheckWorker *self = arg;
+    size_t first, last;
+    while (claim_chunk(self, &first, &last)) {
+        // Start reading the following chunk while this one is hashed
+        pthread_mutex_lock(&self->lock);
+        size_t ahead = self->next;
+        size_t ahead_end = self->end - self->next > RECHECK_CHUNK ? self->next + RECHECK_CHUNK : self->end;
+        pthread_mutex_unlock(&self->lock);
+        if (ahead < ahead_end) {
+            advise_pieces(self->recheck, ahead, ahead_end, MADV_WILLNEED);
+        }
+        check_chunk(self->recheck, first, last);
+    }
+    return NULL;
+}
+
+int recheck_start(Recheck *recheck, const MetaInfo *info, const char *target, int threads) {
+    memset(recheck, 0, sizeof(*recheck));
+    atomic_init(&recheck->pieces_checked, 0);
+    atomic_init(&recheck->pieces_valid, 0);
+    atomic_init(&recheck->bytes_checked, 0);
+    recheck->info = info;
+    recheck->files = calloc(info->num_files ? info->num_files : 1, sizeof(*recheck->files));
+    recheck->bitfield = calloc(bitfield_bytes(info->num_pieces) ? bitfield_bytes(info->num_pieces) : 1, 1);
+    if (recheck->files == NULL || recheck->bitfield == NULL) {
+        info_set_error("Memory allocation for the recheck failed");
+        recheck_free(recheck);
+        return -1;
+    }
+
+    size_t mapped = 0;
+    for (size_t i = 0; i < info->num_files; i++) {
+        char path[PATH_MAX];
+        if (info->files[i].padding || info->files[i].length == 0 ||
+            storage_file_path(info, target, i, path, sizeof(path)) < 0) {
+            continue;
+        }
+        if (map_file(path, &recheck->files[i]) == 0) {
+            mapped++;
+        }
+    }
+    if (mapped == 0 && info->length > 0) {
+        info_set_error("None of the torrent's files exist under %s", target);
+        recheck_free(recheck);
+        return -1;
+    }
+
+    if (threads <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (int)cores : 1;
+    }
+    if ((size_t)threads > info->num_pieces) {
+        threads = info->num_pieces ? (int)info->num_pieces : 1;
+    }
+    recheck->workers = calloc(threads, sizeof(*recheck->workers));
+    if (recheck->workers == NULL) {
+        info_set_error("Memory allocation for the recheck failed");
+        recheck_free(recheck);
+        return -1;
+    }
+    recheck->threads = threads;
+    for (int i = 0; i < threads; i++) {
+        RecheckWorker *worker = &recheck->workers[i];
+        worker->recheck = recheck;
+        worker->next = info->num_pieces * i / threads;
+        worker->end = info->num_pieces * (i + 1) / threads;
+        pthread_mutex_init(&worker->lock, NULL);
+    }
+
+    recheck->started = now_seconds();
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        // A worker that could not start keeps its range, the others steal all of it
+        recheck->workers[i].started = pthread_create(&recheck->workers[i].thread, NULL, recheck_worker, &recheck->workers[i]) == 0;
+        started += recheck->workers[i].started;
+    }
+    if (started == 0) {
+        recheck_worker(&recheck->workers[0]); // No threads available, check on the caller instead
+    }
+    return 0;
+}
+
+void recheck_wait(Recheck *recheck) {
+    if (recheck->workers == NULL) {
+        return;
+    }
+    for (int i = 0; i < recheck->threads; i++) {
+        if (recheck->workers[i].started) {
+            pthread_join(recheck->workers[i].thread, NULL);
+        }
+    }
+    recheck->seconds = now_seconds() - recheck->started;
+    for (int i = 0; i < recheck->threads; i++) {
+        pthread_mutex_destroy(&recheck->workers[i].lock);
+    }
+    free(recheck->workers);
+    recheck->workers = NULL;
+}
+
+int recheck_files(Recheck *recheck, const MetaInfo *info, const char *target, int threads) {
+    if (recheck_start(recheck, info, target, threads) < 0) {
+        return -1;
+    }
+    recheck_wait(recheck);
+    return 0;
+}
+
+double recheck_bytes_per_second(const Recheck *recheck) {
+    size_t bytes = atomic_load_explicit(&recheck->bytes_checked, memory_order_relaxed);
+    return recheck->seconds > 0 ? bytes / recheck->seconds : 0;
+}
+
+void recheck_free(Recheck *recheck) {
+    recheck_wait(recheck);
+    if (recheck->files != NULL) {
+        for (size_t i = 0; i < recheck->info->num_files; i++) {
+            unmap_file(&recheck->files[i]);
+        }
+    }
+    free(recheck->files);
+    free(recheck->bitfield);
+    recheck->files = NULL;
+    recheck->bitfield = NULL;
+}
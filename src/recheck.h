@@ -0,0 +1,43 @@
+#ifndef RECHECK_H
+#define RECHECK_H
+
+#include "info.h"
+#include "mapped_file.h"
+#include <stdatomic.h>
+#include <stddef.h>
+
+struct RecheckWorker;
+
+// Verification of data already on disk against the piece table. the files are memory-mapped and the
+// pieces split across a pool of workers that steal from each other once their own range runs out
+typedef struct Recheck {
+    const MetaInfo *info;
+    MappedFile *files;           // One per torrent file, zeroed if it is missing, empty or padding
+    unsigned char *bitfield;     // Bit set for every piece that verified (bitfield.h layout)
+    atomic_size_t pieces_checked;
+    atomic_size_t pieces_valid;
+    atomic_size_t bytes_checked;
+    int threads;
+    double started;
+    double seconds;              // Wall time, set by recheck_wait
+    struct RecheckWorker *workers;
+} Recheck;
+
+// maps the files of 'info' under 'target' (as for storage_open) and starts checking on 'threads'
+// workers (0 = one per online core) in the background. missing or short files only fail their pieces.
+// returns 0 on success and -1 on failure (info_error() tells why)
+int recheck_start(Recheck *recheck, const MetaInfo *info, const char *target, int threads);
+
+// waits for every worker; the bitfield and counters are final afterwards
+void recheck_wait(Recheck *recheck);
+
+// recheck_start + recheck_wait
+int recheck_files(Recheck *recheck, const MetaInfo *info, const char *target, int threads);
+
+// bytes verified per second over the whole recheck
+double recheck_bytes_per_second(const Recheck *recheck);
+
+// unmaps the files and frees the bitfield
+void recheck_free(Recheck *recheck);
+
+#endif
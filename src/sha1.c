@@ -1,33 +1,155 @@
 #include "sha1.h"
 
-int sha1_hash(const unsigned char *data, size_t data_len, unsigned char *hash) {
-    // Declare a pointer for the message digest context
-    EVP_MD_CTX *mdctx;
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 
-    // Allocate and initialize a new message digest context
-    if ((mdctx = EVP_MD_CTX_new()) == NULL) {
-        return 0;
+// Digest contexts are costly to allocate, so each thread keeps a few reset ones around for reuse
+#define DIGEST_CONTEXT_POOL 8
+
+typedef struct ContextPool {
+    EVP_MD_CTX *contexts[DIGEST_CONTEXT_POOL];
+    int count;
+} ContextPool;
+
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void free_pool(void *arg) {
+    ContextPool *pool = arg;
+    for (int i = 0; i < pool->count; i++) {
+        EVP_MD_CTX_free(pool->contexts[i]);
     }
+    free(pool);
+}
+
+static void create_pool_key(void) {
+    pthread_key_create(&pool_key, free_pool);
+}
+
+static ContextPool *thread_pool(void) {
+    pthread_once(&pool_once, create_pool_key);
+    ContextPool *pool = pthread_getspecific(pool_key);
+    if (pool == NULL && (pool = calloc(1, sizeof(*pool))) != NULL && pthread_setspecific(pool_key, pool) != 0) {
+        free(pool);
+        pool = NULL;
+    }
+    return pool;
+}
 
-    // Initialize the digest context to use the SHA-1 algorithm
-    if (1 != EVP_DigestInit_ex(mdctx, EVP_sha1(), NULL)) {
+// Take a context from this thread's pool and start a digest in it, NULL on failure
+static EVP_MD_CTX *acquire_context(const EVP_MD *md) {
+    ContextPool *pool = thread_pool();
+    EVP_MD_CTX *mdctx = pool != NULL && pool->count > 0 ? pool->contexts[--pool->count] : EVP_MD_CTX_new();
+    if (mdctx != NULL && 1 != EVP_DigestInit_ex(mdctx, md, NULL)) {
         EVP_MD_CTX_free(mdctx);
-        return 0;
+        return NULL;
     }
+    return mdctx;
+}
 
-    // Update the digest context with the data to be hashed
-    if (1 != EVP_DigestUpdate(mdctx, data, data_len)) {
+// Give a context back to this thread's pool
+static void release_context(EVP_MD_CTX *mdctx) {
+    if (mdctx == NULL) {
+        return;
+    }
+    ContextPool *pool = thread_pool();
+    if (pool != NULL && pool->count < DIGEST_CONTEXT_POOL && 1 == EVP_MD_CTX_reset(mdctx)) {
+        pool->contexts[pool->count++] = mdctx;
+    } else {
         EVP_MD_CTX_free(mdctx);
+    }
+}
+
+// One-shot digest through a pooled context
+static int digest(const EVP_MD *md, const unsigned char *data, size_t data_len, unsigned char *hash) {
+    EVP_MD_CTX *mdctx = acquire_context(md);
+    int ok = mdctx != NULL && 1 == EVP_DigestUpdate(mdctx, data, data_len) && 1 == EVP_DigestFinal_ex(mdctx, hash, NULL);
+    release_context(mdctx);
+    return ok;
+}
+
+int sha1_hash(const unsigned char *data, size_t data_len, unsigned char *hash) {
+    return digest(EVP_sha1(), data, data_len, hash);
+}
+
+int sha1_init(Sha1Context *context) {
+    context->mdctx = acquire_context(EVP_sha1());
+    return context->mdctx != NULL;
+}
+
+int sha1_update(Sha1Context *context, const void *data, size_t data_len) {
+    return 1 == EVP_DigestUpdate(context->mdctx, data, data_len);
+}
+
+int sha1_final(Sha1Context *context, unsigned char *hash) {
+    int ok = 1 == EVP_DigestFinal_ex(context->mdctx, hash, NULL);
+    sha1_discard(context);
+    return ok;
+}
+
+void sha1_discard(Sha1Context *context) {
+    release_context(context->mdctx);
+    context->mdctx = NULL;
+}
+
+int sha256_hash(const unsigned char *data, size_t data_len, unsigned char *hash) {
+    return digest(EVP_sha256(), data, data_len, hash);
+}
+
+size_t merkle_width(size_t count) {
+    size_t width = 1;
+    while (width < count) {
+        width <<= 1;
+    }
+    return width;
+}
+
+int merkle_root(const unsigned char *leaves, size_t count, size_t width, const unsigned char *pad, unsigned char *root) {
+    if (count > width || (width & (width - 1)) != 0) {
         return 0;
     }
+    if (width == 1) {
+        memcpy(root, count ? leaves : pad, SHA256_DIGEST_LENGTH);
+        return 1;
+    }
 
-    // Finalize the digest operation and retrieve the hash
-    if (1 != EVP_DigestFinal_ex(mdctx, hash, NULL)) {
-        EVP_MD_CTX_free(mdctx);
+    // Each layer is built in place over the previous one, only the leaves actually present are stored
+    size_t stored = count ? count : 1;
+    unsigned char *layer = malloc(stored * SHA256_DIGEST_LENGTH);
+    if (layer == NULL) {
         return 0;
     }
+    if (count) {
+        memcpy(layer, leaves, count * SHA256_DIGEST_LENGTH);
+    } else {
+        memcpy(layer, pad, SHA256_DIGEST_LENGTH);
+    }
+    unsigned char layer_pad[SHA256_DIGEST_LENGTH];
+    memcpy(layer_pad, pad, SHA256_DIGEST_LENGTH);
 
-    EVP_MD_CTX_free(mdctx);
+    int ok = 1;
+    for (; width > 1 && ok; width >>= 1) {
+        unsigned char pair[2 * SHA256_DIGEST_LENGTH];
+        size_t parents = (stored + 1) / 2;
+        for (size_t i = 0; i < parents && ok; i++) {
+            memcpy(pair, layer + 2 * i * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH);
+            memcpy(pair + SHA256_DIGEST_LENGTH, 2 * i + 1 < stored ? layer + (2 * i + 1) * SHA256_DIGEST_LENGTH : layer_pad, SHA256_DIGEST_LENGTH);
+            ok = sha256_hash(pair, sizeof(pair), layer + i * SHA256_DIGEST_LENGTH);
+        }
+        // The padding of the next layer up is the parent of two padding nodes
+        memcpy(pair, layer_pad, SHA256_DIGEST_LENGTH);
+        memcpy(pair + SHA256_DIGEST_LENGTH, layer_pad, SHA256_DIGEST_LENGTH);
+        ok = ok && sha256_hash(pair, sizeof(pair), layer_pad);
+        stored = parents;
+    }
+
+    memcpy(root, layer, SHA256_DIGEST_LENGTH);
+    free(layer);
+    return ok;
+}
 
-    return 1;
+int merkle_pad_hash(size_t width, unsigned char *hash) {
+    static const unsigned char zero[SHA256_DIGEST_LENGTH];
+    return merkle_root(NULL, 0, width, zero, hash);
 }
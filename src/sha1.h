@@ -4,8 +4,43 @@
 #include <openssl/evp.h>
 
 #define SHA1_DIGEST_LENGTH 20
+#define SHA256_DIGEST_LENGTH 32
+
+// Leaf size of the BitTorrent v2 (BEP 52) Merkle trees
+#define MERKLE_BLOCK_SIZE 16384
+
+// Incremental SHA-1 state, for data that arrives in pieces. the digest context is taken from a
+// per-thread pool and given back to it by sha1_final/sha1_discard
+typedef struct Sha1Context {
+    EVP_MD_CTX *mdctx;
+} Sha1Context;
 
 // calculates sha1-hash for a char string. puts the hash itself in the 'hash' string
 int sha1_hash(const unsigned char *data, size_t data_len, unsigned char *hash);
 
+// starts an incremental hash, returns 1 on success and 0 on failure
+int sha1_init(Sha1Context *context);
+
+// adds the next 'data_len' bytes to the hash
+int sha1_update(Sha1Context *context, const void *data, size_t data_len);
+
+// finishes the hash into 'hash' and releases the context
+int sha1_final(Sha1Context *context, unsigned char *hash);
+
+// releases a context without producing a hash (on error paths)
+void sha1_discard(Sha1Context *context);
+
+// calculates the sha256-hash of 'data' into 'hash' (32 bytes), returns 1 on success and 0 on failure
+int sha256_hash(const unsigned char *data, size_t data_len, unsigned char *hash);
+
+// computes the root of a Merkle tree over 'count' 32-byte leaves, padded with copies of 'pad'
+// up to 'width' leaves (a power of two, >= count). returns 1 on success and 0 on failure
+int merkle_root(const unsigned char *leaves, size_t count, size_t width, const unsigned char *pad, unsigned char *root);
+
+// root of a subtree of 'width' all-zero leaves, what a piece layer is padded with past the end of a file
+int merkle_pad_hash(size_t width, unsigned char *hash);
+
+// smallest power of two >= 'count' (1 for 0)
+size_t merkle_width(size_t count);
+
 #endif /* SHA1_H */
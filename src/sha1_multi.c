@@ -0,0 +1,395 @@
+#include "sha1_multi.h"
+#include "sha1.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHA1_HAVE_X86 1
+#endif
+
+#define SHA1_BLOCK_SIZE 64
+#define SHA1_MAX_LANES 16
+
+// Start-up calibration: 16 messages of 16 KiB per round, best of 3 rounds, a few ms for all engines
+#define CALIBRATION_LENGTH (16 * 1024)
+#define CALIBRATION_ROUNDS 3
+
+static const uint32_t sha1_initial_state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+static uint32_t load_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void store_be32(unsigned char *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+// Runs 'num_blocks' 64-byte blocks of each lane's message through the lanes' states.
+// state[i][lane] is word i of that lane's hash
+typedef void (*LaneKernel)(uint32_t state[5][SHA1_MAX_LANES], const unsigned char *const *blocks, size_t num_blocks);
+
+// Hashes one message's whole blocks, state[i] is word i of its hash
+typedef void (*BlockKernel)(uint32_t state[5], const unsigned char *blocks, size_t num_blocks);
+
+#ifdef SHA1_HAVE_X86
+// The SHA-1 compression function on 'LANES' messages at once, written with GCC vector extensions so
+// the same code becomes SSE2, AVX2 or AVX-512 depending on TARGET. lane l holds message l's words,
+// so the message schedule has to be transposed in as blocks are loaded
+#define SHA1_LANE_KERNEL(NAME, LANES, TARGET)                                                            \
+    typedef uint32_t NAME##_vector __attribute__((vector_size(4 * (LANES))));                           \
+    __attribute__((target(TARGET)))                                                                     \
+    static void NAME(uint32_t state[5][SHA1_MAX_LANES], const unsigned char *const *blocks, size_t num_blocks) { \
+        NAME##_vector h[5];                                                                             \
+        for (int i = 0; i < 5; i++) {                                                                   \
+            memcpy(&h[i], state[i], sizeof(h[i]));                                                      \
+        }                                                                                               \
+        for (size_t n = 0; n < num_blocks; n++) {                                                       \
+            uint32_t words[16][LANES];                                                                  \
+            for (int lane = 0; lane < (LANES); lane++) {                                                \
+                for (int t = 0; t < 16; t++) {                                                          \
+                    words[t][lane] = load_be32(blocks[lane] + n * SHA1_BLOCK_SIZE + 4 * t);             \
+                }                                                                                       \
+            }                                                                                           \
+            NAME##_vector w[16];                                                                        \
+            memcpy(w, words, sizeof(w));                                                                \
+            NAME##_vector a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];                             \
+            _Pragma("GCC unroll 80")                                                                    \
+            for (int t = 0; t < 80; t++) {                                                              \
+                if (t >= 16) {                                                                          \
+                    NAME##_vector x = w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15]; \
+                    w[t & 15] = (x << 1) | (x >> 31);                                                   \
+                }                                                                                       \
+                NAME##_vector f;                                                                        \
+                uint32_t k;                                                                             \
+                if (t < 20) {                                                                           \
+                    f = d ^ (b & (c ^ d));                                                              \
+                    k = 0x5A827999;                                                                     \
+                } else if (t < 40) {                                                                    \
+                    f = b ^ c ^ d;                                                                      \
+                    k = 0x6ED9EBA1;                                                                     \
+                } else if (t < 60) {                                                                    \
+                    f = (b & c) | (d & (b | c));                                                        \
+                    k = 0x8F1BBCDC;                                                                     \
+                } else {                                                                                \
+                    f = b ^ c ^ d;                                                                      \
+                    k = 0xCA62C1D6;                                                                     \
+                }                                                                                       \
+                NAME##_vector temp = ((a << 5) | (a >> 27)) + f + e + k + w[t & 15];                    \
+                e = d;                                                                                  \
+                d = c;                                                                                  \
+                c = (b << 30) | (b >> 2);                                                               \
+                b = a;                                                                                  \
+                a = temp;                                                                               \
+            }                                                                                           \
+            h[0] += a;                                                                                  \
+            h[1] += b;                                                                                  \
+            h[2] += c;                                                                                  \
+            h[3] += d;                                                                                  \
+            h[4] += e;                                                                                  \
+        }                                                                                               \
+        for (int i = 0; i < 5; i++) {                                                                   \
+            memcpy(state[i], &h[i], sizeof(h[i]));                                                      \
+        }                                                                                               \
+    }
+
+SHA1_LANE_KERNEL(sha1_lanes_sse2, 4, "sse2")
+SHA1_LANE_KERNEL(sha1_lanes_avx2, 8, "avx2")
+SHA1_LANE_KERNEL(sha1_lanes_avx512, 16, "avx512f")
+
+// Four rounds of the SHA-NI schedule (rounds 4g to 4g+3). the first four groups load the block, the
+// message words are then produced four at a time by sha1msg1/sha1msg2 as in Intel's reference code
+#define SHANI_GROUP(g, ein, eout, cur, next, after, last)                                               \
+    if ((g) < 4) cur = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * (g))), mask);     \
+    ein = (g) == 0 ? _mm_add_epi32(ein, cur) : _mm_sha1nexte_epu32(ein, cur);                           \
+    eout = abcd;                                                                                        \
+    if ((g) >= 3 && (g) <= 18) next = _mm_sha1msg2_epu32(next, cur);                                    \
+    abcd = _mm_sha1rnds4_epu32(abcd, ein, (g) / 5);                                                     \
+    if ((g) >= 1 && (g) <= 16) last = _mm_sha1msg1_epu32(last, cur);                                    \
+    if ((g) >= 2 && (g) <= 17) after = _mm_xor_si128(after, cur);
+
+// One message at a time with the SHA extensions
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_shani(uint32_t state[5], const unsigned char *data, size_t num_blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+    __m128i e1, m0, m1, m2, m3;
+
+    for (; num_blocks > 0; num_blocks--, data += SHA1_BLOCK_SIZE) {
+        __m128i abcd_saved = abcd;
+        __m128i e0_saved = e0;
+
+        SHANI_GROUP(0, e0, e1, m0, m1, m2, m3)
+        SHANI_GROUP(1, e1, e0, m1, m2, m3, m0)
+        SHANI_GROUP(2, e0, e1, m2, m3, m0, m1)
+        SHANI_GROUP(3, e1, e0, m3, m0, m1, m2)
+        SHANI_GROUP(4, e0, e1, m0, m1, m2, m3)
+        SHANI_GROUP(5, e1, e0, m1, m2, m3, m0)
+        SHANI_GROUP(6, e0, e1, m2, m3, m0, m1)
+        SHANI_GROUP(7, e1, e0, m3, m0, m1, m2)
+        SHANI_GROUP(8, e0, e1, m0, m1, m2, m3)
+        SHANI_GROUP(9, e1, e0, m1, m2, m3, m0)
+        SHANI_GROUP(10, e0, e1, m2, m3, m0, m1)
+        SHANI_GROUP(11, e1, e0, m3, m0, m1, m2)
+        SHANI_GROUP(12, e0, e1, m0, m1, m2, m3)
+        SHANI_GROUP(13, e1, e0, m1, m2, m3, m0)
+        SHANI_GROUP(14, e0, e1, m2, m3, m0, m1)
+        SHANI_GROUP(15, e1, e0, m3, m0, m1, m2)
+        SHANI_GROUP(16, e0, e1, m0, m1, m2, m3)
+        SHANI_GROUP(17, e1, e0, m1, m2, m3, m0)
+        SHANI_GROUP(18, e0, e1, m2, m3, m0, m1)
+        SHANI_GROUP(19, e1, e0, m3, m0, m1, m2)
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_saved);
+        abcd = _mm_add_epi32(abcd, abcd_saved);
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+#endif
+
+typedef struct EngineInfo {
+    const char *name;
+    int lanes;               // 0 for engines that hash one message at a time
+    LaneKernel lane_kernel;
+    BlockKernel block_kernel;
+} EngineInfo;
+
+static const EngineInfo engines[SHA1_ENGINE_COUNT] = {
+    [SHA1_ENGINE_OPENSSL] = { "openssl", 0, NULL, NULL },
+#ifdef SHA1_HAVE_X86
+    [SHA1_ENGINE_SHANI] = { "sha-ni", 0, NULL, sha1_blocks_shani },
+    [SHA1_ENGINE_SSE2_X4] = { "sse2-x4", 4, sha1_lanes_sse2, NULL },
+    [SHA1_ENGINE_AVX2_X8] = { "avx2-x8", 8, sha1_lanes_avx2, NULL },
+    [SHA1_ENGINE_AVX512_X16] = { "avx512-x16", 16, sha1_lanes_avx512, NULL },
+#else
+    [SHA1_ENGINE_SHANI] = { "sha-ni" },
+    [SHA1_ENGINE_SSE2_X4] = { "sse2-x4" },
+    [SHA1_ENGINE_AVX2_X8] = { "avx2-x8" },
+    [SHA1_ENGINE_AVX512_X16] = { "avx512-x16" },
+#endif
+};
+
+static bool engine_usable[SHA1_ENGINE_COUNT];
+static Sha1Engine active_engine = SHA1_ENGINE_OPENSSL;
+static pthread_once_t engines_once = PTHREAD_ONCE_INIT;
+
+// Builds the padded tail of a 'length'-byte message whose last 'tail' bytes are at 'data',
+// returns the number of blocks written to 'out' (1 or 2)
+static size_t pad_tail(const unsigned char *data, size_t tail, size_t length, unsigned char out[2 * SHA1_BLOCK_SIZE]) {
+    size_t blocks = tail + 9 <= SHA1_BLOCK_SIZE ? 1 : 2;
+    memset(out, 0, blocks * SHA1_BLOCK_SIZE);
+    if (tail > 0) {
+        memcpy(out, data, tail);
+    }
+    out[tail] = 0x80;
+    uint64_t bits = (uint64_t)length * 8;
+    store_be32(out + blocks * SHA1_BLOCK_SIZE - 8, bits >> 32);
+    store_be32(out + blocks * SHA1_BLOCK_SIZE - 4, (uint32_t)bits);
+    return blocks;
+}
+
+static int hash_one(Sha1Engine engine, const unsigned char *data, size_t length, unsigned char *hash) {
+    BlockKernel kernel = engines[engine].block_kernel;
+    if (kernel == NULL && engines[engine].lanes > 0 && engine_usable[SHA1_ENGINE_SHANI]) {
+        // Messages left over from a lane group go through SHA-NI when the CPU has it
+        kernel = engines[SHA1_ENGINE_SHANI].block_kernel;
+    }
+    if (kernel == NULL) {
+        return sha1_hash(data, length, hash);
+    }
+
+    uint32_t state[5];
+    memcpy(state, sha1_initial_state, sizeof(state));
+    size_t whole = length / SHA1_BLOCK_SIZE;
+    kernel(state, data, whole);
+    unsigned char tail[2 * SHA1_BLOCK_SIZE];
+    size_t blocks = pad_tail(data + whole * SHA1_BLOCK_SIZE, length % SHA1_BLOCK_SIZE, length, tail);
+    kernel(state, tail, blocks);
+    for (int i = 0; i < 5; i++) {
+        store_be32(hash + 4 * i, state[i]);
+    }
+    return 1;
+}
+
+// Hashes exactly engines[engine].lanes messages side by side
+static void hash_lanes(Sha1Engine engine, const unsigned char *const *messages, size_t length, unsigned char *hashes) {
+    const EngineInfo *e = &engines[engine];
+    uint32_t state[5][SHA1_MAX_LANES];
+    for (int i = 0; i < 5; i++) {
+        for (int lane = 0; lane < e->lanes; lane++) {
+            state[i][lane] = sha1_initial_state[i];
+        }
+    }
+
+    e->lane_kernel(state, messages, length / SHA1_BLOCK_SIZE);
+
+    unsigned char tails[SHA1_MAX_LANES][2 * SHA1_BLOCK_SIZE];
+    const unsigned char *tail_blocks[SHA1_MAX_LANES];
+    size_t whole = length / SHA1_BLOCK_SIZE * SHA1_BLOCK_SIZE;
+    size_t blocks = 0;
+    for (int lane = 0; lane < e->lanes; lane++) {
+        blocks = pad_tail(messages[lane] + whole, length - whole, length, tails[lane]);
+        tail_blocks[lane] = tails[lane];
+    }
+    e->lane_kernel(state, tail_blocks, blocks);
+
+    for (int lane = 0; lane < e->lanes; lane++) {
+        for (int i = 0; i < 5; i++) {
+            store_be32(hashes + lane * SHA1_DIGEST_LENGTH + 4 * i, state[i][lane]);
+        }
+    }
+}
+
+static int hash_many(Sha1Engine engine, const unsigned char *const *messages, size_t count, size_t length, unsigned char *hashes) {
+    size_t done = 0;
+    int lanes = engines[engine].lanes;
+    if (lanes > 0) {
+        for (; count - done >= (size_t)lanes; done += lanes) {
+            hash_lanes(engine, messages + done, length, hashes + done * SHA1_DIGEST_LENGTH);
+        }
+    }
+    for (; done < count; done++) {
+        if (!hash_one(engine, messages[done], length, hashes + done * SHA1_DIGEST_LENGTH)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Compares an engine with OpenSSL on lengths around every padding boundary, in full lane groups
+static bool self_test(Sha1Engine engine) {
+    static const size_t lengths[] = { 0, 1, 55, 56, 63, 64, 65, 119, 120, 1000, 16384 + 3 };
+    size_t max_length = 16384 + 3;
+    unsigned char *data = malloc(SHA1_MAX_LANES * max_length);
+    if (data == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < SHA1_MAX_LANES * max_length; i++) {
+        data[i] = (unsigned char)(i * 2654435761u >> 13);
+    }
+
+    bool ok = true;
+    for (size_t l = 0; ok && l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        const unsigned char *messages[SHA1_MAX_LANES];
+        for (int i = 0; i < SHA1_MAX_LANES; i++) {
+            messages[i] = data + i * max_length;
+        }
+        unsigned char hashes[SHA1_MAX_LANES * SHA1_DIGEST_LENGTH];
+        unsigned char expected[SHA1_DIGEST_LENGTH];
+        ok = hash_many(engine, messages, SHA1_MAX_LANES, lengths[l], hashes);
+        for (int i = 0; ok && i < SHA1_MAX_LANES; i++) {
+            ok = sha1_hash(messages[i], lengths[l], expected) &&
+                 memcmp(expected, hashes + i * SHA1_DIGEST_LENGTH, SHA1_DIGEST_LENGTH) == 0;
+        }
+    }
+    free(data);
+    return ok;
+}
+
+// Best time of a few rounds hashing SHA1_MAX_LANES messages of CALIBRATION_LENGTH bytes with 'engine'
+static double time_engine(Sha1Engine engine, const unsigned char *const *messages) {
+    unsigned char hashes[SHA1_MAX_LANES * SHA1_DIGEST_LENGTH];
+    double best = -1;
+    for (int round = 0; round < CALIBRATION_ROUNDS; round++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        hash_many(engine, messages, SHA1_MAX_LANES, CALIBRATION_LENGTH, hashes);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (best < 0 || seconds < best) best = seconds;
+    }
+    return best;
+}
+
+// Times every usable engine against OpenSSL on this machine and build. the speed order depends on the
+// CPU (SHA-NI, AVX-512 frequency drops) and on how the kernels were compiled, so it is measured rather
+// than fixed. an engine has to beat OpenSSL by 10% to replace it
+static Sha1Engine fastest_engine(void) {
+    unsigned char *data = malloc(SHA1_MAX_LANES * CALIBRATION_LENGTH);
+    if (data == NULL) {
+        return SHA1_ENGINE_OPENSSL;
+    }
+    const unsigned char *messages[SHA1_MAX_LANES];
+    for (int i = 0; i < SHA1_MAX_LANES; i++) {
+        messages[i] = data + i * CALIBRATION_LENGTH;
+    }
+    for (size_t i = 0; i < SHA1_MAX_LANES * CALIBRATION_LENGTH; i++) {
+        data[i] = (unsigned char)(i * 2654435761u >> 13);
+    }
+
+    Sha1Engine fastest = SHA1_ENGINE_OPENSSL;
+    double best = time_engine(SHA1_ENGINE_OPENSSL, messages) / 1.1;
+    for (int i = SHA1_ENGINE_OPENSSL + 1; i < SHA1_ENGINE_COUNT; i++) {
+        double seconds = engine_usable[i] ? time_engine(i, messages) : -1;
+        if (seconds >= 0 && seconds < best) {
+            fastest = i;
+            best = seconds;
+        }
+    }
+    free(data);
+    return fastest;
+}
+
+static void select_engines(void) {
+    engine_usable[SHA1_ENGINE_OPENSSL] = true;
+#ifdef SHA1_HAVE_X86
+    __builtin_cpu_init();
+    engine_usable[SHA1_ENGINE_SHANI] = __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+    engine_usable[SHA1_ENGINE_SSE2_X4] = __builtin_cpu_supports("sse2");
+    engine_usable[SHA1_ENGINE_AVX2_X8] = __builtin_cpu_supports("avx2");
+    engine_usable[SHA1_ENGINE_AVX512_X16] = __builtin_cpu_supports("avx512f");
+
+    // SHA-NI is tested first, the lane engines use it for their leftovers
+    for (int i = SHA1_ENGINE_SHANI; i < SHA1_ENGINE_COUNT; i++) {
+        if (engine_usable[i] && !self_test(i)) {
+            engine_usable[i] = false;
+        }
+    }
+#endif
+
+    active_engine = SHA1_ENGINE_COUNT;
+    const char *forced = getenv("BITTORRENT_SHA1_ENGINE");
+    for (int i = 0; forced != NULL && i < SHA1_ENGINE_COUNT; i++) {
+        if (strcmp(forced, engines[i].name) == 0 && engine_usable[i]) {
+            active_engine = i;
+        }
+    }
+    if (active_engine == SHA1_ENGINE_COUNT) {
+        active_engine = fastest_engine();
+    }
+}
+
+bool sha1_engine_available(Sha1Engine engine) {
+    pthread_once(&engines_once, select_engines);
+    return engine < SHA1_ENGINE_COUNT && engine_usable[engine];
+}
+
+Sha1Engine sha1_engine_active(void) {
+    pthread_once(&engines_once, select_engines);
+    return active_engine;
+}
+
+const char *sha1_engine_name(Sha1Engine engine) {
+    return engine < SHA1_ENGINE_COUNT ? engines[engine].name : "unknown";
+}
+
+int sha1_hash_many_with(Sha1Engine engine, const unsigned char *const *messages, size_t count, size_t length, unsigned char *hashes) {
+    if (!sha1_engine_available(engine)) {
+        return 0;
+    }
+    return hash_many(engine, messages, count, length, hashes);
+}
+
+int sha1_hash_many(const unsigned char *const *messages, size_t count, size_t length, unsigned char *hashes) {
+    return sha1_hash_many_with(sha1_engine_active(), messages, count, length, hashes);
+}
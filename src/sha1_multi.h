@@ -0,0 +1,33 @@
+#ifndef SHA1_MULTI_H
+#define SHA1_MULTI_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Ways of hashing many equal-length messages (pieces) with SHA-1. the SIMD engines run 4, 8 or 16
+// messages side by side, one per 32-bit lane; SHA-NI runs one message at a time in hardware
+typedef enum Sha1Engine {
+    SHA1_ENGINE_OPENSSL,     // One message at a time through sha1_hash
+    SHA1_ENGINE_SHANI,
+    SHA1_ENGINE_SSE2_X4,
+    SHA1_ENGINE_AVX2_X8,
+    SHA1_ENGINE_AVX512_X16,
+    SHA1_ENGINE_COUNT
+} Sha1Engine;
+
+// true if the CPU can run 'engine' and it matched OpenSSL on the self test
+bool sha1_engine_available(Sha1Engine engine);
+
+// the engine sha1_hash_many uses: the fastest available one, timed against OpenSSL on first use, or
+// $BITTORRENT_SHA1_ENGINE when it names one
+Sha1Engine sha1_engine_active(void);
+
+const char *sha1_engine_name(Sha1Engine engine);
+
+// hashes 'count' messages of 'length' bytes each into 'hashes' (count x 20 bytes). returns 1 on success
+int sha1_hash_many(const unsigned char *const *messages, size_t count, size_t length, unsigned char *hashes);
+
+// the same with a given engine (for benchmarks), returns 0 if it is not available
+int sha1_hash_many_with(Sha1Engine engine, const unsigned char *const *messages, size_t count, size_t length, unsigned char *hashes);
+
+#endif
@@ -0,0 +1,107 @@
+#include "sink.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int buffer_reserve(Buffer *buffer, size_t extra) {
+    size_t needed = buffer->length + extra + 1;
+    if (needed <= buffer->capacity) {
+        return 0;
+    }
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 256;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+
+    char *grown = realloc(buffer->data, capacity);
+    if (grown == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+int buffer_append(Buffer *buffer, const void *data, size_t length) {
+    if (buffer_reserve(buffer, length) < 0) {
+        return -1;
+    }
+    if (length > 0) {
+        memcpy(buffer->data + buffer->length, data, length);
+        buffer->length += length;
+    }
+    buffer->data[buffer->length] = '\0';
+    return 0;
+}
+
+int buffer_printf(Buffer *buffer, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int needed = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (needed < 0 || buffer_reserve(buffer, needed) < 0) {
+        return -1;
+    }
+
+    va_start(args, format);
+    vsnprintf(buffer->data + buffer->length, needed + 1, format, args);
+    va_end(args);
+    buffer->length += needed;
+    return 0;
+}
+
+void buffer_free(Buffer *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = buffer->capacity = 0;
+}
+
+static int buffer_sink_write(void *context, const void *data, size_t length) {
+    return buffer_append((Buffer *)context, data, length);
+}
+
+Sink buffer_sink(Buffer *buffer) {
+    return (Sink){buffer_sink_write, buffer};
+}
+
+static int fd_sink_write(void *context, const void *data, size_t length) {
+    int fd = (int)(intptr_t)context;
+    const char *ptr = data;
+    while (length > 0) {
+        ssize_t written = write(fd, ptr, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            perror("Write failed");
+            return -1;
+        }
+        ptr += written;
+        length -= written;
+    }
+    return 0;
+}
+
+Sink fd_sink(int fd) {
+    return (Sink){fd_sink_write, (void *)(intptr_t)fd};
+}
+
+static int file_sink_write(void *context, const void *data, size_t length) {
+    return fwrite(data, 1, length, (FILE *)context) == length ? 0 : -1;
+}
+
+Sink file_sink(FILE *file) {
+    return (Sink){file_sink_write, file};
+}
+
+static int sha1_sink_write(void *context, const void *data, size_t length) {
+    return sha1_update((Sha1Context *)context, data, length) ? 0 : -1;
+}
+
+Sink sha1_sink(Sha1Context *context) {
+    return (Sink){sha1_sink_write, context};
+}
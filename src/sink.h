@@ -0,0 +1,50 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include "sha1.h"
+
+// Destination for encoded or rendered bytes
+typedef struct Sink {
+    int (*write)(void *context, const void *data, size_t length);  // returns 0 on success, -1 on failure
+    void *context;
+} Sink;
+
+// Growable byte buffer, always kept NUL-terminated so text output can be used directly
+typedef struct Buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+// makes sure 'extra' more bytes (plus the terminator) fit without another allocation
+int buffer_reserve(Buffer *buffer, size_t extra);
+
+// appends raw bytes to the buffer
+int buffer_append(Buffer *buffer, const void *data, size_t length);
+
+// appends printf-style formatted text to the buffer
+int buffer_printf(Buffer *buffer, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// releases the buffer's memory
+void buffer_free(Buffer *buffer);
+
+// sink that appends to a Buffer
+Sink buffer_sink(Buffer *buffer);
+
+// sink that writes to a file descriptor, retrying short writes
+Sink fd_sink(int fd);
+
+// sink that writes to a stdio stream
+Sink file_sink(FILE *file);
+
+// sink that feeds an incremental SHA-1 context
+Sink sha1_sink(Sha1Context *context);
+
+// writes everything to the sink
+static inline int sink_write(Sink sink, const void *data, size_t length) {
+    return length == 0 ? 0 : sink.write(sink.context, data, length);
+}
+
+#endif // SINK_H
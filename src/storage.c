@@ -0,0 +1,248 @@
+#define _GNU_SOURCE // IOV_MAX
+#include "storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Extents mapped per storage_map_range call while writing, pieces rarely span more files
+#define STORAGE_EXTENT_BATCH 16
+
+int storage_map_range(const MetaInfo *info, size_t piece_index, size_t offset, size_t length, FileExtent *extents, size_t max_extents) {
+    if (piece_index >= info->num_pieces || offset > info_piece_size(info, piece_index) ||
+        length > info_piece_size(info, piece_index) - offset) {
+        return -1;
+    }
+
+    size_t position = piece_index * info->piece_length + offset;
+    size_t count = 0;
+    for (size_t i = length ? info_file_at(info, position) : info->num_files; length > 0; i++) {
+        const TorrentFile *file = &info->files[i];
+        if (file->length == 0) {
+            continue;
+        }
+        if (count == max_extents) {
+            break;
+        }
+        size_t file_offset = position - file->offset;
+        size_t run = file->length - file_offset < length ? file->length - file_offset : length;
+        extents[count++] = (FileExtent){ .file_index = i, .file_offset = file_offset, .length = run };
+        position += run;
+        length -= run;
+    }
+    return count;
+}
+
+// mkdir -p for the directories leading to 'path'
+static int make_parent_directories(char *path) {
+    for (char *p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        int status = mkdir(path, 0755);
+        *p = '/';
+        if (status < 0 && errno != EEXIST) return -1;
+    }
+    return 0;
+}
+
+int storage_file_path(const MetaInfo *info, const char *target, size_t file_index, char *path, size_t size) {
+    int written = info->multi_file ? snprintf(path, size, "%s/%s", target, info->files[file_index].path)
+                                   : snprintf(path, size, "%s", target);
+    if (written < 0 || (size_t)written >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+int storage_open(Storage *storage, const MetaInfo *info, const char *target) {
+    storage->info = info;
+    storage->fds = malloc(info->num_files * sizeof(*storage->fds));
+    if (storage->fds == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < info->num_files; i++) {
+        storage->fds[i] = -1;
+    }
+
+    for (size_t i = 0; i < info->num_files; i++) {
+        if (info->files[i].padding) {
+            continue;
+        }
+        char path[PATH_MAX];
+        if (storage_file_path(info, target, i, path, sizeof(path)) < 0) {
+            goto fail;
+        }
+        if (info->multi_file && make_parent_directories(path) < 0) {
+            goto fail;
+        }
+
+        storage->fds[i] = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (storage->fds[i] < 0) {
+            goto fail;
+        }
+        // Size every file up front (sparse), so pieces can land in any order
+        struct stat st;
+        if (fstat(storage->fds[i], &st) < 0 ||
+            ((size_t)st.st_size != info->files[i].length && ftruncate(storage->fds[i], info->files[i].length) < 0)) {
+            goto fail;
+        }
+    }
+    return 0;
+
+fail: {
+        int saved = errno;
+        storage_close(storage);
+        errno = saved;
+        return -1;
+    }
+}
+
+// pwritev all of 'iov' at 'offset', retrying short writes
+static int pwritev_all(int fd, struct iovec *iov, int count, off_t offset) {
+    while (count > 0) {
+        ssize_t written = pwritev(fd, iov, count < IOV_MAX ? count : IOV_MAX, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        offset += written;
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Write 'buffers' ('length' bytes in total) at 'begin' inside piece 'piece_index', one pwritev per file
+static int write_range(Storage *storage, size_t piece_index, size_t begin, size_t length, const struct iovec *buffers, int count) {
+    // Slices of the caller's buffers for one file at a time, at most one per buffer plus a split one
+    struct iovec *slices = malloc((count + 1) * sizeof(*slices));
+    if (slices == NULL) {
+        return -1;
+    }
+
+    int buffer = 0;
+    size_t buffer_offset = 0;
+    FileExtent extents[STORAGE_EXTENT_BATCH];
+    while (length > 0) {
+        int mapped = storage_map_range(storage->info, piece_index, begin, length, extents, STORAGE_EXTENT_BATCH);
+        if (mapped <= 0) {
+            free(slices);
+            errno = EINVAL;
+            return -1;
+        }
+        for (int e = 0; e < mapped; e++) {
+            const FileExtent *extent = &extents[e];
+            int sliced = 0;
+            for (size_t gathered = 0; gathered < extent->length;) {
+                size_t take = buffers[buffer].iov_len - buffer_offset;
+                if (take > extent->length - gathered) take = extent->length - gathered;
+                slices[sliced++] = (struct iovec){ (char *)buffers[buffer].iov_base + buffer_offset, take };
+                gathered += take;
+                buffer_offset += take;
+                if (buffer_offset == buffers[buffer].iov_len) {
+                    buffer++;
+                    buffer_offset = 0;
+                }
+            }
+
+            if (!storage->info->files[extent->file_index].padding &&
+                pwritev_all(storage->fds[extent->file_index], slices, sliced, extent->file_offset) < 0) {
+                free(slices);
+                return -1;
+            }
+            begin += extent->length;
+            length -= extent->length;
+        }
+    }
+    free(slices);
+    return 0;
+}
+
+int storage_writev(Storage *storage, size_t piece_index, const struct iovec *buffers, int count) {
+    const MetaInfo *info = storage->info;
+    size_t length = 0;
+    for (int i = 0; i < count; i++) {
+        length += buffers[i].iov_len;
+    }
+    if (piece_index >= info->num_pieces || length != info_piece_size(info, piece_index)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return write_range(storage, piece_index, 0, length, buffers, count);
+}
+
+int storage_write_block(Storage *storage, size_t piece_index, size_t begin, const char *data, size_t length) {
+    const MetaInfo *info = storage->info;
+    if (piece_index >= info->num_pieces || begin > info_piece_size(info, piece_index) ||
+        length > info_piece_size(info, piece_index) - begin) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct iovec buffer = { (void *)data, length };
+    return write_range(storage, piece_index, begin, length, &buffer, 1);
+}
+
+int storage_write_piece(Storage *storage, size_t piece_index, const char *data, size_t length) {
+    struct iovec buffer = { (void *)data, length };
+    return storage_writev(storage, piece_index, &buffer, 1);
+}
+
+ssize_t storage_send_block(Storage *storage, int sockfd, size_t piece_index, size_t begin, size_t length) {
+    const MetaInfo *info = storage->info;
+    if (piece_index >= info->num_pieces || begin > info_piece_size(info, piece_index) ||
+        length > info_piece_size(info, piece_index) - begin) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    static const char zeros[4096];
+    size_t position = piece_index * info->piece_length + begin;
+    size_t sent = 0;
+    while (sent < length) {
+        const TorrentFile *file = &info->files[info_file_at(info, position)];
+        size_t file_offset = position - file->offset;
+        size_t run = file->length - file_offset < length - sent ? file->length - file_offset : length - sent;
+        ssize_t written;
+        if (file->padding) {
+            written = send(sockfd, zeros, run < sizeof(zeros) ? run : sizeof(zeros), MSG_NOSIGNAL | MSG_MORE);
+        } else {
+            off_t offset = file_offset;
+            written = sendfile(sockfd, storage->fds[file - info->files], &offset, run);
+        }
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return sent > 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? (ssize_t)sent : -1;
+        }
+        if (written == 0) {
+            errno = EIO; // The file is shorter than the torrent says
+            return -1;
+        }
+        position += written;
+        sent += written;
+    }
+    return sent;
+}
+
+void storage_close(Storage *storage) {
+    if (storage->fds != NULL) {
+        for (size_t i = 0; i < storage->info->num_files; i++) {
+            if (storage->fds[i] >= 0) close(storage->fds[i]);
+        }
+    }
+    free(storage->fds);
+    storage->fds = NULL;
+}
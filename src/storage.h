@@ -0,0 +1,54 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "info.h"
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// A run of bytes of the torrent's content that lives inside one file
+typedef struct FileExtent {
+    size_t file_index;
+    size_t file_offset;
+    size_t length;
+} FileExtent;
+
+// The files a torrent is downloaded into, one open descriptor per file
+typedef struct Storage {
+    const MetaInfo *info;
+    int *fds;
+} Storage;
+
+// maps 'length' bytes at 'offset' inside piece 'piece_index' onto the files holding them. zero-length files
+// never appear, padding files do (their bytes are zero and never stored). the first file is found by
+// binary search over the extent map (O(log n)). a range that needs more than 'max_extents' gets the first
+// 'max_extents' of them, the caller maps the rest from where the last one ends.
+// returns the number of extents written to 'extents', or -1 if the range is out of bounds
+int storage_map_range(const MetaInfo *info, size_t piece_index, size_t offset, size_t length, FileExtent *extents, size_t max_extents);
+
+// builds the on-disk path of file 'file_index' under 'target' (see storage_open) into 'path'.
+// returns 0 on success and -1 if it does not fit (errno is ENAMETOOLONG)
+int storage_file_path(const MetaInfo *info, const char *target, size_t file_index, char *path, size_t size);
+
+// creates (without truncating) every non-padding file of the torrent under 'target': the file itself
+// for a single-file torrent, the top directory for a multi-file one. returns 0 on success and -1 on failure (errno is kept)
+int storage_open(Storage *storage, const MetaInfo *info, const char *target);
+
+// writes a piece held in 'count' buffers (e.g. one per block), with a single pwritev per file it touches
+int storage_writev(Storage *storage, size_t piece_index, const struct iovec *buffers, int count);
+
+// writes part of a piece, e.g. a block as soon as it has been hashed
+int storage_write_block(Storage *storage, size_t piece_index, size_t begin, const char *data, size_t length);
+
+// writes a contiguous piece
+int storage_write_piece(Storage *storage, size_t piece_index, const char *data, size_t length);
+
+// sends 'length' bytes at 'begin' inside piece 'piece_index' to the socket 'sockfd' with sendfile, straight
+// from the page cache (padding bytes are sent as zeros). stops early once the socket is full.
+// returns the number of bytes sent, or -1 on failure (errno is EAGAIN if a non-blocking socket took nothing)
+ssize_t storage_send_block(Storage *storage, int sockfd, size_t piece_index, size_t begin, size_t length);
+
+// closes every file
+void storage_close(Storage *storage);
+
+#endif
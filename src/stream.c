@@ -0,0 +1,233 @@
+#include "stream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void bencode_stream_init(BencodeStream *stream, BencodeEventHandler handler, void *userdata) {
+    memset(stream, 0, sizeof(*stream));
+    stream->handler = handler;
+    stream->userdata = userdata;
+    stream->state = BENCODE_STREAM_VALUE;
+}
+
+void bencode_stream_free(BencodeStream *stream) {
+    free(stream->buffer);
+    stream->buffer = NULL;
+    stream->buffer_capacity = 0;
+}
+
+bool bencode_stream_done(const BencodeStream *stream) {
+    return stream->state == BENCODE_STREAM_DONE;
+}
+
+// Put the parser in the error state, always returns -1
+static int stream_error(BencodeStream *stream, const char *message) {
+    snprintf(stream->error, sizeof(stream->error), "%s at offset %zu", message, stream->consumed);
+    stream->state = BENCODE_STREAM_ERROR;
+    return -1;
+}
+
+// The next item belongs to an open dict that is waiting for a key
+static bool expecting_key(const BencodeStream *stream) {
+    return stream->depth > 0 && stream->containers[stream->depth - 1] == 'd' && stream->expect_key[stream->depth - 1];
+}
+
+// Hand an event to the handler
+static int emit(BencodeStream *stream, BencodeEventType type, const char *str, size_t length, int64_t integer) {
+    BencodeEvent event = {type, stream->depth, str, length, integer};
+    if (stream->handler != NULL && stream->handler(stream->userdata, &event) != 0) {
+        return stream_error(stream, "Aborted by handler");
+    }
+    return 0;
+}
+
+// A key, scalar or container just completed, move on to the next item
+static void finish_item(BencodeStream *stream) {
+    if (stream->depth == 0) {
+        stream->state = BENCODE_STREAM_DONE;
+        return;
+    }
+    if (stream->containers[stream->depth - 1] == 'd') {
+        stream->expect_key[stream->depth - 1] = !stream->expect_key[stream->depth - 1];
+    }
+    stream->state = BENCODE_STREAM_VALUE;
+}
+
+// Report a complete string as a key or a value
+static int finish_string(BencodeStream *stream, const char *str) {
+    BencodeEventType type = expecting_key(stream) ? BENCODE_EVENT_KEY : BENCODE_EVENT_STR;
+    if (emit(stream, type, str, stream->string_length, 0) < 0) {
+        return -1;
+    }
+    finish_item(stream);
+    return 0;
+}
+
+// Accumulate one decimal digit with overflow checking
+static int push_digit(BencodeStream *stream, char c, uint64_t limit) {
+    uint64_t digit = c - '0';
+    if (stream->number > (limit - digit) / 10) {
+        return stream_error(stream, "Number too large");
+    }
+    stream->number = stream->number * 10 + digit;
+    stream->digits++;
+    return 0;
+}
+
+// Handle the first byte of a value, or the 'e' closing a container
+static int start_value(BencodeStream *stream, char c) {
+    if (c == 'e') {
+        if (stream->depth == 0) {
+            return stream_error(stream, "Unexpected end marker");
+        }
+        if (stream->containers[stream->depth - 1] == 'd' && !stream->expect_key[stream->depth - 1]) {
+            return stream_error(stream, "Dictionary key without a value");
+        }
+        stream->depth--;
+        if (emit(stream, BENCODE_EVENT_END, NULL, 0, 0) < 0) {
+            return -1;
+        }
+        finish_item(stream);
+        return 0;
+    }
+
+    if (c >= '0' && c <= '9') {
+        stream->state = BENCODE_STREAM_STRING_LENGTH;
+        stream->number = 0;
+        stream->digits = 0;
+        return push_digit(stream, c, BENCODE_STREAM_MAX_STRING);
+    }
+
+    if (expecting_key(stream)) {
+        return stream_error(stream, "Dictionary key is not a string");
+    }
+
+    if (c == 'i') {
+        stream->state = BENCODE_STREAM_INTEGER;
+        stream->number = 0;
+        stream->digits = 0;
+        stream->negative = false;
+        return 0;
+    }
+
+    if (c == 'l' || c == 'd') {
+        if (stream->depth == BENCODE_STREAM_MAX_DEPTH) {
+            return stream_error(stream, "Nesting too deep");
+        }
+        if (emit(stream, c == 'l' ? BENCODE_EVENT_LIST_START : BENCODE_EVENT_DICT_START, NULL, 0, 0) < 0) {
+            return -1;
+        }
+        stream->containers[stream->depth] = c;
+        stream->expect_key[stream->depth] = true;
+        stream->depth++;
+        return 0;
+    }
+
+    return stream_error(stream, "Unsupported encoded value");
+}
+
+// Handle one byte of an integer
+static int integer_byte(BencodeStream *stream, char c) {
+    if (c == '-' && stream->digits == 0 && !stream->negative) {
+        stream->negative = true;
+        return 0;
+    }
+    if (c >= '0' && c <= '9') {
+        return push_digit(stream, c, stream->negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX);
+    }
+    if (c != 'e' || stream->digits == 0) {
+        return stream_error(stream, "Invalid integer");
+    }
+
+    int64_t value = stream->negative ? (int64_t)(0 - stream->number) : (int64_t)stream->number;
+    if (emit(stream, BENCODE_EVENT_INT, NULL, 0, value) < 0) {
+        return -1;
+    }
+    finish_item(stream);
+    return 0;
+}
+
+// Handle one byte of a string length prefix
+static int length_byte(BencodeStream *stream, char c) {
+    if (c >= '0' && c <= '9') {
+        return push_digit(stream, c, BENCODE_STREAM_MAX_STRING);
+    }
+    if (c != ':') {
+        return stream_error(stream, "Invalid string length");
+    }
+
+    stream->string_length = stream->number;
+    stream->string_received = 0;
+    if (stream->string_length == 0) {
+        return finish_string(stream, "");
+    }
+    stream->state = BENCODE_STREAM_STRING_BODY;
+    return 0;
+}
+
+// Consume string bytes, returns how many were used or -1
+static ssize_t string_bytes(BencodeStream *stream, const char *data, size_t available) {
+    size_t needed = stream->string_length - stream->string_received;
+
+    // The whole string is inside this chunk, report it without copying
+    if (stream->string_received == 0 && available >= needed) {
+        return finish_string(stream, data) < 0 ? -1 : (ssize_t)needed;
+    }
+
+    if (stream->buffer_capacity < stream->string_length) {
+        char *grown = realloc(stream->buffer, stream->string_length);
+        if (grown == NULL) {
+            return stream_error(stream, "Memory allocation failed");
+        }
+        stream->buffer = grown;
+        stream->buffer_capacity = stream->string_length;
+    }
+
+    size_t take = available < needed ? available : needed;
+    memcpy(stream->buffer + stream->string_received, data, take);
+    stream->string_received += take;
+    if (stream->string_received == stream->string_length && finish_string(stream, stream->buffer) < 0) {
+        return -1;
+    }
+    return take;
+}
+
+ssize_t bencode_stream_feed(BencodeStream *stream, const char *data, size_t length) {
+    if (stream->state == BENCODE_STREAM_ERROR) {
+        return -1;
+    }
+
+    size_t pos = 0;
+    while (pos < length && stream->state != BENCODE_STREAM_DONE) {
+        int status = 0;
+        switch (stream->state) {
+            case BENCODE_STREAM_VALUE:
+                status = start_value(stream, data[pos]);
+                break;
+            case BENCODE_STREAM_INTEGER:
+                status = integer_byte(stream, data[pos]);
+                break;
+            case BENCODE_STREAM_STRING_LENGTH:
+                status = length_byte(stream, data[pos]);
+                break;
+            case BENCODE_STREAM_STRING_BODY: {
+                ssize_t used = string_bytes(stream, data + pos, length - pos);
+                if (used < 0) {
+                    return -1;
+                }
+                pos += used;
+                stream->consumed += used;
+                continue;
+            }
+            default:
+                break;
+        }
+        if (status < 0) {
+            return -1;
+        }
+        pos++;
+        stream->consumed++;
+    }
+    return pos;
+}
@@ -0,0 +1,83 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Deepest nesting the push parser keeps track of
+#define BENCODE_STREAM_MAX_DEPTH 64
+
+// Strings longer than this are rejected instead of buffered
+#define BENCODE_STREAM_MAX_STRING (64 * 1024 * 1024)
+
+// Kind of event reported while a document streams in
+typedef enum BencodeEventType {
+    BENCODE_EVENT_INT,         // An integer value
+    BENCODE_EVENT_STR,         // A string value
+    BENCODE_EVENT_KEY,         // A dictionary key, the next event is its value
+    BENCODE_EVENT_LIST_START,  // 'l'
+    BENCODE_EVENT_DICT_START,  // 'd'
+    BENCODE_EVENT_END,         // 'e' closing the innermost list or dict
+} BencodeEventType;
+
+// A single parse event. strings are only valid for the duration of the callback
+typedef struct BencodeEvent {
+    BencodeEventType type;
+    size_t depth;      // 0 for the root value, 1 for keys and values directly inside it, ...
+    const char *str;   // BENCODE_EVENT_STR and BENCODE_EVENT_KEY
+    size_t length;
+    int64_t integer;   // BENCODE_EVENT_INT
+} BencodeEvent;
+
+// Receives parse events, returns 0 to keep going or non-zero to abort the parse
+typedef int (*BencodeEventHandler)(void *userdata, const BencodeEvent *event);
+
+// Where the push parser is inside the current token
+typedef enum BencodeStreamState {
+    BENCODE_STREAM_VALUE,          // Expecting a value, or 'e' to close a container
+    BENCODE_STREAM_INTEGER,        // Inside i...e
+    BENCODE_STREAM_STRING_LENGTH,  // Reading the digits before ':'
+    BENCODE_STREAM_STRING_BODY,    // Reading string bytes
+    BENCODE_STREAM_DONE,           // The root value is complete
+    BENCODE_STREAM_ERROR,
+} BencodeStreamState;
+
+// Resumable (push/SAX-style) bencode parser, fed with chunks as they arrive
+typedef struct BencodeStream {
+    BencodeEventHandler handler;
+    void *userdata;
+    BencodeStreamState state;
+
+    size_t depth;
+    char containers[BENCODE_STREAM_MAX_DEPTH];   // 'l' or 'd' for every open container
+    bool expect_key[BENCODE_STREAM_MAX_DEPTH];   // Next item of an open dict is a key
+
+    uint64_t number;        // Integer magnitude or string length read so far
+    size_t digits;
+    bool negative;
+
+    size_t string_length;   // Length of the string being read
+    size_t string_received;
+    char *buffer;           // Holds a string that spans chunks
+    size_t buffer_capacity;
+
+    size_t consumed;        // Total bytes consumed since init
+    char error[96];
+} BencodeStream;
+
+// prepares a parser that reports events to 'handler'
+void bencode_stream_init(BencodeStream *stream, BencodeEventHandler handler, void *userdata);
+
+// feeds the next chunk. returns how many bytes were consumed (less than 'length' once the
+// root value completes, so trailing payload can be handled by the caller), -1 on error
+ssize_t bencode_stream_feed(BencodeStream *stream, const char *data, size_t length);
+
+// true once a complete root value has been parsed
+bool bencode_stream_done(const BencodeStream *stream);
+
+// releases the buffer owned by the parser
+void bencode_stream_free(BencodeStream *stream);
+
+#endif // STREAM_H
@@ -0,0 +1,339 @@
+#include "tape.h"
+
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TAPE_HAVE_X86 1
+#endif
+
+// Nesting limit while indexing, same bound as the tree parser
+#define MAX_TAPE_DEPTH 512
+
+// Returns the first byte in [ptr, end) that is not an ASCII digit, or end
+typedef const char *(*DigitScanner)(const char *ptr, const char *end);
+
+static const char *scan_digits_scalar(const char *ptr, const char *end) {
+    while (ptr < end && is_digit(*ptr)) {
+        ptr++;
+    }
+    return ptr;
+}
+
+#ifdef TAPE_HAVE_X86
+// 16 bytes per step: bytes between '0' and '9' set a bit in the movemask
+__attribute__((target("sse2")))
+static const char *scan_digits_sse2(const char *ptr, const char *end) {
+    const __m128i low = _mm_set1_epi8('0' - 1);
+    const __m128i high = _mm_set1_epi8('9' + 1);
+    while (end - ptr >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)ptr);
+        __m128i digits = _mm_and_si128(_mm_cmpgt_epi8(bytes, low), _mm_cmplt_epi8(bytes, high));
+        unsigned mask = ~(unsigned)_mm_movemask_epi8(digits) & 0xFFFF;
+        if (mask != 0) {
+            return ptr + __builtin_ctz(mask);
+        }
+        ptr += 16;
+    }
+    return scan_digits_scalar(ptr, end);
+}
+
+// 32 bytes per step, same classification as the SSE2 kernel
+__attribute__((target("avx2")))
+static const char *scan_digits_avx2(const char *ptr, const char *end) {
+    const __m256i low = _mm256_set1_epi8('0' - 1);
+    const __m256i high = _mm256_set1_epi8('9' + 1);
+    while (end - ptr >= 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)ptr);
+        __m256i digits = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, low), _mm256_cmpgt_epi8(high, bytes));
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(digits);
+        if (mask != 0) {
+            return ptr + __builtin_ctz(mask);
+        }
+        ptr += 32;
+    }
+    return scan_digits_sse2(ptr, end);
+}
+#endif
+
+static DigitScanner digit_scanner = scan_digits_scalar;
+static const char *digit_scanner_name = "scalar";
+static pthread_once_t scanner_once = PTHREAD_ONCE_INIT;
+
+// Pick the widest kernel the running CPU supports, runs once per process
+static void select_scanner(void) {
+#ifdef TAPE_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        digit_scanner = scan_digits_avx2;
+        digit_scanner_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        digit_scanner = scan_digits_sse2;
+        digit_scanner_name = "sse2";
+    }
+#endif
+}
+
+const char *tape_kernel_name(void) {
+    pthread_once(&scanner_once, select_scanner);
+    return digit_scanner_name;
+}
+
+// Record why indexing failed, always returns 0 (no bytes consumed)
+static size_t tape_error(BencodeTape *tape, const char *message, size_t pos) {
+    snprintf(tape->error, sizeof(tape->error), "%s at offset %zu", message, pos);
+    return 0;
+}
+
+// Append an entry, returns its index or -1 when out of memory
+static long push_entry(BencodeTape *tape, DecodedValueType type, size_t offset) {
+    if (tape->count == tape->capacity) {
+        size_t capacity = tape->capacity ? tape->capacity * 2 : 256;
+        TapeEntry *grown = realloc(tape->entries, capacity * sizeof(TapeEntry));
+        if (grown == NULL) {
+            return -1;
+        }
+        tape->entries = grown;
+        tape->capacity = capacity;
+    }
+    TapeEntry *entry = &tape->entries[tape->count];
+    memset(entry, 0, sizeof(*entry));
+    entry->type = type;
+    entry->offset = offset;
+    return tape->count++;
+}
+
+// Convert a validated run of digits, -1 on overflow
+static int digits_value(const char *start, const char *end, uint64_t limit, uint64_t *value) {
+    uint64_t result = 0;
+    for (const char *p = start; p < end; p++) {
+        uint64_t digit = *p - '0';
+        if (result > (limit - digit) / 10) {
+            return -1;
+        }
+        result = result * 10 + digit;
+    }
+    *value = result;
+    return 0;
+}
+
+size_t tape_build(BencodeTape *tape, const char *data, size_t length) {
+    pthread_once(&scanner_once, select_scanner);
+    DigitScanner scan = digit_scanner;
+    const char *end = data + length;
+    size_t stack[MAX_TAPE_DEPTH];
+    size_t depth = 0;
+    size_t pos = 0;
+
+    memset(tape, 0, sizeof(*tape));
+    tape->data = data;
+    tape->length = length;
+
+    do {
+        if (pos >= length) {
+            return tape_error(tape, "Unexpected end of buffer", pos);
+        }
+        char c = data[pos];
+
+        // Close the innermost container and link it to whatever follows its subtree
+        if (c == 'e') {
+            if (depth == 0) {
+                return tape_error(tape, "Unexpected end marker", pos);
+            }
+            TapeEntry *container = &tape->entries[stack[--depth]];
+            if (container->type == DECODED_VALUE_TYPE_DICT && container->count % 2 != 0) {
+                return tape_error(tape, "Dictionary key without a value", pos);
+            }
+            pos++;
+            container->span = pos - container->offset;
+            container->next = tape->count;
+            continue;
+        }
+
+        if (depth > 0) {
+            TapeEntry *parent = &tape->entries[stack[depth - 1]];
+            if (parent->type == DECODED_VALUE_TYPE_DICT && parent->count % 2 == 0 && !is_digit(c)) {
+                return tape_error(tape, "Dictionary key is not a string", pos);
+            }
+            parent->count++;
+        }
+
+        long index;
+        if (is_digit(c)) {
+            // Read the length prefix with the SIMD kernel, then jump straight past the payload
+            const char *colon = scan(data + pos, end);
+            uint64_t string_length;
+            if (colon == end || *colon != ':') {
+                return tape_error(tape, "Unterminated number", colon - data);
+            }
+            if (digits_value(data + pos, colon, SIZE_MAX, &string_length) < 0) {
+                return tape_error(tape, "Length overflow", pos);
+            }
+            size_t payload = colon - data + 1;
+            if (string_length > length - payload) {
+                return tape_error(tape, "String runs past end of buffer", payload);
+            }
+            if ((index = push_entry(tape, DECODED_VALUE_TYPE_STR, pos)) < 0) {
+                return tape_error(tape, "Memory allocation failed", pos);
+            }
+            tape->entries[index].length = string_length;
+            pos = payload + string_length;
+        } else if (c == 'i') {
+            const char *digits = data + pos + 1;
+            bool negative = digits < end && *digits == '-';
+            digits += negative;
+            const char *terminator = scan(digits, end);
+            uint64_t magnitude;
+            if (terminator == digits) {
+                return tape_error(tape, "Expected digits", digits - data);
+            }
+            if (terminator == end || *terminator != 'e') {
+                return tape_error(tape, "Unterminated number", terminator - data);
+            }
+            if (digits_value(digits, terminator, negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX, &magnitude) < 0) {
+                return tape_error(tape, "Integer overflow", pos);
+            }
+            if ((index = push_entry(tape, DECODED_VALUE_TYPE_INT, pos)) < 0) {
+                return tape_error(tape, "Memory allocation failed", pos);
+            }
+            tape->entries[index].integer = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+            pos = terminator - data + 1;
+        } else if (c == 'l' || c == 'd') {
+            if (depth == MAX_TAPE_DEPTH) {
+                return tape_error(tape, "Nesting too deep", pos);
+            }
+            if ((index = push_entry(tape, c == 'l' ? DECODED_VALUE_TYPE_LIST : DECODED_VALUE_TYPE_DICT, pos)) < 0) {
+                return tape_error(tape, "Memory allocation failed", pos);
+            }
+            stack[depth++] = index;
+            pos++;
+            continue;
+        } else {
+            return tape_error(tape, "Unsupported encoded value", pos);
+        }
+
+        // Scalars are complete as soon as they are indexed
+        tape->entries[index].span = pos - tape->entries[index].offset;
+        tape->entries[index].next = tape->count;
+    } while (depth > 0);
+
+    tape->error[0] = '\0';
+    return pos;
+}
+
+void tape_free(BencodeTape *tape) {
+    free(tape->entries);
+    tape->entries = NULL;
+    tape->count = tape->capacity = 0;
+}
+
+const char *tape_string(const BencodeTape *tape, size_t entry, size_t *length) {
+    if (entry >= tape->count || tape->entries[entry].type != DECODED_VALUE_TYPE_STR) {
+        return NULL;
+    }
+    const TapeEntry *str = &tape->entries[entry];
+    *length = str->length;
+    return tape->data + str->offset + str->span - str->length;
+}
+
+long tape_find_key(const BencodeTape *tape, size_t entry, const char *key, size_t key_length) {
+    if (entry >= tape->count || tape->entries[entry].type != DECODED_VALUE_TYPE_DICT) {
+        return -1;
+    }
+
+    // Walk the keys, hopping over each value's subtree through its 'next' link
+    size_t child = entry + 1;
+    for (size_t i = 0; i < tape->entries[entry].count; i += 2) {
+        size_t child_length = 0;
+        const char *child_key = tape_string(tape, child, &child_length);
+        size_t value = child + 1;
+        if (child_length == key_length && memcmp(child_key, key, key_length) == 0) {
+            return value;
+        }
+        child = tape->entries[value].next;
+    }
+    return -1;
+}
+
+// NUL-terminated arena copy of a string payload, NULL when out of memory
+static char *copy_string(Arena *arena, const char *str, size_t length) {
+    char *copy = arena_alloc(arena, length + 1);
+    if (copy != NULL) {
+        memcpy(copy, str, length);
+        copy[length] = '\0';
+    }
+    return copy;
+}
+
+// Build the node of 'entry' and its subtree. the tape already holds every count, so each list and dict
+// array is allocated once at its final size. raw offsets are relative to 'base'
+static int materialize_value(const BencodeTape *tape, size_t entry, size_t base, DecodeMode mode, Arena *arena,
+                             DecodedValue *decoded) {
+    const TapeEntry *value = &tape->entries[entry];
+    memset(decoded, 0, sizeof(*decoded));
+    decoded->type = value->type;
+    decoded->raw_offset = value->offset - base;
+    decoded->raw_length = value->span;
+
+    if (value->type == DECODED_VALUE_TYPE_STR) {
+        const char *payload = tape_string(tape, entry, &decoded->val.length);
+        decoded->val.str = mode == DECODE_MODE_VIEW ? (char *)payload : copy_string(arena, payload, value->length);
+        return decoded->val.str != NULL ? 0 : -1;
+    }
+    if (value->type == DECODED_VALUE_TYPE_INT) {
+        decoded->val.integer = value->integer;
+        return 0;
+    }
+
+    size_t child = entry + 1;
+    if (value->type == DECODED_VALUE_TYPE_LIST) {
+        decoded->size = value->count;
+        if (value->count > 0 && (decoded->val.list = arena_alloc(arena, value->count * sizeof(DecodedValue))) == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < value->count; i++) {
+            if (materialize_value(tape, child, base, mode, arena, &decoded->val.list[i]) < 0) {
+                return -1;
+            }
+            child = tape->entries[child].next;
+        }
+        return 0;
+    }
+
+    size_t count = value->count / 2;
+    decoded->size = count;
+    decoded->val.sorted = true;
+    if (count > 0 && (decoded->val.dict = arena_alloc(arena, count * sizeof(KeyValPair))) == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        KeyValPair *pair = &decoded->val.dict[i];
+        const char *key = tape_string(tape, child, &pair->key_length);
+        pair->key = mode == DECODE_MODE_VIEW ? (char *)key : copy_string(arena, key, pair->key_length);
+        if (pair->key == NULL || materialize_value(tape, child + 1, base, mode, arena, &pair->val) < 0) {
+            return -1;
+        }
+        if (i > 0 && compare_keys(pair[-1].key, pair[-1].key_length, pair->key, pair->key_length) >= 0) {
+            decoded->val.sorted = false;
+        }
+        child = tape->entries[child + 1].next;
+    }
+    if (count >= DICT_INDEX_THRESHOLD && count < UINT32_MAX &&
+        (decoded->val.index = build_dict_index(arena, decoded->val.dict, count)) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+size_t tape_materialize(const BencodeTape *tape, size_t entry, DecodeMode mode, BencodeDocument *document) {
+    if (entry >= tape->count) {
+        return 0;
+    }
+    const TapeEntry *value = &tape->entries[entry];
+    arena_init(&document->arena, DOCUMENT_FIRST_BLOCK);
+    if (materialize_value(tape, entry, value->offset, mode, &document->arena, &document->root) < 0) {
+        arena_free(&document->arena);
+        return 0;
+    }
+    return value->span;
+}
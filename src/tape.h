@@ -0,0 +1,49 @@
+#ifndef TAPE_H
+#define TAPE_H
+
+#include "decode.h"
+
+// One structural entry of the tape: a value and where it sits in the source buffer
+typedef struct TapeEntry {
+    DecodedValueType type;
+    size_t offset;      // First byte of the encoded value
+    size_t span;        // Encoded length, including prefixes and the closing 'e'
+    size_t next;        // Index of the entry that follows this value's subtree
+    union {
+        int64_t integer;  // Integers are validated and parsed while the tape is built
+        size_t length;    // String payload length, the payload ends the span
+        size_t count;     // Number of items in a list, keys + values in a dict
+    };
+} TapeEntry;
+
+// Structural index of a bencoded buffer (simdjson-style tape), values are materialized on demand
+typedef struct BencodeTape {
+    const char *data;   // Borrowed source buffer, must outlive the tape
+    size_t length;
+    TapeEntry *entries; // Preorder: a container is followed by its children
+    size_t count;
+    size_t capacity;
+    char error[96];
+} BencodeTape;
+
+// builds the structural index in one pass that jumps over string payloads.
+// returns the number of bytes consumed, 0 on error (see tape->error)
+size_t tape_build(BencodeTape *tape, const char *data, size_t length);
+
+// releases the entries of a tape
+void tape_free(BencodeTape *tape);
+
+// finds the value of a key inside the dict at 'entry', -1 if missing or not a dict
+long tape_find_key(const BencodeTape *tape, size_t entry, const char *key, size_t key_length);
+
+// returns the payload of the string at 'entry' (pointing into the source buffer), NULL if not a string
+const char *tape_string(const BencodeTape *tape, size_t entry, size_t *length);
+
+// builds the document of the subtree at 'entry' straight from the tape, without parsing it again.
+// offsets in the nodes are relative to the entry, returns its encoded length or 0 when out of memory
+size_t tape_materialize(const BencodeTape *tape, size_t entry, DecodeMode mode, BencodeDocument *document);
+
+// name of the digit-scanning kernel picked for this CPU ("avx2", "sse2" or "scalar")
+const char *tape_kernel_name(void);
+
+#endif // TAPE_H
@@ -1,98 +1,206 @@
 #include "tracker.h"
+#include <stdarg.h>
 
 const char *peer_id = "00112233445566778899";
 const char *port = "6881";
-const char uploaded  = '0';
-const char downloaded = '0';
 const char compact ='1';
 
-PeersList get_peers(MetaInfo info)
-{
-    CURL *curl;
-    CURLcode result;
+static _Thread_local char tracker_error_message[256] = "";
+
+// Append one address to the peers list, growing it geometrically
+static int append_peer(Response *response, const Peer *peer) {
+    if (response->peers.count == response->peers_capacity) {
+        size_t capacity = response->peers_capacity ? response->peers_capacity * 2 : 32;
+        Peer *grown = realloc(response->peers.peers, capacity * sizeof(Peer));
+        if (grown == NULL) {
+            fprintf(stderr, "Memory allocation failed");
+            return -1;
+        }
+        response->peers.peers = grown;
+        response->peers_capacity = capacity;
+    }
+    response->peers.peers[response->peers.count++] = *peer;
+    if (response->on_peer != NULL) {
+        response->on_peer(response->context, peer);
+    }
+    return 0;
+}
 
-    curl = curl_easy_init();
-    if (curl == NULL) {
-        fprintf(stderr, "HTTP request failed\n");
-        exit(1);
+// Decode a compact peers string (4 bytes IPv4 + 2 bytes port per peer)
+static int parse_compact_peers(Response *response, const char *raw, size_t length) {
+    for (size_t i = 0; i + 6 <= length; i += 6) {
+        Peer peer;
+        struct in_addr ip_addr;
+        memcpy(&ip_addr, &raw[i], 4);
+        inet_ntop(AF_INET, &ip_addr, peer.ip, INET_ADDRSTRLEN);
+        uint16_t port;
+        memcpy(&port, &raw[i + 4], 2);
+        peer.port = ntohs(port);
+        if (append_peer(response, &peer) < 0) {
+            return -1;
+        }
     }
+    return 0;
+}
 
-    Response response;
-    response.string = malloc(1);
-    response.size = 0;
+// Name the field a key refers to
+static TrackerField match_field(const char *key, size_t length, bool peer_entry) {
+    if (peer_entry) {
+        if (length == 2 && memcmp(key, "ip", 2) == 0) return TRACKER_FIELD_PEER_IP;
+        if (length == 4 && memcmp(key, "port", 4) == 0) return TRACKER_FIELD_PEER_PORT;
+        return TRACKER_FIELD_OTHER;
+    }
+    if (length == 5 && memcmp(key, "peers", 5) == 0) return TRACKER_FIELD_PEERS;
+    if (length == 14 && memcmp(key, "failure reason", 14) == 0) return TRACKER_FIELD_FAILURE;
+    return TRACKER_FIELD_OTHER;
+}
 
-    // URL setup
-    char *safe_info_hash = curl_easy_escape(curl, info.info_hash, 20); // Info hash is 20 bytes long
+// Pick the peers out of the response as it streams in, without keeping the body around
+static int tracker_event(void *userdata, const BencodeEvent *event) {
+    Response *response = (Response *) userdata;
 
-    // Calculate the length of the URL string
-    size_t url_length = snprintf(NULL, 0, "%s?peer_id=%s&info_hash=%s&port=%s&left=%zu&downloaded=%c&uploaded=%c&compact=%c", 
-                                info.url, peer_id, safe_info_hash, port, info.length, downloaded, uploaded, compact);
-    char *url = malloc(url_length + 1); // Add 1 for null terminator
+    if (event->depth == 1) {
+        if (event->type == BENCODE_EVENT_KEY) {
+            response->field = match_field(event->str, event->length, false);
+        } else if (event->type == BENCODE_EVENT_STR && response->field == TRACKER_FIELD_PEERS) {
+            // Compact form: the list is usable as soon as this string completes
+            response->have_peers = true;
+            return parse_compact_peers(response, event->str, event->length);
+        } else if (event->type == BENCODE_EVENT_STR && response->field == TRACKER_FIELD_FAILURE) {
+            size_t length = event->length < sizeof(response->failure) - 1 ? event->length : sizeof(response->failure) - 1;
+            memcpy(response->failure, event->str, length);
+            response->failure[length] = '\0';
+        } else if (event->type == BENCODE_EVENT_LIST_START && response->field == TRACKER_FIELD_PEERS) {
+            response->have_peers = true;
+        }
+        return 0;
+    }
 
-    // Construct the URL string
-    snprintf(url, url_length + 1, "%s?peer_id=%s&info_hash=%s&port=%s&left=%zu&downloaded=%c&uploaded=%c&compact=%c", 
-            info.url, peer_id, safe_info_hash, port, info.length, downloaded, uploaded, compact);
+    // Non-compact form: a list of {"ip": ..., "port": ...} dicts
+    if (response->field != TRACKER_FIELD_PEERS) {
+        return 0;
+    }
+    if (event->depth == 2 && event->type == BENCODE_EVENT_DICT_START) {
+        memset(&response->pending, 0, sizeof(response->pending));
+    } else if (event->depth == 2 && event->type == BENCODE_EVENT_END && response->pending.ip[0] != '\0') {
+        return append_peer(response, &response->pending);
+    } else if (event->depth == 3 && event->type == BENCODE_EVENT_KEY) {
+        response->peer_field = match_field(event->str, event->length, true);
+    } else if (event->depth == 3 && event->type == BENCODE_EVENT_STR && response->peer_field == TRACKER_FIELD_PEER_IP) {
+        if (event->length < INET_ADDRSTRLEN) {
+            memcpy(response->pending.ip, event->str, event->length);
+            response->pending.ip[event->length] = '\0';
+        }
+    } else if (event->depth == 3 && event->type == BENCODE_EVENT_INT && response->peer_field == TRACKER_FIELD_PEER_PORT) {
+        response->pending.port = (int)event->integer;
+    }
+    return 0;
+}
 
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_chunk);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) &response);
+int get_peers(MetaInfo info, PeersList *peers)
+{
+    AnnounceTotals totals = { .left = info.length };
+    return get_peers_streaming(info, totals, NULL, NULL, peers);
+}
 
-    result = curl_easy_perform(curl);
+const char *tracker_error(void) {
+    return tracker_error_message;
+}
 
+// Record why an announce failed, always returns -1
+static int tracker_set_error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(tracker_error_message, sizeof(tracker_error_message), format, args);
+    va_end(args);
+    return -1;
+}
+
+// Whether the finished transfer is a usable response: 0, or -1 with the reason recorded
+static int check_response(CURLcode result, const Response *response, const AnnounceTotals *totals) {
+    if (result == CURLE_WRITE_ERROR && response->stream.state == BENCODE_STREAM_ERROR) {
+        return tracker_set_error("Invalid tracker response: %s", response->stream.error);
+    }
     if (result != CURLE_OK) {
-        fprintf(stderr, "Error : %s\n", curl_easy_strerror(result));
-        exit(1);
+        return tracker_set_error("HTTP request failed: %s", curl_easy_strerror(result));
+    }
+    if (!bencode_stream_done(&response->stream)) {
+        return tracker_set_error("Truncated tracker response");
+    }
+    if (response->failure[0] != '\0') {
+        return tracker_set_error("Tracker failure: %s", response->failure);
+    }
+    bool stopped = totals->event != NULL && strcmp(totals->event, "stopped") == 0;
+    if (!response->have_peers && !stopped) {
+        return tracker_set_error("peers key not found");
     }
+    return 0;
+}
 
-    DecodedValue decodedResponse = decode_bencode(response.string);
-    int peers_index = find_index(decodedResponse, "peers");
+int get_peers_streaming(MetaInfo info, AnnounceTotals totals, PeerCallback on_peer, void *context, PeersList *peers)
+{
+    CURL *curl;
+    CURLcode result;
 
-    if(peers_index == -1) {
-        fprintf(stderr, "peers key not found");
-        exit(1);
+    *peers = (PeersList){ NULL, 0 };
+    curl = curl_easy_init();
+    if (curl == NULL) {
+        return tracker_set_error("HTTP request failed");
     }
-    size_t raw_addresses_string_length = decodedResponse.val.dict[peers_index].val.val.length;
-    char *raw_addresses_string = malloc(raw_addresses_string_length);
-    memcpy(raw_addresses_string, decodedResponse.val.dict[peers_index].val.val.str, raw_addresses_string_length);
 
-    // Parse peers
-    PeersList peersList;
-    peersList.count = raw_addresses_string_length / 6;
-    peersList.peers = malloc(peersList.count * sizeof(Peer));
+    Response response = { .on_peer = on_peer, .context = context };
+    bencode_stream_init(&response.stream, tracker_event, &response);
 
-    for (size_t i = 0; i < peersList.count; ++i) {
-        struct in_addr ip_addr;
-        memcpy(&ip_addr, &raw_addresses_string[i * 6], 4);
-        inet_ntop(AF_INET, &ip_addr, peersList.peers[i].ip, INET_ADDRSTRLEN);
-        uint16_t port;
-        memcpy(&port, &raw_addresses_string[i * 6 + 4], 2);
-        peersList.peers[i].port = ntohs(port);
+    // URL setup
+    char *safe_info_hash = curl_easy_escape(curl, info.info_hash, 20); // Info hash is 20 bytes long
+
+    // Calculate the length of the URL string
+    const char *event_key = totals.event != NULL ? "&event=" : "";
+    const char *event = totals.event != NULL ? totals.event : "";
+    size_t url_length = snprintf(NULL, 0, "%s?peer_id=%s&info_hash=%s&port=%s&left=%zu&downloaded=%zu&uploaded=%zu&compact=%c%s%s", 
+                                info.url, peer_id, safe_info_hash, port, totals.left, totals.downloaded, totals.uploaded, compact,
+                                event_key, event);
+    char *url = malloc(url_length + 1); // Add 1 for null terminator
+
+    int status;
+    if (safe_info_hash == NULL || url == NULL) {
+        status = tracker_set_error("Out of memory building the announce URL");
+    } else {
+        // Construct the URL string
+        snprintf(url, url_length + 1, "%s?peer_id=%s&info_hash=%s&port=%s&left=%zu&downloaded=%zu&uploaded=%zu&compact=%c%s%s", 
+                info.url, peer_id, safe_info_hash, port, totals.left, totals.downloaded, totals.uploaded, compact,
+                event_key, event);
+
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_chunk);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) &response);
+
+        result = curl_easy_perform(curl);
+        status = check_response(result, &response, &totals);
     }
 
     curl_easy_cleanup(curl);
     free(url); // Free the allocated memory for the URL
     curl_free(safe_info_hash); // Free the escaped info_hash
-    free(response.string);
-    free(raw_addresses_string);
+    bencode_stream_free(&response.stream);
 
-    return peersList;
+    if (status < 0) {
+        free_peers(response.peers); // Whoever got them through 'on_peer' already keeps them
+        return -1;
+    }
+    *peers = response.peers;
+    return 0;
 }
 
 size_t write_chunk(void *data, size_t size, size_t nmemb, void *userdata) {
     size_t real_size = size * nmemb;
 
+    // Returning a short count makes curl abort the transfer with CURLE_WRITE_ERROR
     Response *response = (Response *) userdata;
-    char *ptr = realloc(response->string, response->size + real_size + 1);
-    if(ptr == NULL) {
-        fprintf(stderr, "Memory allocation failed");
-        return CURLE_WRITE_ERROR;
+    if (bencode_stream_feed(&response->stream, data, real_size) < 0) {
+        return 0;
     }
 
-    response->string = ptr;
-    memcpy(&(response->string[response->size]), data, real_size);
-    response->size += real_size;
-    response->string[response->size] = '\0';
-
     return real_size;
 }
 
@@ -103,19 +211,20 @@ void print_peers(PeersList peers) {
 }
 
 char* peers_list_to_string(PeersList peers) {
-    char *result = NULL;
-    size_t result_size = 0;
-    char buffer[256];
+    Buffer buffer = {0};
 
+    // "255.255.255.255:65535\n" is at most 22 bytes, reserve once up front
+    if (buffer_reserve(&buffer, peers.count * 22) < 0) {
+        return NULL;
+    }
     for (size_t i = 0; i < peers.count; ++i) {
-        size_t peer_info_size = snprintf(buffer, sizeof(buffer), "%s:%d\n", peers.peers[i].ip, peers.peers[i].port);
-        result_size += peer_info_size;
-
-        result = (char*)realloc(result, result_size + 1);
-        strcat(result, buffer);
+        if (buffer_printf(&buffer, "%s:%d\n", peers.peers[i].ip, peers.peers[i].port) < 0) {
+            buffer_free(&buffer);
+            return NULL;
+        }
     }
 
-    return result;
+    return buffer.data;
 }
 
 void free_peers(PeersList peers) {
@@ -9,6 +9,7 @@
 #include <curl/curl.h>
 #include "decode.h"
 #include "info.h"
+#include "stream.h"
 
 typedef struct {
     char ip[INET_ADDRSTRLEN];
@@ -20,15 +21,53 @@ typedef struct {
     size_t count;
 } PeersList;
 
+// Which field of the tracker response the parser is currently inside
+typedef enum {
+    TRACKER_FIELD_OTHER,
+    TRACKER_FIELD_PEERS,    // "peers", compact string or list of dicts
+    TRACKER_FIELD_FAILURE,  // "failure reason"
+    TRACKER_FIELD_PEER_IP,  // "ip" of a non-compact peer entry
+    TRACKER_FIELD_PEER_PORT // "port" of a non-compact peer entry
+} TrackerField;
+
+// Receives every peer as soon as the tracker response has delivered it, while the rest still streams in
+typedef void (*PeerCallback)(void *context, const Peer *peer);
+
+// Tracker response state, parsed chunk by chunk as curl delivers the body
 typedef struct {
-    char *string;
-    size_t size;
+    BencodeStream stream;
+    TrackerField field;       // Top-level field named by the last key
+    TrackerField peer_field;  // Field of the non-compact peer entry being read
+    Peer pending;             // Non-compact peer entry being assembled
+    PeersList peers;
+    size_t peers_capacity;
+    bool have_peers;
+    char failure[256];
+    PeerCallback on_peer;     // May be NULL
+    void *context;
 } Response;
 
-// return a list of peers addresses
-PeersList get_peers(MetaInfo info);
+// What an announce reports about our side of the torrent
+typedef struct {
+    size_t uploaded;          // Bytes sent to peers so far
+    size_t downloaded;        // Bytes received from peers so far
+    size_t left;              // Bytes still missing, 0 once we seed
+    const char *event;        // "completed", "stopped", or NULL for a regular announce
+} AnnounceTotals;
+
+// fetch the list of peers addresses into 'peers'. returns 0, or -1 when the announce failed (see tracker_error),
+// 'peers' is empty then
+int get_peers(MetaInfo info, PeersList *peers);
+
+// get_peers, also handing every peer to 'on_peer' the moment it is parsed, so connecting to the first
+// ones overlaps with receiving the rest ('peers' still gets them all). 'totals' is what the
+// announce reports, a "stopped" one may get no peers back
+int get_peers_streaming(MetaInfo info, AnnounceTotals totals, PeerCallback on_peer, void *context, PeersList *peers);
+
+// why the last get_peers call on this thread failed
+const char *tracker_error(void);
 
-// writes incoming data to a string
+// feeds incoming data to the response parser
 size_t write_chunk(void *data, size_t size, size_t nmemb, void *userdata);
 
 // print peers addresses list (useless with ncurses)
@@ -0,0 +1,236 @@
+#include "wire.h"
+#include "peer.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+int wire_init(PeerWire *wire, int fd) {
+    memset(wire, 0, sizeof(*wire));
+    wire->fd = fd;
+    wire->ring = malloc(WIRE_RING_SIZE);
+    if (wire->ring == NULL) {
+        return -1;
+    }
+    wire->capacity = WIRE_RING_SIZE;
+    return 0;
+}
+
+void wire_free(PeerWire *wire) {
+    free(wire->ring);
+    free(wire->scratch);
+    wire->ring = wire->scratch = NULL;
+    wire->capacity = wire->scratch_capacity = wire->length = wire->head = 0;
+    wire->target = NULL;
+}
+
+// Copy 'length' bytes starting 'offset' bytes into the unparsed ones, without consuming them
+static void copy_out(const PeerWire *wire, size_t offset, void *data, size_t length) {
+    size_t start = (wire->head + offset) & (wire->capacity - 1);
+    size_t first = wire->capacity - start < length ? wire->capacity - start : length;
+    memcpy(data, wire->ring + start, first);
+    memcpy((char *)data + first, wire->ring, length - first);
+}
+
+static void consume(PeerWire *wire, size_t length) {
+    wire->length -= length;
+    // An empty ring starts over at the front, so the next messages are less likely to wrap
+    wire->head = wire->length == 0 ? 0 : (wire->head + length) & (wire->capacity - 1);
+}
+
+// Make room for a message of 'needed' bytes, unwrapping what is buffered into the bigger ring
+static int grow(PeerWire *wire, size_t needed) {
+    size_t capacity = wire->capacity;
+    while (capacity < needed) capacity *= 2;
+    char *ring = malloc(capacity);
+    if (ring == NULL) {
+        return -1;
+    }
+    copy_out(wire, 0, ring, wire->length);
+    free(wire->ring);
+    wire->ring = ring;
+    wire->capacity = capacity;
+    wire->head = 0;
+    return 0;
+}
+
+// The 'length' bytes at 'offset' as one run: in place when they do not wrap, copied to the scratch otherwise
+static const char *contiguous(PeerWire *wire, size_t offset, size_t length) {
+    size_t start = (wire->head + offset) & (wire->capacity - 1);
+    if (start + length <= wire->capacity) {
+        return wire->ring + start;
+    }
+    if (length > wire->scratch_capacity) {
+        char *scratch = realloc(wire->scratch, length);
+        if (scratch == NULL) {
+            return NULL;
+        }
+        wire->scratch = scratch;
+        wire->scratch_capacity = length;
+    }
+    copy_out(wire, offset, wire->scratch, length);
+    return wire->scratch;
+}
+
+ssize_t wire_fill(PeerWire *wire) {
+    struct iovec buffers[3];
+    int count = 0;
+    // The payload being placed comes first, whatever follows it lands in the ring
+    bool placing = wire->target != NULL && wire->length == 0;
+    if (placing) {
+        buffers[count++] = (struct iovec){ wire->target + wire->placed, wire->frame.length - wire->placed };
+    }
+    size_t space = wire->capacity - wire->length;
+    size_t tail = (wire->head + wire->length) & (wire->capacity - 1);
+    size_t first = wire->capacity - tail < space ? wire->capacity - tail : space;
+    if (first > 0) {
+        buffers[count++] = (struct iovec){ wire->ring + tail, first };
+    }
+    if (space > first) {
+        buffers[count++] = (struct iovec){ wire->ring, space - first };
+    }
+    if (count == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    ssize_t received;
+    do {
+        received = readv(wire->fd, buffers, count);
+    } while (received < 0 && errno == EINTR);
+    if (received <= 0) {
+        return received;
+    }
+
+    size_t rest = received;
+    if (placing) {
+        size_t placed = rest < buffers[0].iov_len ? rest : buffers[0].iov_len;
+        wire->placed += placed;
+        rest -= placed;
+    }
+    wire->length += rest;
+    return received;
+}
+
+int wire_next(PeerWire *wire, WireFrame *frame, WireDestination destination, void *context) {
+    if (wire->target != NULL) {
+        // Bytes of the payload that were read before its header was parsed
+        uint32_t missing = wire->frame.length - wire->placed;
+        uint32_t take = wire->length < missing ? wire->length : missing;
+        copy_out(wire, 0, wire->target + wire->placed, take);
+        consume(wire, take);
+        wire->placed += take;
+        if (wire->placed < wire->frame.length) {
+            return 0;
+        }
+        *frame = wire->frame;
+        wire->target = NULL;
+        return 1;
+    }
+
+    if (wire->length < LENGTH_PREFIX_SIZE) {
+        return 0;
+    }
+    uint32_t size;
+    copy_out(wire, 0, &size, LENGTH_PREFIX_SIZE);
+    size = ntohl(size);
+    if (size > MAX_MESSAGE_LENGTH) {
+        return -1;
+    }
+    if (size == 0) {
+        consume(wire, LENGTH_PREFIX_SIZE);
+        *frame = (WireFrame){ 0 };
+        return 1;
+    }
+
+    // A block still on the way, or wrapped around the ring, goes to where it belongs instead
+    size_t whole = LENGTH_PREFIX_SIZE + (size_t)size;
+    bool in_place = wire->length >= whole && ((wire->head + whole) <= wire->capacity);
+    if (destination != NULL && !in_place && size > 9 && wire->length >= LENGTH_PREFIX_SIZE + 9) {
+        char header[LENGTH_PREFIX_SIZE + 9];
+        copy_out(wire, 0, header, sizeof(header));
+        uint32_t fields[2];
+        memcpy(fields, header + LENGTH_PREFIX_SIZE + 1, sizeof(fields));
+        WireFrame piece = { size, PIECE, NULL, ntohl(fields[0]), ntohl(fields[1]), size - 9, NULL };
+        char *target = header[LENGTH_PREFIX_SIZE] == PIECE ?
+                       destination(context, piece.piece_index, piece.begin, piece.length) : NULL;
+        if (target != NULL) {
+            consume(wire, sizeof(header));
+            piece.data = target;
+            wire->frame = piece;
+            wire->target = target;
+            wire->placed = 0;
+            return wire_next(wire, frame, destination, context);
+        }
+    }
+
+    if (whole > wire->capacity && grow(wire, whole) < 0) {
+        return -1;
+    }
+    if (wire->length < whole) {
+        return 0;
+    }
+    const char *payload = contiguous(wire, LENGTH_PREFIX_SIZE, size);
+    if (payload == NULL) {
+        return -1;
+    }
+    consume(wire, whole);
+    *frame = (WireFrame){ .size = size, .id = payload[0], .payload = payload };
+    if (frame->id == PIECE && size >= 9) {
+        uint32_t fields[2];
+        memcpy(fields, payload + 1, sizeof(fields));
+        frame->piece_index = ntohl(fields[0]);
+        frame->begin = ntohl(fields[1]);
+        frame->length = size - 9;
+        frame->data = payload + 9;
+    }
+    return 1;
+}
+
+int wire_detach(PeerWire *wire) {
+    if (wire->target == NULL || wire->target == wire->scratch) {
+        return 0;
+    }
+    if (wire->frame.length > wire->scratch_capacity) {
+        char *scratch = realloc(wire->scratch, wire->frame.length);
+        if (scratch == NULL) {
+            return -1;
+        }
+        wire->scratch = scratch;
+        wire->scratch_capacity = wire->frame.length;
+    }
+    wire->target = wire->scratch;
+    wire->frame.data = wire->scratch;
+    return 0;
+}
+
+int wire_take(PeerWire *wire, void *data, size_t length) {
+    if (wire->length < length) {
+        return 0;
+    }
+    copy_out(wire, 0, data, length);
+    consume(wire, length);
+    return 1;
+}
+
+int wire_read(PeerWire *wire, WireFrame *frame, WireDestination destination, void *context) {
+    for (;;) {
+        int status = wire_next(wire, frame, destination, context);
+        if (status != 0) {
+            if (status < 0) fprintf(stderr, "Peer sent a malformed message\n");
+            return status;
+        }
+        ssize_t received = wire_fill(wire);
+        if (received == 0) {
+            fprintf(stderr, "Peer closed the connection\n");
+            return -1;
+        }
+        if (received < 0) {
+            perror("Failed to read from peer");
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define WIRE_RING_SIZE (128 * 1024)
+// Largest message accepted from a peer (a BITFIELD of 8M pieces, far more than a PIECE)
+#define MAX_MESSAGE_LENGTH (1 << 20)
+
+// Where the data of the PIECE message for ('piece_index', 'begin', 'length') should go, or NULL to get
+// it in the ring like any other message. only return memory that has room for 'length' bytes
+typedef char *(*WireDestination)(void *context, uint32_t piece_index, uint32_t begin, uint32_t length);
+
+// One complete message
+typedef struct WireFrame {
+    uint32_t size;             // Bytes after the length prefix, 0 for a keep-alive
+    uint8_t id;
+    const char *payload;       // The message (id first), NULL for a PIECE that went to its destination
+    uint32_t piece_index;      // PIECE only: the block it carries
+    uint32_t begin;
+    uint32_t length;
+    const char *data;          // PIECE only: the block's bytes, in the ring or at their destination
+} WireFrame;
+
+// The receiving side of one peer connection. bytes are read into a ring as many at a time as the
+// socket has, and a PIECE payload whose header is in goes straight to its destination with readv
+typedef struct PeerWire {
+    int fd;
+    char *ring;                // 'capacity' bytes (a power of two), 'length' of them from 'head' unparsed
+    size_t capacity;
+    size_t head;
+    size_t length;
+    char *scratch;             // A message that wraps around the end of the ring, made contiguous
+    size_t scratch_capacity;
+    char *target;              // The PIECE payload being placed, 'placed' of 'frame.length' bytes in
+    uint32_t placed;
+    WireFrame frame;
+} PeerWire;
+
+// starts reading 'fd'. returns 0 on success and -1 if the ring could not be allocated
+int wire_init(PeerWire *wire, int fd);
+
+// frees the buffers (the socket stays open)
+void wire_free(PeerWire *wire);
+
+// one read of whatever the socket has. returns the number of bytes read, 0 at end of stream and -1 on
+// error (errno tells, EAGAIN for a non-blocking socket with nothing to read)
+ssize_t wire_fill(PeerWire *wire);
+
+// takes the next complete message out of what has been read, asking 'destination' (may be NULL) where
+// PIECE data goes. the frame stays valid until the next wire call. returns 1 for a message, 0 if more
+// bytes are needed and -1 if the peer sent something too long to be a message
+int wire_next(PeerWire *wire, WireFrame *frame, WireDestination destination, void *context);
+
+// stops placing the PIECE payload in progress (if any) where it was going, because that memory is
+// about to go away: the rest of it is read into the wire's own scratch instead. returns -1 if out of memory
+int wire_detach(PeerWire *wire);
+
+// copies and consumes 'length' raw bytes (the handshake) if they are all in. returns 1 if they were, 0 otherwise
+int wire_take(PeerWire *wire, void *data, size_t length);
+
+// wire_next on a blocking socket: waits for the next message, keep-alives included.
+// returns 1 for a message and -1 if the connection broke or the peer misbehaved
+int wire_read(PeerWire *wire, WireFrame *frame, WireDestination destination, void *context);
+
+#endif
@@ -0,0 +1,251 @@
+// Storage layer checks: pieces that span files, and zero-length files at the start, middle and end
+#include "bencode.h"
+#include "info.h"
+#include "storage.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PIECE_LENGTH 4
+
+static int failures = 0;
+
+#define CHECK(condition)                                                        \
+    do {                                                                        \
+        if (!(condition)) {                                                     \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                         \
+        }                                                                       \
+    } while (0)
+
+typedef struct TestFile {
+    const char *path;
+    size_t length;
+} TestFile;
+
+// Files in torrent order: 18 bytes of content in 5 pieces, the piece boundaries fall inside 'a', 'b' and 'c'
+static const TestFile files[] = {
+    { "empty0", 0 }, { "a", 5 }, { "empty1", 0 }, { "b", 10 }, { "empty2", 0 }, { "c", 3 }, { "empty3", 0 },
+};
+#define NUM_FILES (sizeof(files) / sizeof(files[0]))
+#define TOTAL_LENGTH 18
+#define NUM_PIECES ((TOTAL_LENGTH + PIECE_LENGTH - 1) / PIECE_LENGTH)
+
+// Bencode a torrent of 'count' files, piece hashes are made up since nothing is verified here
+static int build_torrent(Buffer *torrent, const TestFile *files, size_t count, size_t piece_length) {
+    BencodeWriter writer;
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += files[i].length;
+    }
+    size_t hashes_length = (total + piece_length - 1) / piece_length * SHA1_DIGEST_LENGTH;
+    char *hashes = calloc(1, hashes_length + 1);
+    if (hashes == NULL) {
+        return -1;
+    }
+    bencode_writer_init(&writer, buffer_sink(torrent));
+    bencode_write_dict_start(&writer);
+    bencode_write_string(&writer, "announce", 8);
+    bencode_write_string(&writer, "http://localhost", 16);
+    bencode_write_string(&writer, "info", 4);
+    bencode_write_dict_start(&writer);
+    bencode_write_string(&writer, "files", 5);
+    bencode_write_list_start(&writer);
+    for (size_t i = 0; i < count; i++) {
+        bencode_write_dict_start(&writer);
+        bencode_write_string(&writer, "length", 6);
+        bencode_write_int(&writer, files[i].length);
+        bencode_write_string(&writer, "path", 4);
+        bencode_write_list_start(&writer);
+        bencode_write_string(&writer, files[i].path, strlen(files[i].path));
+        bencode_write_end(&writer);
+        bencode_write_end(&writer);
+    }
+    bencode_write_end(&writer);
+    bencode_write_string(&writer, "name", 4);
+    bencode_write_string(&writer, "spans", 5);
+    bencode_write_string(&writer, "piece length", 12);
+    bencode_write_int(&writer, piece_length);
+    bencode_write_string(&writer, "pieces", 6);
+    bencode_write_string(&writer, hashes, hashes_length);
+    bencode_write_end(&writer);
+    bencode_write_end(&writer);
+    free(hashes);
+    return bencode_writer_finish(&writer);
+}
+
+// Index of a file in 'files' by name
+static size_t file_index(const MetaInfo *info, const char *path) {
+    for (size_t i = 0; i < info->num_files; i++) {
+        if (strcmp(info->files[i].path, path) == 0) {
+            return i;
+        }
+    }
+    return (size_t)-1;
+}
+
+static void test_map_range(const MetaInfo *info) {
+    FileExtent extents[8];
+    size_t a = file_index(info, "a"), b = file_index(info, "b"), c = file_index(info, "c");
+
+    // Inside one file, then across a boundary with a zero-length file in between
+    CHECK(storage_map_range(info, 0, 0, 4, extents, 8) == 1);
+    CHECK(extents[0].file_index == a && extents[0].file_offset == 0 && extents[0].length == 4);
+    CHECK(storage_map_range(info, 1, 0, 4, extents, 8) == 2);
+    CHECK(extents[0].file_index == a && extents[0].file_offset == 4 && extents[0].length == 1);
+    CHECK(extents[1].file_index == b && extents[1].file_offset == 0 && extents[1].length == 3);
+    CHECK(storage_map_range(info, 3, 0, 4, extents, 8) == 2);
+    CHECK(extents[0].file_index == b && extents[0].file_offset == 7 && extents[0].length == 3);
+    CHECK(extents[1].file_index == c && extents[1].file_offset == 0 && extents[1].length == 1);
+
+    // The short last piece, and a range starting right at a file boundary
+    CHECK(storage_map_range(info, 4, 0, 2, extents, 8) == 1);
+    CHECK(extents[0].file_index == c && extents[0].file_offset == 1 && extents[0].length == 2);
+    CHECK(storage_map_range(info, 1, 1, 3, extents, 8) == 1);
+    CHECK(extents[0].file_index == b && extents[0].file_offset == 0 && extents[0].length == 3);
+
+    // More extents than room: the first ones come back, the rest is mapped from where they end
+    CHECK(storage_map_range(info, 1, 0, 4, extents, 1) == 1);
+    CHECK(extents[0].file_index == a && extents[0].length == 1);
+
+    // Out of bounds
+    CHECK(storage_map_range(info, NUM_PIECES, 0, 1, extents, 8) == -1);
+    CHECK(storage_map_range(info, 4, 1, 2, extents, 8) == -1);
+    CHECK(storage_map_range(info, 0, 0, 0, extents, 8) == 0);
+}
+
+// Read a whole file written by the storage layer, returns its length or -1
+static long read_file(const char *directory, const char *path, char *data, size_t size) {
+    char full[PATH_MAX];
+    snprintf(full, sizeof(full), "%s/%s", directory, path);
+    FILE *file = fopen(full, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+    long length = fread(data, 1, size, file);
+    fclose(file);
+    return length;
+}
+
+static void test_write(const MetaInfo *info, const char *directory) {
+    char content[TOTAL_LENGTH];
+    for (size_t i = 0; i < TOTAL_LENGTH; i++) {
+        content[i] = 'A' + i;
+    }
+
+    Storage storage;
+    CHECK(storage_open(&storage, info, directory) == 0);
+    for (size_t piece = 0; piece < NUM_PIECES; piece++) {
+        char *data = content + piece * PIECE_LENGTH;
+        size_t size = info_piece_size(info, piece);
+        if (piece % 2 == 0) {
+            CHECK(storage_write_piece(&storage, piece, data, size) == 0);
+            continue;
+        }
+        // One buffer per byte, so buffers get split at file boundaries too
+        struct iovec buffers[PIECE_LENGTH];
+        for (size_t i = 0; i < size; i++) {
+            buffers[i] = (struct iovec){ data + i, 1 };
+        }
+        CHECK(storage_writev(&storage, piece, buffers, size) == 0);
+    }
+    // A block across the b/c boundary, written again with different bytes
+    CHECK(storage_write_block(&storage, 3, 2, "xy", 2) == 0);
+    content[14] = 'x';
+    content[15] = 'y';
+    CHECK(storage_write_block(&storage, 4, 1, "zz", 2) == -1 && errno == EINVAL);
+    CHECK(storage_write_piece(&storage, 4, content, 3) == -1 && errno == EINVAL);
+    storage_close(&storage);
+
+    size_t offset = 0;
+    for (size_t i = 0; i < NUM_FILES; i++) {
+        char data[TOTAL_LENGTH + 1];
+        long length = read_file(directory, files[i].path, data, sizeof(data));
+        CHECK(length == (long)files[i].length);
+        CHECK(length < 0 || memcmp(data, content + offset, files[i].length) == 0);
+        offset += files[i].length;
+    }
+}
+
+// One 40-byte piece over 20 two-byte files: more extents than storage maps per call
+static void test_many_files(const char *directory) {
+    static const char *names[] = { "f00", "f01", "f02", "f03", "f04", "f05", "f06", "f07", "f08", "f09",
+                                   "f10", "f11", "f12", "f13", "f14", "f15", "f16", "f17", "f18", "f19" };
+    TestFile small[20];
+    for (size_t i = 0; i < 20; i++) {
+        small[i] = (TestFile){ names[i], 2 };
+    }
+    Buffer torrent = {0};
+    MetaInfo info;
+    if (build_torrent(&torrent, small, 20, 64) < 0 || info_extract(torrent.data, torrent.length, &info) < 0) {
+        fprintf(stderr, "Failed to build the many-file torrent: %s\n", info_error());
+        failures++;
+        buffer_free(&torrent);
+        return;
+    }
+
+    char content[40];
+    for (size_t i = 0; i < sizeof(content); i++) {
+        content[i] = 'a' + i % 26;
+    }
+    FileExtent extents[4];
+    CHECK(storage_map_range(&info, 0, 0, 40, extents, 4) == 4);
+    CHECK(extents[3].file_offset == 0 && extents[3].length == 2);
+
+    Storage storage;
+    CHECK(storage_open(&storage, &info, directory) == 0);
+    CHECK(storage_write_piece(&storage, 0, content, sizeof(content)) == 0);
+    storage_close(&storage);
+    for (size_t i = 0; i < 20; i++) {
+        char data[4], path[PATH_MAX];
+        CHECK(read_file(directory, names[i], data, sizeof(data)) == 2 && memcmp(data, content + i * 2, 2) == 0);
+        snprintf(path, sizeof(path), "%s/%s", directory, names[i]);
+        unlink(path);
+    }
+    free_info(info);
+    buffer_free(&torrent);
+}
+
+// Remove the files written under 'directory' and the directory itself
+static void remove_directory(const char *directory) {
+    char path[PATH_MAX];
+    for (size_t i = 0; i < NUM_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/%s", directory, files[i].path);
+        unlink(path);
+    }
+    rmdir(directory);
+}
+
+int main(void) {
+    Buffer torrent = {0};
+    MetaInfo info;
+    if (build_torrent(&torrent, files, NUM_FILES, PIECE_LENGTH) < 0 || info_extract(torrent.data, torrent.length, &info) < 0) {
+        fprintf(stderr, "Failed to build the test torrent: %s\n", info_error());
+        return 1;
+    }
+    CHECK(info.num_pieces == NUM_PIECES && info.length == TOTAL_LENGTH && info.num_files == NUM_FILES);
+
+    char directory[] = "/tmp/storage-test-XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    test_map_range(&info);
+    test_write(&info, directory);
+    test_many_files(directory);
+
+    remove_directory(directory);
+    free_info(info);
+    buffer_free(&torrent);
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("storage: all checks passed\n");
+    return 0;
+}